@@ -6,6 +6,10 @@
 #include "bserv/common.hpp"
 
 #include "rendering.h"
+#include "counters.h"
+#include "purchases.h"
+#include "booking.h"
+#include "idempotency.h"
 #include "handlers.h"
 
 void show_usage(const bserv::server_config& config) {
@@ -23,6 +27,10 @@ void show_config(const bserv::server_config& config) {
 		<< "\nrotation: " << config.get_log_rotation_size() / 1024 / 1024
 		<< "\nlog path: " << config.get_log_path()
 		<< "\ndb-conn: " << config.get_num_db_conn()
+		<< "\nconn-timeout: " << config.get_db_conn_timeout() << "ms"
+		<< "\nws-high-water-mark: " << config.get_ws_high_water_mark()
+		<< "\nws-slow-consumer: " << (config.get_ws_drop_slow() ? "drop" : "close")
+		<< "\nws-deflate: " << (config.get_ws_deflate() ? "on" : "off")
 		<< "\nconn-str: " << config.get_db_conn_str() << std::endl;
 }
 
@@ -44,10 +52,49 @@ int main(int argc, char* argv[]) {
 				config.set_num_threads((int)config_obj["thread-num"].as_int64());
 			if (config_obj.contains("conn-num"))
 				config.set_num_db_conn((int)config_obj["conn-num"].as_int64());
+			if (config_obj.contains("conn-timeout"))
+				config.set_db_conn_timeout((int)config_obj["conn-timeout"].as_int64());
 			if (config_obj.contains("conn-str"))
 				config.set_db_conn_str(config_obj["conn-str"].as_string().c_str());
 			if (config_obj.contains("log-dir"))
 				config.set_log_path(std::string{ config_obj["log-dir"].as_string() });
+			if (config_obj.contains("ws-high-water-mark"))
+				config.set_ws_high_water_mark((std::size_t)config_obj["ws-high-water-mark"].as_int64());
+			if (config_obj.contains("ws-slow-consumer"))
+				config.set_ws_drop_slow(config_obj["ws-slow-consumer"].as_string() != "close");
+			if (config_obj.contains("ws-deflate"))
+				config.set_ws_deflate(config_obj["ws-deflate"].as_bool());
+			if (config_obj.contains("ws-deflate-window-bits"))
+				config.set_ws_deflate_window_bits((int)config_obj["ws-deflate-window-bits"].as_int64());
+			if (config_obj.contains("ws-deflate-mem-level"))
+				config.set_ws_deflate_mem_level((int)config_obj["ws-deflate-mem-level"].as_int64());
+			if (config_obj.contains("ws-deflate-server-no-context-takeover"))
+				config.set_ws_deflate_server_no_context_takeover(
+					config_obj["ws-deflate-server-no-context-takeover"].as_bool());
+			if (config_obj.contains("ws-deflate-client-no-context-takeover"))
+				config.set_ws_deflate_client_no_context_takeover(
+					config_obj["ws-deflate-client-no-context-takeover"].as_bool());
+			if (config_obj.contains("count-reconcile")) {
+				std::size_t capacity = config_obj.contains("count-capacity")
+					? (std::size_t)config_obj["count-capacity"].as_int64() : 10000;
+				init_counters((int)config_obj["count-reconcile"].as_int64(), capacity);
+				init_purchases((int)config_obj["count-reconcile"].as_int64(), capacity);
+			}
+			if (config_obj.contains("idempotency-capacity"))
+				init_idempotency((std::size_t)config_obj["idempotency-capacity"].as_int64(),
+					config_obj.contains("idempotency-ttl")
+					? (int)config_obj["idempotency-ttl"].as_int64() : 600);
+			if (config_obj.contains("booking-shards"))
+				init_booking((int)config_obj["booking-shards"].as_int64(),
+					config_obj.contains("booking-flush-ms")
+					? (int)config_obj["booking-flush-ms"].as_int64() : 50,
+					config_obj.contains("hold-minutes")
+					? (int)config_obj["hold-minutes"].as_int64() : 10,
+					config_obj.contains("hold-journal")
+					? config_obj["hold-journal"].as_string().c_str() : "",
+					config.get_db_conn_str(),
+					config_obj.contains("booking-conn-num")
+					? (int)config_obj["booking-conn-num"].as_int64() : 2);
 			if (!config_obj.contains("template_root")) {
 				std::cerr << "`template_root` must be specified" << std::endl;
 				return EXIT_FAILURE;
@@ -71,11 +118,11 @@ int main(int argc, char* argv[]) {
 		bserv::make_path("/hello", &hello,
 			bserv::placeholders::response,
 			bserv::placeholders::session),
-		bserv::make_path("/register", &user_register,
+		bserv::make_path(boost::beast::http::verb::post, "/register", &user_register,
 			bserv::placeholders::request,
 			bserv::placeholders::json_params,
 			bserv::placeholders::db_connection_ptr),
-		bserv::make_path("/login", &user_login,
+		bserv::make_path(boost::beast::http::verb::post, "/login", &user_login,
 			bserv::placeholders::request,
 			bserv::placeholders::json_params,
 			bserv::placeholders::db_connection_ptr,
@@ -91,6 +138,9 @@ int main(int argc, char* argv[]) {
 			bserv::placeholders::json_params),
 		bserv::make_path("/echo", &echo,
 			bserv::placeholders::json_params),
+		bserv::make_path("/db_stats", &db_stats,
+			bserv::placeholders::session,
+			bserv::placeholders::db_connection_manager_ptr),
 
 		// serving static files
 		bserv::make_path("/statics/<path>", &serve_static_files,
@@ -110,17 +160,34 @@ int main(int argc, char* argv[]) {
 		bserv::make_path("/form_logout", &form_logout,
 			bserv::placeholders::session,
 			bserv::placeholders::response),
-		bserv::make_path("/update_user_info", &update_user_info,
+		bserv::make_path(boost::beast::http::verb::post, "/update_user_info", &update_user_info,
 			bserv::placeholders::request,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::json_params,
 			bserv::placeholders::session,
-			bserv::placeholders::response),
-		bserv::make_path("/flights", &view_flights,
+			bserv::placeholders::response,
+			bserv::placeholders::yield),
+		bserv::make_path("/flights", &view_flights_keyset,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::response,
-			std::string{"1"}),
+			bserv::placeholders::json_storage,
+			std::string{"first"},
+			std::string{""}),
+		bserv::make_path("/flights/after/<str>", &view_flights_keyset,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::response,
+			bserv::placeholders::json_storage,
+			std::string{"after"},
+			bserv::placeholders::_1),
+		bserv::make_path("/flights/before/<str>", &view_flights_keyset,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::response,
+			bserv::placeholders::json_storage,
+			std::string{"before"},
+			bserv::placeholders::_1),
 		bserv::make_path("/flights/<int>", &view_flights,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
@@ -132,7 +199,7 @@ int main(int argc, char* argv[]) {
 			bserv::placeholders::json_params,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
-			std::string{"1"}),
+			1),
 		bserv::make_path("/flights/search/<int>", &search_flights,
 			bserv::placeholders::request,
 			bserv::placeholders::response,
@@ -140,17 +207,60 @@ int main(int argc, char* argv[]) {
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::_1),
-		bserv::make_path("/flights/purchase", &make_purchase,
+		bserv::make_path(boost::beast::http::verb::post, "/flights/purchase", &make_purchase,
+			bserv::placeholders::request,
+			bserv::placeholders::response,
+			bserv::placeholders::json_params,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::yield),
+		bserv::make_path(boost::beast::http::verb::post, "/flights/purchase/batch", &purchase_batch,
+			bserv::placeholders::request,
+			bserv::placeholders::json_params,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::yield),
+		bserv::make_path(boost::beast::http::verb::post, "/flights/waitlist", &join_waitlist,
 			bserv::placeholders::request,
 			bserv::placeholders::response,
 			bserv::placeholders::json_params,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session),
-		bserv::make_path("/myorders", &view_orders,
+		bserv::make_path(boost::beast::http::verb::post, "/flights/hold", &hold_seat,
+			bserv::placeholders::request,
+			bserv::placeholders::response,
+			bserv::placeholders::json_params,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::yield),
+		bserv::make_path(boost::beast::http::verb::post, "/flights/confirm", &confirm_seat,
+			bserv::placeholders::request,
+			bserv::placeholders::response,
+			bserv::placeholders::json_params,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::yield),
+		bserv::make_path("/myorders", &view_orders_keyset,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::response,
+			bserv::placeholders::json_storage,
+			std::string{"first"},
+			std::string{""}),
+		bserv::make_path("/myorders/after/<str>", &view_orders_keyset,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::response,
-			std::string{"1"}),
+			bserv::placeholders::json_storage,
+			std::string{"after"},
+			bserv::placeholders::_1),
+		bserv::make_path("/myorders/before/<str>", &view_orders_keyset,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::response,
+			bserv::placeholders::json_storage,
+			std::string{"before"},
+			bserv::placeholders::_1),
 		bserv::make_path("/myorders/<int>", &view_orders,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
@@ -162,7 +272,7 @@ int main(int argc, char* argv[]) {
 			bserv::placeholders::json_params,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
-			std::string{"1"}),
+			1),
 		bserv::make_path("/myorders/search/<int>", &search_myorders,
 			bserv::placeholders::request,
 			bserv::placeholders::response,
@@ -170,17 +280,34 @@ int main(int argc, char* argv[]) {
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::_1),
-		bserv::make_path("/myorders/cancel", &cancel_orders,
+		bserv::make_path(boost::beast::http::verb::post, "/myorders/cancel", &cancel_orders,
 			bserv::placeholders::request,
 			bserv::placeholders::response,
 			bserv::placeholders::json_params,
 			bserv::placeholders::db_connection_ptr,
-			bserv::placeholders::session),
-		bserv::make_path("/users", &view_users,
+			bserv::placeholders::session,
+			bserv::placeholders::yield),
+		bserv::make_path("/users", &view_users_keyset,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::response,
-			std::string{"1"}),
+			bserv::placeholders::json_storage,
+			std::string{"first"},
+			std::string{""}),
+		bserv::make_path("/users/after/<str>", &view_users_keyset,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::response,
+			bserv::placeholders::json_storage,
+			std::string{"after"},
+			bserv::placeholders::_1),
+		bserv::make_path("/users/before/<str>", &view_users_keyset,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::response,
+			bserv::placeholders::json_storage,
+			std::string{"before"},
+			bserv::placeholders::_1),
 		bserv::make_path("/users/<int>", &view_users,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
@@ -197,11 +324,27 @@ int main(int argc, char* argv[]) {
 			bserv::placeholders::json_params,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session),
-		bserv::make_path("/flights_admin", &view_flights_admin,
+		bserv::make_path("/flights_admin", &view_flights_admin_keyset,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::response,
-			std::string{ "1" }),
+			bserv::placeholders::json_storage,
+			std::string{ "first" },
+			std::string{ "" }),
+		bserv::make_path("/flights_admin/after/<str>", &view_flights_admin_keyset,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::response,
+			bserv::placeholders::json_storage,
+			std::string{ "after" },
+			bserv::placeholders::_1),
+		bserv::make_path("/flights_admin/before/<str>", &view_flights_admin_keyset,
+			bserv::placeholders::db_connection_ptr,
+			bserv::placeholders::session,
+			bserv::placeholders::response,
+			bserv::placeholders::json_storage,
+			std::string{ "before" },
+			bserv::placeholders::_1),
 		bserv::make_path("/flights_admin/<int>", &view_flights_admin,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
@@ -210,33 +353,37 @@ int main(int argc, char* argv[]) {
 		bserv::make_path("/flights_admin/reset", &reset_flights_admin,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
-			bserv::placeholders::json_params,
-			bserv::placeholders::response),
+			bserv::placeholders::params,
+			bserv::placeholders::response,
+			bserv::placeholders::yield),
 		bserv::make_path("/flights_admin/cancel", &cancel_flights_admin,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::json_params,
-			bserv::placeholders::response),
+			bserv::placeholders::response,
+			bserv::placeholders::yield),
 		bserv::make_path("/flights_admin/add", &add_flights_admin,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
-			bserv::placeholders::json_params,
+			bserv::placeholders::body<flight_form>,
 			bserv::placeholders::response),
 		bserv::make_path("/orders", &view_orders,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::response,
-			std::string{ "1" }),
+			1),
 		bserv::make_path("/orders/<int>", &view_orders,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::response,
 			bserv::placeholders::_1),
 		bserv::make_path("/orders/delete", &delete_orders,
+			bserv::placeholders::request,
 			bserv::placeholders::db_connection_ptr,
 			bserv::placeholders::session,
 			bserv::placeholders::json_params,
-			bserv::placeholders::response),
+			bserv::placeholders::response,
+			bserv::placeholders::yield),
 		bserv::make_path("/orders/search_flight_number", &search_flight_number,
 			bserv::placeholders::request,
 			bserv::placeholders::response,
@@ -306,9 +453,13 @@ int main(int argc, char* argv[]) {
 		}
 		, {
 			// websocket example
-			bserv::make_path("/echo", &ws_echo,
+			bserv::without_compression(bserv::make_path("/echo", &ws_echo,
+				bserv::placeholders::session,
+				bserv::placeholders::websocket_server_ptr)),
+			bserv::make_path("/notifications", &ws_notifications,
 				bserv::placeholders::session,
-				bserv::placeholders::websocket_server_ptr)
+				bserv::placeholders::websocket_server_ptr,
+				bserv::placeholders::yield)
 		}
 	};
 
@@ -0,0 +1,887 @@
+#include "booking.h"
+
+#include <map>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <future>
+#include <atomic>
+#include <cstdio>
+
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+booking_engine::booking_engine(int num_shards, int flush_ms,
+	int hold_minutes, const std::string& journal_path,
+	const std::string& conn_str, int num_conns)
+	: pool_{ (std::size_t)std::max(1, std::min(num_shards,
+		(int)std::thread::hardware_concurrency())) },
+	flush_interval_{ flush_ms },
+	hold_duration_{ hold_minutes },
+	timer_{ pool_.get_executor() },
+	wheel_timer_{ pool_.get_executor() },
+	journal_path_{ journal_path },
+	journal_{ nullptr },
+	conn_str_{ conn_str },
+	num_conns_{ std::max(num_conns, 1) } {
+	for (int i = 0; i < num_shards; ++i) {
+		shards_.emplace_back(std::make_unique<shard>(pool_.get_executor()));
+	}
+	open_journal();
+}
+
+booking_engine::~booking_engine() {
+	// the users have been told that the pending orders are booked.
+	// `start` has returned before any change is made.
+	if (db_conn_mgr_ != nullptr) {
+		auto drained = std::make_shared<std::promise<void>>();
+		std::future<void> done = drained->get_future();
+		drain_all([drained] { drained->set_value(); });
+		if (done.wait_for(std::chrono::seconds{ 30 }) == std::future_status::timeout)
+			lgerror << "booking: the pending changes are not written before the shutdown";
+	}
+	pool_.stop();
+	pool_.join();
+	if (journal_ != nullptr) std::fclose(journal_);
+}
+
+void booking_engine::start(const booking_observer& observer) {
+	std::call_once(started_, [&] {
+		// the loads and flushes wait for a connection as long as it takes
+		db_conn_mgr_ = std::make_shared<bserv::db_connection_manager>(
+			conn_str_, num_conns_, std::chrono::milliseconds{ 0 });
+		observer_ = observer;
+		schedule_flush();
+		schedule_tick();
+	});
+}
+
+booking_engine::shard& booking_engine::shard_of(const std::string& flight_number) {
+	return *shards_[std::hash<std::string>{}(flight_number) % shards_.size()];
+}
+
+void booking_engine::request(const std::string& flight_number, booking_request&& req) {
+	shard& s = shard_of(flight_number);
+	boost::asio::post(s.strand,
+		[this, &s, flight_number, req = std::move(req)]() mutable {
+			submit(s, flight_number, std::move(req));
+		});
+}
+
+void booking_engine::submit(
+	shard& s, const std::string& flight_number, booking_request&& req) {
+	if (req.action == booking_action::commit || req.action == booking_action::rollback) {
+		settle(s, flight_number, req);
+		return;
+	}
+	flight_inventory& inventory = s.flights[flight_number];
+	if (!inventory.loaded) {
+		inventory.waiting.emplace_back(std::move(req));
+		if (!inventory.loading && inventory.unflushed == 0) load(s, flight_number);
+		return;
+	}
+	apply(s, flight_number, inventory, req);
+}
+
+void booking_engine::apply(
+	shard& s, const std::string& flight_number,
+	flight_inventory& inventory, booking_request& req) {
+	booking_status status;
+	long long available = inventory.available;
+	auto holder = inventory.holders.find(req.username);
+	auto hold = inventory.held.find(req.username);
+	bool booked = holder != inventory.holders.end()
+		|| inventory.reserving.count(req.username) != 0;
+	long long seats = req.seats;
+	switch (req.action) {
+	case booking_action::reserve:
+	case booking_action::confirm:
+	case booking_action::prepare:
+		if (booked) status = booking_status::already_booked;
+		// the held seat has been taken from `available` already
+		else if (hold != inventory.held.end()) {
+			if (inventory.available < seats - 1) {
+				status = booking_status::sold_out;
+				break;
+			}
+			inventory.available -= seats - 1;
+			// the hold is given back if the batch is rolled back
+			if (req.action == booking_action::prepare) {
+				inventory.reserving[req.username] = { seats, hold->second };
+				++inventory.unflushed;
+			}
+			else {
+				journal('C', { flight_number, req.username, hold->second });
+				inventory.holders.emplace(req.username, seats);
+			}
+			inventory.held.erase(hold);
+			status = booking_status::booked;
+		}
+		else if (req.action == booking_action::confirm) status = booking_status::not_held;
+		else if (inventory.available < seats) status = booking_status::sold_out;
+		else {
+			inventory.available -= seats;
+			if (req.action == booking_action::prepare) {
+				inventory.reserving[req.username] = { seats, std::nullopt };
+				++inventory.unflushed;
+			}
+			else inventory.holders.emplace(req.username, seats);
+			status = booking_status::booked;
+		}
+		break;
+	case booking_action::release:
+		if (holder == inventory.holders.end()) status = booking_status::not_booked;
+		else {
+			seats = holder->second;
+			inventory.available += seats;
+			inventory.holders.erase(holder);
+			status = booking_status::cancelled;
+		}
+		break;
+	case booking_action::hold:
+		if (booked) status = booking_status::already_booked;
+		else if (hold != inventory.held.end()) status = booking_status::held;
+		else if (inventory.available <= 0) status = booking_status::sold_out;
+		else {
+			hold_entry entry{ flight_number, req.username, clock::now() + hold_duration_ };
+			--inventory.available;
+			add_hold(s, inventory, entry);
+			journal('H', entry);
+			status = booking_status::held;
+		}
+		break;
+	// they are settled by `settle`
+	default:
+		status = booking_status::failed;
+		break;
+	}
+	if (req.action != booking_action::prepare
+		&& (status == booking_status::booked || status == booking_status::cancelled))
+		record(s, inventory, { flight_number, req.username, status == booking_status::booked, seats });
+	if (status == booking_status::cancelled) promote(s, flight_number, inventory);
+	if (inventory.available != available && observer_.seats_changed)
+		observer_.seats_changed(flight_number, inventory.available);
+	// the user is told once the hold is in the journal on disk
+	if (status == booking_status::held) {
+		s.unsynced.push_back([complete = std::move(req.complete)] {
+			complete(booking_status::held);
+		});
+		return;
+	}
+	req.complete(status);
+}
+
+void booking_engine::settle(
+	shard& s, const std::string& flight_number, booking_request& req) {
+	flight_inventory& inventory = s.flights[flight_number];
+	// the inventory is kept while the reservation is unflushed
+	auto it = inventory.reserving.find(req.username);
+	reservation r = it->second;
+	inventory.reserving.erase(it);
+	--inventory.unflushed;
+	long long available = inventory.available;
+	booking_status status;
+	if (req.action == booking_action::commit) {
+		if (r.hold.has_value()) journal('C', { flight_number, req.username, r.hold.value() });
+		if (inventory.loaded) inventory.holders.emplace(req.username, r.seats);
+		record(s, inventory, { flight_number, req.username, true, r.seats });
+		status = booking_status::booked;
+	}
+	else {
+		// (an unloaded inventory gets its seats back from the database)
+		if (r.hold.has_value() && r.hold.value() > clock::now()) {
+			hold_entry entry{ flight_number, req.username, r.hold.value() };
+			if (!inventory.loaded) s.restoring[flight_number].push_back(entry);
+			else {
+				inventory.available += r.seats - 1;
+				add_hold(s, inventory, entry);
+			}
+		}
+		else {
+			// it has expired while the batch was prepared
+			if (r.hold.has_value()) journal('R', { flight_number, req.username, r.hold.value() });
+			if (inventory.loaded) inventory.available += r.seats;
+		}
+		if (inventory.loaded) promote(s, flight_number, inventory);
+		status = booking_status::cancelled;
+	}
+	if (inventory.available != available && observer_.seats_changed)
+		observer_.seats_changed(flight_number, inventory.available);
+	req.complete(status);
+	if (inventory.unflushed != 0 || inventory.loaded || inventory.loading) return;
+	// it has been forgotten while the batch was prepared
+	if (!inventory.waiting.empty()) load(s, flight_number);
+	else s.flights.erase(flight_number);
+}
+
+void booking_engine::reserve_batch(std::shared_ptr<batch_reservation> batch) {
+	std::size_t items = batch->flights.size();
+	batch->statuses.resize(items);
+	batch->remaining = items;
+	if (items == 0) {
+		batch->complete({});
+		return;
+	}
+	for (std::size_t i = 0; i < items; ++i) {
+		request(batch->flights[i], { batch->username, booking_action::prepare,
+			[this, batch, i](booking_status status) {
+				batch->statuses[i] = status;
+				if (--batch->remaining == 0) settle_batch(batch);
+			}, batch->seats[i] });
+	}
+}
+
+void booking_engine::settle_batch(std::shared_ptr<batch_reservation> batch) {
+	std::vector<std::size_t> prepared;
+	for (std::size_t i = 0; i < batch->statuses.size(); ++i) {
+		if (batch->statuses[i] == booking_status::booked) prepared.push_back(i);
+	}
+	bool failed = prepared.size() != batch->statuses.size();
+	if (failed) {
+		for (std::size_t i : prepared) {
+			batch->statuses[i] = booking_status::cancelled;
+		}
+	}
+	batch->remaining = prepared.size();
+	if (prepared.empty()) {
+		batch->complete(std::move(batch->statuses));
+		return;
+	}
+	for (std::size_t i : prepared) {
+		request(batch->flights[i], { batch->username,
+			failed ? booking_action::rollback : booking_action::commit,
+			[batch](booking_status) {
+				if (--batch->remaining == 0) batch->complete(std::move(batch->statuses));
+			} });
+	}
+}
+
+// hands the available seats to the users on the waitlist
+void booking_engine::promote(
+	shard& s, const std::string& flight_number, flight_inventory& inventory) {
+	while (inventory.available > 0 && !inventory.waitlist.empty()) {
+		std::string username = std::move(inventory.waitlist.front());
+		inventory.waitlist.pop_front();
+		// they have booked the flight (or held a seat) since they joined
+		if (inventory.holders.count(username) != 0
+			|| inventory.held.count(username) != 0
+			|| inventory.reserving.count(username) != 0) continue;
+		--inventory.available;
+		inventory.holders.emplace(username, 1);
+		record(s, inventory, { flight_number, username, true, 1 });
+		if (observer_.promoted) observer_.promoted(flight_number, username);
+	}
+}
+
+// the seat of `entry` must have been taken from `available`
+void booking_engine::add_hold(
+	shard& s, flight_inventory& inventory, const hold_entry& entry) {
+	inventory.held[entry.username] = entry.deadline;
+	auto ticks = std::chrono::duration_cast<std::chrono::seconds>(
+		entry.deadline - clock::now()) / wheel_tick + 1;
+	std::size_t slot = (s.wheel_cursor + (std::size_t)std::max<long long>(ticks, 1)) % wheel_size;
+	s.wheel[slot].push_back(entry);
+}
+
+void booking_engine::restore_holds(
+	shard& s, const std::string& flight_number, flight_inventory& inventory) {
+	auto it = s.restoring.find(flight_number);
+	if (it == s.restoring.end()) return;
+	for (const auto& entry : it->second) {
+		// the expired holds are dropped from the journal by the next restart
+		if (entry.deadline <= clock::now()
+			|| inventory.holders.count(entry.username) != 0
+			|| inventory.held.count(entry.username) != 0) continue;
+		if (inventory.available <= 0) {
+			journal('R', entry);
+			continue;
+		}
+		--inventory.available;
+		add_hold(s, inventory, entry);
+	}
+	s.restoring.erase(it);
+}
+
+void booking_engine::tick(shard& s) {
+	s.wheel_cursor = (s.wheel_cursor + 1) % wheel_size;
+	std::vector<hold_entry> entries = std::move(s.wheel[s.wheel_cursor]);
+	s.wheel[s.wheel_cursor].clear();
+	auto now = clock::now();
+	for (auto& entry : entries) {
+		// it is due in a later turn of the wheel
+		if (entry.deadline > now) {
+			s.wheel[s.wheel_cursor].emplace_back(std::move(entry));
+			continue;
+		}
+		auto it = s.flights.find(entry.flight_number);
+		if (it == s.flights.end() || !it->second.loaded) continue;
+		flight_inventory& inventory = it->second;
+		auto hold = inventory.held.find(entry.username);
+		// it has been confirmed, or replaced by a later hold
+		if (hold == inventory.held.end() || hold->second != entry.deadline) continue;
+		inventory.held.erase(hold);
+		++inventory.available;
+		journal('R', entry);
+		promote(s, entry.flight_number, inventory);
+		if (observer_.seats_changed) observer_.seats_changed(entry.flight_number, inventory.available);
+	}
+}
+
+void booking_engine::load(shard& s, const std::string& flight_number) {
+	s.flights[flight_number].loading = true;
+	// the queries run on the pool, outside of the strand
+	db_conn_mgr_->async_get(pool_.get_executor(),
+		[this, &s, flight_number](
+			const boost::system::error_code& ec,
+			std::shared_ptr<bserv::db_connection> conn) {
+				bool failed = true;
+				std::optional<long long> available;
+				std::map<std::string, long long> holders;
+				std::deque<std::string> waitlist;
+				if (!ec) {
+					try {
+						bserv::db_transaction tx{ conn };
+						bserv::db_result seats = tx.exec(BSERV_SQL(
+							"select available_seat from flightinfo where flight_number = ?;"), flight_number);
+						if (seats.size() != 0) {
+							bserv::db_row row = *seats.begin();
+							available = row[0].is_null() ? 0 : row[0].as<long long>();
+							bserv::db_result orders = tx.exec(BSERV_SQL(
+								"select username, seats from orders where flight_number = ?;"), flight_number);
+							for (const auto& order : orders) {
+								holders.emplace(order[0].as<std::string>(), order[1].as<long long>());
+							}
+							bserv::db_result waiting = tx.exec(BSERV_SQL(
+								"select username from waitlist where flight_number = ? order by id;"), flight_number);
+							for (const auto& row : waiting) {
+								waitlist.emplace_back(row[0].as<std::string>());
+							}
+						}
+						failed = false;
+					}
+					catch (const std::exception& e) {
+						lgerror << "booking: loading " << flight_number << " failed: " << e.what();
+					}
+				}
+				conn.reset();
+				boost::asio::post(s.strand,
+					[this, &s, flight_number, failed, available,
+					holders = std::move(holders), waitlist = std::move(waitlist)]() mutable {
+						loaded(s, flight_number, failed, available,
+							std::move(holders), std::move(waitlist));
+					});
+		});
+}
+
+void booking_engine::loaded(
+	shard& s, const std::string& flight_number, bool failed,
+	std::optional<long long> available, std::map<std::string, long long>&& holders,
+	std::deque<std::string>&& waitlist) {
+	flight_inventory& inventory = s.flights[flight_number];
+	inventory.loading = false;
+	if (inventory.stale) {
+		inventory.stale = false;
+		// otherwise it is loaded once the pending changes are written
+		if (inventory.unflushed == 0) load(s, flight_number);
+		return;
+	}
+	// they may have joined after the waitlist was read
+	for (auto& username : inventory.joined) {
+		if (std::find(waitlist.begin(), waitlist.end(), username) == waitlist.end())
+			waitlist.emplace_back(std::move(username));
+	}
+	inventory.joined.clear();
+	std::vector<booking_request> waiting = std::move(inventory.waiting);
+	inventory.waiting.clear();
+	if (failed || !available.has_value()) {
+		for (auto& req : waiting) {
+			req.complete(failed ? booking_status::failed : booking_status::no_such_flight);
+		}
+		if (!failed) s.restoring.erase(flight_number);
+		// nothing can be pending for a flight that is not loaded
+		s.flights.erase(flight_number);
+		return;
+	}
+	inventory.loaded = true;
+	inventory.available = available.value();
+	inventory.holders = std::move(holders);
+	inventory.waitlist = std::move(waitlist);
+	restore_holds(s, flight_number, inventory);
+	for (auto& req : waiting) {
+		apply(s, flight_number, inventory, req);
+	}
+}
+
+void booking_engine::schedule_flush() {
+	timer_.expires_after(flush_interval_);
+	timer_.async_wait([this](const boost::system::error_code& ec) {
+		if (ec == boost::asio::error::operation_aborted) return;
+		compact_journal();
+		for (auto& s : shards_) {
+			boost::asio::post(s->strand, [this, &s = *s] {
+				flush(s);
+				sync_holds(s);
+			});
+		}
+		schedule_flush();
+	});
+	sync_journal();
+}
+
+void booking_engine::sync_holds(shard& s) {
+	if (s.unsynced.empty()) return;
+	// the holds of the shard are written already, by the strand
+	sync_journal();
+	std::vector<std::function<void()>> unsynced = std::move(s.unsynced);
+	s.unsynced.clear();
+	for (auto& complete : unsynced) {
+		complete();
+	}
+}
+
+void booking_engine::schedule_tick() {
+	wheel_timer_.expires_after(wheel_tick);
+	wheel_timer_.async_wait([this](const boost::system::error_code& ec) {
+		if (ec == boost::asio::error::operation_aborted) return;
+		for (auto& s : shards_) {
+			boost::asio::post(s->strand, [this, &s = *s] { tick(s); });
+		}
+		schedule_tick();
+	});
+}
+
+void booking_engine::record(
+	shard& s, flight_inventory& inventory, booking_change&& change) {
+	change.seq = s.next_seq++;
+	{
+		std::lock_guard<std::mutex> lg{ pending_lock_ };
+		++pending_users_[change.username];
+	}
+	s.batch.emplace_back(std::move(change));
+	++inventory.unflushed;
+}
+
+bool booking_engine::has_pending(const std::string& username) {
+	std::lock_guard<std::mutex> lg{ pending_lock_ };
+	return pending_users_.count(username) != 0;
+}
+
+// the retried changes are put before the newer ones,
+// but the changes of different flights may be reordered
+std::uint64_t booking_engine::oldest_pending(const shard& s) {
+	std::uint64_t oldest = s.next_seq;
+	if (s.flushing) oldest = std::min(oldest, s.flushing_seq);
+	for (const auto& change : s.batch) {
+		oldest = std::min(oldest, change.seq);
+	}
+	return oldest;
+}
+
+void booking_engine::flush(shard& s) {
+	// the previous batch of the shard is still being written
+	if (s.flushing || s.batch.empty()) return;
+	s.flushing = true;
+	s.flushing_seq = oldest_pending(s);
+	std::vector<booking_change> changes = std::move(s.batch);
+	s.batch.clear();
+	db_conn_mgr_->async_get(pool_.get_executor(),
+		[this, &s, changes = std::move(changes)](
+			const boost::system::error_code& ec,
+			std::shared_ptr<bserv::db_connection> conn) mutable {
+				std::vector<booking_change> rejected, unwritten;
+				if (ec) unwritten.swap(changes);
+				else {
+					try {
+						write_changes(conn, changes);
+					}
+					// one flight cannot hold back the others
+					catch (const bserv::db_sql_error& e) {
+						lgerror << "booking: writing " << changes.size()
+							<< " changes failed: " << e.what();
+						write_each_flight(conn, changes, rejected, unwritten);
+					}
+					catch (const std::exception& e) {
+						lgerror << "booking: writing " << changes.size()
+							<< " changes failed: " << e.what();
+						unwritten.swap(changes);
+					}
+				}
+				conn.reset();
+				boost::asio::post(s.strand,
+					[this, &s, changes = std::move(changes), rejected = std::move(rejected),
+					unwritten = std::move(unwritten)]() mutable {
+						flushed(s, std::move(changes), std::move(rejected), std::move(unwritten));
+					});
+		});
+}
+
+void booking_engine::flushed(shard& s, std::vector<booking_change>&& written,
+	std::vector<booking_change>&& rejected, std::vector<booking_change>&& unwritten) {
+	s.flushing = false;
+	// the flights whose changes the database keeps rejecting
+	std::vector<std::string> abandoned;
+	for (auto& change : rejected) {
+		if (++change.attempts >= max_flush_attempts
+			&& std::find(abandoned.begin(), abandoned.end(), change.flight_number) == abandoned.end())
+			abandoned.emplace_back(change.flight_number);
+	}
+	for (auto& change : rejected) {
+		if (std::find(abandoned.begin(), abandoned.end(), change.flight_number) == abandoned.end())
+			unwritten.emplace_back(std::move(change));
+		else {
+			lgerror << "booking: dropped the " << (change.reserve ? "order" : "cancellation")
+				<< " of " << change.flight_number << " by " << change.username
+				<< " after " << change.attempts << " failed flushes";
+			written.emplace_back(std::move(change));
+		}
+	}
+	// retried by the next flush, before the newer changes
+	if (!unwritten.empty()) {
+		unwritten.insert(unwritten.end(), std::make_move_iterator(s.batch.begin()),
+			std::make_move_iterator(s.batch.end()));
+		s.batch = std::move(unwritten);
+	}
+	for (const auto& flight_number : abandoned) {
+		abandon(s, flight_number);
+	}
+	{
+		std::lock_guard<std::mutex> lg{ pending_lock_ };
+		for (const auto& change : written) {
+			auto it = pending_users_.find(change.username);
+			if (it != pending_users_.end() && --it->second == 0) pending_users_.erase(it);
+		}
+	}
+	for (const auto& change : written) {
+		auto it = s.flights.find(change.flight_number);
+		if (it == s.flights.end()) continue;
+		flight_inventory& inventory = it->second;
+		--inventory.unflushed;
+		if (inventory.unflushed != 0 || inventory.loaded || inventory.loading) continue;
+		// it has been forgotten, and the database is now up to date
+		if (!inventory.waiting.empty()) load(s, change.flight_number);
+		else s.flights.erase(it);
+	}
+	if (s.drains.empty()) return;
+	std::uint64_t oldest = oldest_pending(s);
+	std::vector<drain_waiter> drains = std::move(s.drains);
+	s.drains.clear();
+	for (auto& waiter : drains) {
+		if (waiter.seq <= oldest) waiter.done();
+		else s.drains.emplace_back(std::move(waiter));
+	}
+}
+
+void booking_engine::abandon(shard& s, const std::string& flight_number) {
+	auto it = s.flights.find(flight_number);
+	if (it == s.flights.end()) return;
+	flight_inventory& inventory = it->second;
+	std::vector<booking_request> waiting = std::move(inventory.waiting);
+	inventory.waiting.clear();
+	for (auto& req : waiting) {
+		req.complete(booking_status::failed);
+	}
+	// the memory no longer matches the database
+	if (inventory.loaded) unload(s, flight_number, inventory);
+}
+
+void booking_engine::write_changes(
+	std::shared_ptr<bserv::db_connection> conn,
+	const std::vector<booking_change>& changes) {
+	// only the last change of an order matters, it is the order's final state
+	std::map<std::pair<std::string, std::string>, const booking_change*> orders;
+	std::map<std::string, long long> seats;
+	for (const auto& change : changes) {
+		orders[{ change.username, change.flight_number }] = &change;
+		seats[change.flight_number] += change.reserve ? -change.seats : change.seats;
+	}
+	std::vector<std::string> inserted_users, inserted_flights;
+	std::vector<long long> inserted_seats;
+	std::vector<std::string> deleted_users, deleted_flights;
+	for (const auto& [order, change] : orders) {
+		if (change->reserve) {
+			inserted_users.emplace_back(order.first);
+			inserted_flights.emplace_back(order.second);
+			inserted_seats.emplace_back(change->seats);
+		}
+		else {
+			deleted_users.emplace_back(order.first);
+			deleted_flights.emplace_back(order.second);
+		}
+	}
+	std::vector<std::string> flights;
+	std::vector<long long> deltas;
+	for (const auto& [flight_number, delta] : seats) {
+		if (delta == 0) continue;
+		flights.emplace_back(flight_number);
+		deltas.emplace_back(delta);
+	}
+	bserv::db_transaction tx{ conn };
+	if (!inserted_users.empty()) {
+		tx.exec(BSERV_SQL(
+			"insert into orders(username, flight_number, seats) "
+			"select * from unnest(?::text[], ?::text[], ?::int[]) "
+			"on conflict (username, flight_number) do update set seats = excluded.seats;"),
+			inserted_users, inserted_flights, inserted_seats);
+		// the users booked from the waitlist leave it in the same transaction
+		tx.exec(BSERV_SQL(
+			"delete from waitlist w using unnest(?::text[], ?::text[]) as d(username, flight_number) "
+			"where w.username = d.username and w.flight_number = d.flight_number;"),
+			inserted_users, inserted_flights);
+	}
+	if (!deleted_users.empty())
+		tx.exec(BSERV_SQL(
+			"delete from orders o using unnest(?::text[], ?::text[]) as d(username, flight_number) "
+			"where o.username = d.username and o.flight_number = d.flight_number;"),
+			deleted_users, deleted_flights);
+	if (!flights.empty())
+		tx.exec(BSERV_SQL(
+			"update flightinfo f set available_seat = f.available_seat + d.delta "
+			"from unnest(?::text[], ?::bigint[]) as d(flight_number, delta) "
+			"where f.flight_number = d.flight_number;"),
+			flights, deltas);
+	tx.commit();
+}
+
+void booking_engine::write_each_flight(
+	std::shared_ptr<bserv::db_connection> conn,
+	std::vector<booking_change>& changes,
+	std::vector<booking_change>& rejected,
+	std::vector<booking_change>& unwritten) {
+	std::map<std::string, std::vector<booking_change>> flights;
+	for (auto& change : changes) {
+		flights[change.flight_number].emplace_back(std::move(change));
+	}
+	changes.clear();
+	bool broken = false;
+	for (auto& [flight_number, flight_changes] : flights) {
+		std::vector<booking_change>* result = &changes;
+		if (broken) result = &unwritten;
+		else {
+			try {
+				write_changes(conn, flight_changes);
+			}
+			catch (const bserv::db_sql_error& e) {
+				lgerror << "booking: writing the changes of " << flight_number
+					<< " failed: " << e.what();
+				result = &rejected;
+			}
+			// the connection is lost, the rest are retried as they are
+			catch (const std::exception& e) {
+				lgerror << "booking: writing the changes of " << flight_number
+					<< " failed: " << e.what();
+				broken = true;
+				result = &unwritten;
+			}
+		}
+		result->insert(result->end(), std::make_move_iterator(flight_changes.begin()),
+			std::make_move_iterator(flight_changes.end()));
+	}
+}
+
+// the holds are kept, to be restored when the flight is loaded again
+void booking_engine::unload(
+	shard& s, const std::string& flight_number, flight_inventory& inventory) {
+	for (const auto& [username, deadline] : inventory.held) {
+		s.restoring[flight_number].push_back({ flight_number, username, deadline });
+	}
+	inventory.loaded = false;
+	inventory.holders.clear();
+	inventory.held.clear();
+	inventory.waitlist.clear();
+}
+
+booking_engine::journal_holds booking_engine::read_journal(const std::string& path) {
+	journal_holds holds;
+	std::ifstream fin{ path };
+	std::string line;
+	while (std::getline(fin, line)) {
+		std::istringstream iss{ line };
+		char op;
+		long long seconds;
+		std::string flight_number, username;
+		// a partially written line is ignored
+		if (!(iss >> op >> seconds >> flight_number >> username)) continue;
+		try {
+			flight_number = bserv::utils::decode_url(flight_number);
+			username = bserv::utils::decode_url(username);
+		}
+		catch (const std::exception&) {
+			continue;
+		}
+		if (op == 'H')
+			holds[{ flight_number, username }] = clock::time_point{ std::chrono::seconds{ seconds } };
+		else holds.erase({ flight_number, username });
+	}
+	for (auto it = holds.begin(); it != holds.end();) {
+		if (it->second <= clock::now()) it = holds.erase(it);
+		else ++it;
+	}
+	return holds;
+}
+
+std::string booking_engine::journal_line(char op, const hold_entry& entry) {
+	auto seconds = std::chrono::duration_cast<std::chrono::seconds>(
+		entry.deadline.time_since_epoch()).count();
+	return std::string{ op } + " " + std::to_string(seconds) + " "
+		+ bserv::utils::encode_url(entry.flight_number) + " "
+		+ bserv::utils::encode_url(entry.username) + "\n";
+}
+
+static void sync_file(std::FILE* file) {
+	std::fflush(file);
+#ifdef _MSC_VER
+	_commit(_fileno(file));
+#else
+	fsync(fileno(file));
+#endif
+}
+
+void booking_engine::rewrite_journal(const journal_holds& holds) {
+	if (journal_ != nullptr) std::fclose(journal_);
+	journal_ = nullptr;
+	journal_lines_ = 0;
+	std::string tmp_path = journal_path_ + ".tmp";
+	std::FILE* tmp = std::fopen(tmp_path.c_str(), "w");
+	if (tmp == nullptr) {
+		lgerror << "booking: cannot write the journal " << journal_path_;
+		// the old journal is still complete
+		journal_ = std::fopen(journal_path_.c_str(), "a");
+		return;
+	}
+	for (const auto& [key, deadline] : holds) {
+		std::fputs(journal_line('H', { key.first, key.second, deadline }).c_str(), tmp);
+	}
+	sync_file(tmp);
+	std::fclose(tmp);
+	// a crash leaves either the old journal or the new one.
+	// (`std::rename` does not replace an existing file on Windows)
+#ifdef _MSC_VER
+	std::remove(journal_path_.c_str());
+#endif
+	if (std::rename(tmp_path.c_str(), journal_path_.c_str()) != 0)
+		lgerror << "booking: cannot replace the journal " << journal_path_;
+	journal_ = std::fopen(journal_path_.c_str(), "a");
+}
+
+void booking_engine::open_journal() {
+	if (journal_path_ == "") return;
+	journal_holds holds = read_journal(journal_path_);
+	for (const auto& [key, deadline] : holds) {
+		hold_entry entry{ key.first, key.second, deadline };
+		shard_of(entry.flight_number).restoring[entry.flight_number].push_back(entry);
+	}
+	std::lock_guard<std::mutex> lg{ journal_lock_ };
+	rewrite_journal(holds);
+}
+
+void booking_engine::compact_journal() {
+	std::lock_guard<std::mutex> lg{ journal_lock_ };
+	if (journal_ == nullptr || journal_lines_ < journal_compact_lines) return;
+	std::fflush(journal_);
+	rewrite_journal(read_journal(journal_path_));
+}
+
+void booking_engine::journal(char op, const hold_entry& entry) {
+	std::string line = journal_line(op, entry);
+	std::lock_guard<std::mutex> lg{ journal_lock_ };
+	if (journal_ == nullptr) return;
+	std::fputs(line.c_str(), journal_);
+	++journal_lines_;
+}
+
+void booking_engine::sync_journal() {
+	std::lock_guard<std::mutex> lg{ journal_lock_ };
+	if (journal_ == nullptr) return;
+	sync_file(journal_);
+}
+
+void booking_engine::join_waitlist(
+	const std::string& flight_number, const std::string& username) {
+	shard& s = shard_of(flight_number);
+	boost::asio::post(s.strand, [this, &s, flight_number, username] {
+		auto it = s.flights.find(flight_number);
+		// it is read from the database when the flight is loaded
+		if (it == s.flights.end()) return;
+		flight_inventory& inventory = it->second;
+		if (inventory.loading) inventory.joined.push_back(username);
+		if (!inventory.loaded) return;
+		if (std::find(inventory.waitlist.begin(), inventory.waitlist.end(), username)
+			== inventory.waitlist.end())
+			inventory.waitlist.push_back(username);
+		long long available = inventory.available;
+		promote(s, flight_number, inventory);
+		if (inventory.available != available && observer_.seats_changed)
+			observer_.seats_changed(flight_number, inventory.available);
+	});
+}
+
+void booking_engine::forget(const std::string& flight_number) {
+	shard& s = shard_of(flight_number);
+	boost::asio::post(s.strand, [this, &s, flight_number] {
+		auto it = s.flights.find(flight_number);
+		if (it == s.flights.end()) return;
+		if (it->second.loading) it->second.stale = true;
+		if (!it->second.loaded) return;
+		unload(s, it->first, it->second);
+		if (it->second.unflushed == 0) s.flights.erase(it);
+	});
+}
+
+void booking_engine::forget_all() {
+	for (auto& s : shards_) {
+		boost::asio::post(s->strand, [this, &s = *s] {
+			for (auto it = s.flights.begin(); it != s.flights.end();) {
+				if (it->second.loading) it->second.stale = true;
+				if (!it->second.loaded) {
+					++it;
+					continue;
+				}
+				unload(s, it->first, it->second);
+				if (it->second.unflushed == 0) it = s.flights.erase(it);
+				else ++it;
+			}
+		});
+	}
+}
+
+void booking_engine::drain(shard& s, std::function<void()>&& done) {
+	boost::asio::post(s.strand, [this, &s, done = std::move(done)]() mutable {
+		if (oldest_pending(s) == s.next_seq) {
+			done();
+			return;
+		}
+		s.drains.push_back({ s.next_seq, std::move(done) });
+		// it does not wait for the flush interval
+		flush(s);
+	});
+}
+
+void booking_engine::drain_all(std::function<void()>&& done) {
+	auto remaining = std::make_shared<std::atomic<std::size_t>>(shards_.size());
+	auto done_ptr = std::make_shared<std::function<void()>>(std::move(done));
+	for (auto& s : shards_) {
+		drain(*s, [remaining, done_ptr] {
+			if (--*remaining == 0) (*done_ptr)();
+		});
+	}
+}
+
+std::unique_ptr<booking_engine> booking_;
+
+void init_booking(int num_shards, int flush_ms,
+	int hold_minutes, const std::string& journal_path,
+	const std::string& conn_str, int num_conns) {
+	if (num_shards > 0)
+		booking_ = std::make_unique<booking_engine>(
+			num_shards, flush_ms, hold_minutes, journal_path, conn_str, num_conns);
+}
+
+booking_engine* booking() {
+	return booking_.get();
+}
@@ -0,0 +1,399 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+
+#include "bserv/common.hpp"
+
+// an in-process booking engine in front of the seat inventory.
+// the seats of a flight are owned by one shard (chosen by the hash of the
+// flight number), and each shard is a strand, so the purchases of a flight
+// are serialized without locks while different flights are served in parallel.
+// sold-out flights and repeated bookings are rejected from memory.
+// the orders and seat changes are written to `orders`/`flightinfo` in
+// batches (write-behind), once every flush interval.
+// a seat can also be held for a while before the order is confirmed.
+// the holds only live in memory (expired by a timer wheel of each shard),
+// and are journaled to a file so that they survive a restart.
+// a seat that is given back goes to the next user on the waitlist
+// of the flight, if there is one. the table `waitlist` is the record, and
+// it is loaded with the inventory.
+
+enum class booking_status {
+	booked,
+	cancelled,
+	sold_out,
+	already_booked,
+	not_booked,
+	held,
+	// the hold has expired (or never existed)
+	not_held,
+	no_such_flight,
+	// the inventory could not be loaded from the database
+	failed
+};
+
+// the callbacks of the engine, they are called on its strands
+struct booking_observer {
+	// a seat of the flight has been booked for the user from the waitlist
+	std::function<void(const std::string& flight_number, const std::string& username)> promoted;
+	// the number of available seats of the flight has changed
+	std::function<void(const std::string& flight_number, long long available)> seats_changed;
+};
+
+class booking_engine {
+private:
+	using executor_type = boost::asio::thread_pool::executor_type;
+	using clock = std::chrono::system_clock;
+	enum class booking_action {
+		reserve,
+		release,
+		hold,
+		confirm,
+		// puts the seats aside for a batch (see `async_reserve_batch`),
+		// until it is committed (booked) or rolled back
+		prepare,
+		commit,
+		rollback
+	};
+	struct booking_request {
+		std::string username;
+		booking_action action;
+		std::function<void(booking_status)> complete;
+		// the number of seats to reserve
+		long long seats = 1;
+	};
+	// a batch of `async_reserve_batch`, its items are prepared and then settled
+	struct batch_reservation {
+		std::vector<std::string> flights;
+		std::vector<long long> seats;
+		std::string username;
+		std::vector<booking_status> statuses;
+		// the items not prepared (or settled) yet
+		std::atomic<std::size_t> remaining;
+		std::function<void(std::vector<booking_status>)> complete;
+	};
+	// the seats put aside by a prepared item of a batch
+	struct reservation {
+		long long seats;
+		// the deadline of the hold it is made from, if any
+		std::optional<clock::time_point> hold;
+	};
+	struct hold_entry {
+		std::string flight_number;
+		std::string username;
+		clock::time_point deadline;
+	};
+	struct flight_inventory {
+		bool loaded = false;
+		bool loading = false;
+		// it has been forgotten while loading, so the rows being read
+		// may be out of date, and they are read again
+		bool stale = false;
+		long long available = 0;
+		// the users who have booked the flight, and the seats of their orders
+		std::map<std::string, long long> holders;
+		// the users holding a seat, and when their holds expire.
+		// the held seats are not `available`, nor written to the database.
+		std::map<std::string, clock::time_point> held;
+		// the number of changes not written to the database yet.
+		// the inventory is only (re)loaded when it is zero.
+		std::size_t unflushed = 0;
+		// the users whose batches have put seats aside, they are not
+		// `available` and count as changes in `unflushed` until settled.
+		// they survive the unloading of the inventory.
+		std::map<std::string, reservation> reserving;
+		// the users waiting for a seat, in the order of joining
+		std::deque<std::string> waitlist;
+		// the users who have joined the waitlist while it is loaded
+		std::vector<std::string> joined;
+		// the requests that arrived before the inventory was loaded
+		std::vector<booking_request> waiting;
+	};
+	struct booking_change {
+		std::string flight_number;
+		std::string username;
+		bool reserve;
+		long long seats;
+		// the flushes that have failed to write it
+		int attempts = 0;
+		// the order in which the changes of the shard are made
+		std::uint64_t seq = 0;
+	};
+	struct drain_waiter {
+		// the changes before `seq` must be written first
+		std::uint64_t seq;
+		std::function<void()> done;
+	};
+	// the members are only accessed on `strand`
+	struct shard {
+		boost::asio::strand<executor_type> strand;
+		std::unordered_map<std::string, flight_inventory> flights;
+		// the changes to be written by the next flush
+		std::vector<booking_change> batch;
+		bool flushing = false;
+		std::uint64_t next_seq = 0;
+		// the oldest change being written, if `flushing`
+		std::uint64_t flushing_seq = 0;
+		std::vector<drain_waiter> drains;
+		// the completions of the holds, they are called once the journal is synced
+		std::vector<std::function<void()>> unsynced;
+		// the timer wheel of the holds, one slot per tick.
+		// an entry waits in its slot for as many turns as its deadline takes.
+		std::vector<std::vector<hold_entry>> wheel;
+		std::size_t wheel_cursor = 0;
+		// the holds to restore once their flights are loaded
+		// (those in the journal, or of the inventories that are forgotten)
+		std::unordered_map<std::string, std::vector<hold_entry>> restoring;
+		shard(const executor_type& executor)
+			: strand{ boost::asio::make_strand(executor) },
+			wheel(wheel_size) {}
+	};
+	static constexpr std::size_t wheel_size = 256;
+	// the changes of a flight that fail this many flushes are dropped
+	static constexpr int max_flush_attempts = 5;
+	static constexpr std::chrono::seconds wheel_tick{ 1 };
+	boost::asio::thread_pool pool_;
+	std::vector<std::unique_ptr<shard>> shards_;
+	const std::chrono::milliseconds flush_interval_;
+	const std::chrono::minutes hold_duration_;
+	boost::asio::steady_timer timer_;
+	boost::asio::steady_timer wheel_timer_;
+	// one line per hold, confirmation or release of a hold
+	// the journal is compacted once this many lines are appended
+	static constexpr std::size_t journal_compact_lines = 10000;
+	const std::string journal_path_;
+	std::FILE* journal_;
+	// the lines appended since the journal was rewritten
+	std::size_t journal_lines_ = 0;
+	std::mutex journal_lock_;
+	const std::string conn_str_;
+	const int num_conns_;
+	// the connections of the engine, apart from those of the requests,
+	// which may be held by requests waiting on the engine
+	std::shared_ptr<bserv::db_connection_manager> db_conn_mgr_;
+	// the number of changes of each user not written yet, of all the shards
+	std::unordered_map<std::string, std::size_t> pending_users_;
+	std::mutex pending_lock_;
+	booking_observer observer_;
+	std::once_flag started_;
+	shard& shard_of(const std::string& flight_number);
+	void request(const std::string& flight_number, booking_request&& req);
+	// the following run on the strand of `s`
+	void submit(shard& s, const std::string& flight_number, booking_request&& req);
+	void apply(shard& s, const std::string& flight_number,
+		flight_inventory& inventory, booking_request& req);
+	// commits or rolls back the reservation of `req.username`,
+	// whether the inventory is loaded or not
+	void settle(shard& s, const std::string& flight_number, booking_request& req);
+	void load(shard& s, const std::string& flight_number);
+	void loaded(shard& s, const std::string& flight_number, bool failed,
+		std::optional<long long> available, std::map<std::string, long long>&& holders,
+		std::deque<std::string>&& waitlist);
+	// adds `change` to the batch of `s`
+	void record(shard& s, flight_inventory& inventory, booking_change&& change);
+	// the oldest change of `s` not written yet, or `next_seq` if there is none
+	static std::uint64_t oldest_pending(const shard& s);
+	void flush(shard& s);
+	// `rejected` are refused by the database, and `unwritten` are not tried
+	void flushed(shard& s, std::vector<booking_change>&& written,
+		std::vector<booking_change>&& rejected, std::vector<booking_change>&& unwritten);
+	// gives up the changes of `flight_number` that cannot be written:
+	// its waiting requests fail, and its inventory is reloaded from the database
+	void abandon(shard& s, const std::string& flight_number);
+	void add_hold(shard& s, flight_inventory& inventory, const hold_entry& entry);
+	void promote(shard& s, const std::string& flight_number, flight_inventory& inventory);
+	void restore_holds(shard& s, const std::string& flight_number,
+		flight_inventory& inventory);
+	void unload(shard& s, const std::string& flight_number,
+		flight_inventory& inventory);
+	void tick(shard& s);
+	void reserve_batch(std::shared_ptr<batch_reservation> batch);
+	// commits the batch if every item is prepared, otherwise rolls it back
+	void settle_batch(std::shared_ptr<batch_reservation> batch);
+	// calls `done` (on the strand of `s`) once the changes made
+	// so far by `s` are written to the database, or dropped
+	void drain(shard& s, std::function<void()>&& done);
+	void drain_all(std::function<void()>&& done);
+	void schedule_flush();
+	void schedule_tick();
+	// the holds in the journal at `path` that have not expired
+	using journal_holds = std::map<std::pair<std::string, std::string>, clock::time_point>;
+	static journal_holds read_journal(const std::string& path);
+	static std::string journal_line(char op, const hold_entry& entry);
+	// replaces the journal with the lines of `holds`, and reopens it.
+	// `journal_lock_` must be held.
+	void rewrite_journal(const journal_holds& holds);
+	// replays the journal into `restoring`, and rewrites it
+	// with only the holds that have not expired
+	void open_journal();
+	// rewrites the journal with only the holds that are still in it,
+	// once `journal_compact_lines` lines have been appended
+	void compact_journal();
+	// `op` is 'H' (hold), 'C' (confirmed) or 'R' (released)
+	void journal(char op, const hold_entry& entry);
+	// makes the journal durable, it is called by every flush
+	void sync_journal();
+	// completes the holds of `s` made before the journal is synced
+	void sync_holds(shard& s);
+	// writes `changes` in a single transaction
+	static void write_changes(
+		std::shared_ptr<bserv::db_connection> conn,
+		const std::vector<booking_change>& changes);
+	// writes the changes of each flight in its own transaction,
+	// and leaves in `changes` only those written
+	static void write_each_flight(
+		std::shared_ptr<bserv::db_connection> conn,
+		std::vector<booking_change>& changes,
+		std::vector<booking_change>& rejected,
+		std::vector<booking_change>& unwritten);
+
+	template <typename ...Results, typename Handler>
+	static std::function<void(Results...)> make_completion(Handler&& handler) {
+		auto handler_ptr = std::make_shared<std::decay_t<Handler>>(std::move(handler));
+		return [handler_ptr](Results ...results) {
+			// resumes the caller on its own executor
+			auto executor = boost::asio::get_associated_executor(*handler_ptr);
+			boost::asio::post(executor, [handler_ptr, results...]() mutable {
+				(*handler_ptr)(std::move(results)...);
+			});
+		};
+	}
+public:
+	booking_engine(int num_shards, int flush_ms,
+		int hold_minutes, const std::string& journal_path,
+		const std::string& conn_str, int num_conns);
+	~booking_engine();
+	// connects to the database and starts the write-behind,
+	// only the first call (that succeeds) takes effect
+	void start(const booking_observer& observer);
+	// books `seats` seats of `flight_number` for `username` in one order,
+	// the completion handler has the signature `void(booking_status)`:
+	// `booked`, `sold_out`, `already_booked`, `no_such_flight` or `failed`.
+	// a seat held by `username` is one of them.
+	template <typename CompletionToken>
+	auto async_reserve(
+		const std::string& flight_number,
+		const std::string& username,
+		long long seats,
+		CompletionToken&& token) {
+		return boost::asio::async_initiate<CompletionToken, void(booking_status)>(
+			[this, flight_number, username, seats](auto handler) {
+				request(flight_number, { username, booking_action::reserve,
+					make_completion<booking_status>(std::move(handler)), seats });
+			}, token);
+	}
+	// books `seats[i]` seats of `flights[i]` for `username`, for every item or none.
+	// the seats of every item are put aside (on the shard of its flight) before
+	// any of them is booked, and given back if one of them cannot be.
+	// the completion handler has the signature `void(std::vector<booking_status>)`,
+	// with the statuses of `async_reserve` in the same order as `flights`,
+	// and `cancelled` for the items that are given back.
+	template <typename CompletionToken>
+	auto async_reserve_batch(
+		const std::vector<std::string>& flights,
+		const std::vector<long long>& seats,
+		const std::string& username,
+		CompletionToken&& token) {
+		return boost::asio::async_initiate<CompletionToken, void(std::vector<booking_status>)>(
+			[this, flights, seats, username](auto handler) {
+				auto batch = std::make_shared<batch_reservation>();
+				batch->flights = flights;
+				batch->seats = seats;
+				batch->username = username;
+				batch->complete = make_completion<std::vector<booking_status>>(std::move(handler));
+				reserve_batch(std::move(batch));
+			}, token);
+	}
+	// gives back the seats of `flight_number` booked by `username`:
+	// `cancelled`, `not_booked`, `no_such_flight` or `failed`
+	template <typename CompletionToken>
+	auto async_release(
+		const std::string& flight_number,
+		const std::string& username,
+		CompletionToken&& token) {
+		return boost::asio::async_initiate<CompletionToken, void(booking_status)>(
+			[this, flight_number, username](auto handler) {
+				request(flight_number, { username, booking_action::release,
+					make_completion<booking_status>(std::move(handler)) });
+			}, token);
+	}
+	// holds a seat of `flight_number` for `username` for the hold duration:
+	// `held`, `sold_out`, `already_booked`, `no_such_flight` or `failed`.
+	// holding the seat again does not extend the hold.
+	// `held` is only reported once the journal is synced (by the next flush).
+	template <typename CompletionToken>
+	auto async_hold(
+		const std::string& flight_number,
+		const std::string& username,
+		CompletionToken&& token) {
+		return boost::asio::async_initiate<CompletionToken, void(booking_status)>(
+			[this, flight_number, username](auto handler) {
+				request(flight_number, { username, booking_action::hold,
+					make_completion<booking_status>(std::move(handler)) });
+			}, token);
+	}
+	// turns the hold of `username` into an order:
+	// `booked`, `not_held`, `already_booked`, `no_such_flight` or `failed`
+	template <typename CompletionToken>
+	auto async_confirm(
+		const std::string& flight_number,
+		const std::string& username,
+		CompletionToken&& token) {
+		return boost::asio::async_initiate<CompletionToken, void(booking_status)>(
+			[this, flight_number, username](auto handler) {
+				request(flight_number, { username, booking_action::confirm,
+					make_completion<booking_status>(std::move(handler)) });
+			}, token);
+	}
+	// waits until the orders and cancellations made so far are written
+	// to the database (or dropped, see `flushed`),
+	// the completion handler has the signature `void()`
+	template <typename CompletionToken>
+	auto async_drain(CompletionToken&& token) {
+		return boost::asio::async_initiate<CompletionToken, void()>(
+			[this](auto handler) {
+				drain_all(make_completion<>(std::move(handler)));
+			}, token);
+	}
+	// the same, but only for the shard of `flight_number`
+	template <typename CompletionToken>
+	auto async_drain(const std::string& flight_number, CompletionToken&& token) {
+		return boost::asio::async_initiate<CompletionToken, void()>(
+			[this, flight_number](auto handler) {
+				drain(shard_of(flight_number), make_completion<>(std::move(handler)));
+			}, token);
+	}
+	// adds `username` to the waitlist of `flight_number` once they have joined it
+	// in the database, they are booked at once if a seat is available
+	void join_waitlist(const std::string& flight_number, const std::string& username);
+	// whether the orders of `username` in the database are behind the engine
+	bool has_pending(const std::string& username);
+	std::chrono::minutes hold_duration() const { return hold_duration_; }
+	// drops the inventory of `flight_number` (e.g. after it is changed
+	// elsewhere), it is reloaded once its pending changes are written
+	void forget(const std::string& flight_number);
+	void forget_all();
+};
+
+// `num_shards` is zero if the engine is disabled,
+// in which case `booking()` returns null.
+// the engine opens `num_conns` connections of its own to `conn_str`.
+void init_booking(int num_shards, int flush_ms,
+	int hold_minutes, const std::string& journal_path,
+	const std::string& conn_str, int num_conns);
+
+booking_engine* booking();
@@ -0,0 +1,85 @@
+#include "counters.h"
+
+#include <map>
+#include <list>
+#include <iterator>
+#include <mutex>
+#include <chrono>
+
+struct count_entry {
+	std::size_t count;
+	std::chrono::steady_clock::time_point loaded_at;
+	// the position of its key in `count_order_`
+	std::list<std::string>::iterator order;
+};
+
+// ordered, so that the counts sharing a prefix are adjacent
+std::map<std::string, count_entry> counts_;
+// the keys in the order they are loaded, the oldest is at the front
+std::list<std::string> count_order_;
+std::mutex counts_lock_;
+std::chrono::seconds reconcile_interval_{ 60 };
+std::size_t counts_capacity_ = 10000;
+
+void init_counters(int reconcile_seconds, std::size_t capacity) {
+	std::lock_guard<std::mutex> lg{ counts_lock_ };
+	reconcile_interval_ = std::chrono::seconds{ reconcile_seconds };
+	counts_capacity_ = capacity;
+}
+
+// `counts_lock_` must be held
+std::map<std::string, count_entry>::iterator erase_count(
+	std::map<std::string, count_entry>::iterator it) {
+	count_order_.erase(it->second.order);
+	return counts_.erase(it);
+}
+
+std::optional<std::size_t> find_count(const std::string& key) {
+	std::lock_guard<std::mutex> lg{ counts_lock_ };
+	auto it = counts_.find(key);
+	if (it == counts_.end()) return std::nullopt;
+	if (std::chrono::steady_clock::now() - it->second.loaded_at
+		>= reconcile_interval_) {
+		erase_count(it);
+		return std::nullopt;
+	}
+	return it->second.count;
+}
+
+void store_count(const std::string& key, std::size_t count) {
+	std::lock_guard<std::mutex> lg{ counts_lock_ };
+	auto now = std::chrono::steady_clock::now();
+	auto it = counts_.find(key);
+	if (it != counts_.end()) erase_count(it);
+	// the expired counts are dropped as well
+	while (!count_order_.empty()) {
+		auto oldest = counts_.find(count_order_.front());
+		if (counts_.size() < counts_capacity_
+			&& now - oldest->second.loaded_at < reconcile_interval_) break;
+		erase_count(oldest);
+	}
+	if (counts_capacity_ == 0) return;
+	count_order_.push_back(key);
+	counts_.emplace(key, count_entry{ count, now, std::prev(count_order_.end()) });
+}
+
+void adjust_count(const std::string& key, long long delta) {
+	std::lock_guard<std::mutex> lg{ counts_lock_ };
+	auto it = counts_.find(key);
+	if (it == counts_.end()) return;
+	// it has drifted, let it be reloaded
+	if (delta < 0 && it->second.count < (std::size_t)-delta) {
+		erase_count(it);
+		return;
+	}
+	it->second.count += delta;
+}
+
+void invalidate_counts(const std::string& prefix) {
+	std::lock_guard<std::mutex> lg{ counts_lock_ };
+	auto it = counts_.lower_bound(prefix);
+	while (it != counts_.end()
+		&& it->first.compare(0, prefix.size(), prefix) == 0) {
+		it = erase_count(it);
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <cstddef>
+
+// row counts kept in memory, so that the paginated views do not run
+// `select count(*)` on every request.
+// a count is loaded from the database the first time it is needed,
+// adjusted by the handlers that write to the counted tables, and reloaded
+// once it is older than the reconcile interval, which corrects any drift
+// (e.g. changes made outside of the server).
+// at most `capacity` counts are kept, the oldest are dropped first.
+
+void init_counters(int reconcile_seconds, std::size_t capacity);
+
+// builds the key of a count from its parts, e.g.
+// count_key("orders", username) -> "orders\n<username>\n".
+// every part ends with a separator, so that `invalidate_counts` with
+// a key as the prefix only matches the counts under it.
+template <typename ...Parts>
+std::string count_key(const Parts&... parts) {
+	std::string key;
+	((key += std::string_view{ parts }, key += '\n'), ...);
+	return key;
+}
+
+// returns the count of `key`, or `std::nullopt` if it is not cached
+// or is due for reconciliation
+std::optional<std::size_t> find_count(const std::string& key);
+
+void store_count(const std::string& key, std::size_t count);
+
+// adds `delta` to the count of `key`, if it is cached
+void adjust_count(const std::string& key, long long delta);
+
+// drops the counts whose keys start with `prefix`,
+// they are reloaded the next time they are needed
+void invalidate_counts(const std::string& prefix);
@@ -1,8 +1,16 @@
 #include "handlers.h"
 
 #include <vector>
+#include <utility>
+#include <algorithm>
+#include <charconv>
 
 #include "rendering.h"
+#include "counters.h"
+#include "purchases.h"
+#include "booking.h"
+#include "idempotency.h"
+#include "notifications.h"
 
 // register an orm mapping (to convert the db query results into
 // json objects).
@@ -56,7 +64,7 @@ std::optional<boost::json::object> get_user(
 	bserv::db_transaction& tx,
 	const boost::json::string& username) {
 	bserv::db_result r = tx.exec(
-		"select * from auth_user where username = ?", username);
+		BSERV_SQL("select * from auth_user where username = ?"), username);
 	lginfo << r.query(); // this is how you log info
 	return orm_user.convert_to_optional(r);
 }
@@ -110,9 +118,6 @@ boost::json::object user_register(
 	// as well as the url parameters
 	boost::json::object&& params,
 	std::shared_ptr<bserv::db_connection> conn) {
-	if (request.method() != boost::beast::http::verb::post) {
-		throw bserv::url_not_found_exception{};
-	}
 	if (params["username"].as_string() == "") {
 		return {
 			{"success", false},
@@ -149,6 +154,7 @@ boost::json::object user_register(
 		get_or_empty(params, "phone_number"), true);
 	lginfo << r.query();
 	tx.commit(); // you must manually commit changes
+	adjust_count(count_key("auth_user"), 1);
 	return {
 		{"success", true},
 		{"message", "User successfully registered"}
@@ -159,11 +165,9 @@ boost::json::object user_update(
 	bserv::request_type& request,
 	std::shared_ptr<bserv::session_type> session_ptr,
 	boost::json::object&& params,
-	std::shared_ptr<bserv::db_connection> conn) {
+	std::shared_ptr<bserv::db_connection> conn,
+	boost::asio::yield_context& yield) {
 	bserv::session_type& session = *session_ptr;
-	if (request.method() != boost::beast::http::verb::post) {
-		throw bserv::url_not_found_exception{};
-	}
 	lgdebug << params;
 	if (params["username"].as_string() == "") {
 		return {
@@ -186,6 +190,12 @@ boost::json::object user_update(
 	auto user = session["user"].as_object();
 	auto userid = boost::json::value_to<std::int64_t>(user["id"]);
 	auto username = boost::json::value_to<std::string>(user["username"]);
+	// the orders the booking engine has not written yet would be written
+	// under the old username, and its inventories are read again
+	if (booking() != nullptr) {
+		booking()->forget_all();
+		booking()->async_drain(yield);
+	}
 	bserv::db_transaction tx{ conn };
 	auto un = params["username"].as_string();
 	auto opt_user = get_user(tx, un);
@@ -197,8 +207,15 @@ boost::json::object user_update(
 	}
 	auto password = params["password"].as_string();
 	tx.exec("update auth_user set username = ?, password = ?, first_name = ?, last_name = ?, phone_number = ? where id = ?;", params["username"], bserv::utils::security::encode_password(password.c_str()), get_or_empty(params, "first_name"), get_or_empty(params, "last_name"), get_or_empty(params, "phone_number"), userid);
-	tx.exec("update orders set username = ? where username = ?;", params["username"], username);
+	tx.exec(BSERV_SQL("update orders set username = ? where username = ?;"), params["username"], username);
+	tx.exec(BSERV_SQL("update waitlist set username = ? where username = ?;"), params["username"], username);
 	tx.commit(); // you must manually commit changes
+	// the orders now belong to the new username
+	invalidate_counts(count_key("orders", username));
+	invalidate_counts(count_key("flightinfo", "unbooked", username));
+	invalidate_purchases(username);
+	// the booking engine knows the holders of the flights by username
+	if (booking() != nullptr) booking()->forget_all();
 	user["username"] = params["username"];
 	user["first_name"] = get_or_empty(params, "first_name");
 	user["last_name"] = get_or_empty(params, "last_name");
@@ -222,9 +239,6 @@ boost::json::object user_login(
 	boost::json::object&& params,
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr) {
-	if (request.method() != boost::beast::http::verb::post) {
-		throw bserv::url_not_found_exception{};
-	}
 	if (params["username"].as_string() == "") {
 		return {
 			{"success", false},
@@ -341,6 +355,30 @@ boost::json::object echo(
 	return { {"echo", params} };
 }
 
+// connection pool statistics, only for administrators
+boost::json::object db_stats(
+	std::shared_ptr<bserv::session_type> session_ptr,
+	std::shared_ptr<bserv::db_connection_manager> db_conn_mgr) {
+	bserv::session_type& session = *session_ptr;
+	if (!session.contains("user")
+		|| !session["user"].as_object()["is_superuser"].as_bool()) {
+		throw bserv::url_not_found_exception{};
+	}
+	bserv::db_connection_pool_stats stats = db_conn_mgr->stats();
+	std::int64_t avg_wait_time = stats.waited == 0 ? 0
+		: stats.total_wait_time.count() / (std::int64_t)stats.waited;
+	return {
+		{"size", stats.size},
+		{"idle", stats.idle},
+		{"waiting", stats.waiting},
+		{"acquired", stats.acquired},
+		{"waited", stats.waited},
+		{"timed_out", stats.timed_out},
+		{"avg_wait_us", avg_wait_time},
+		{"max_wait_us", stats.max_wait_time.count()}
+	};
+}
+
 // websocket
 std::nullopt_t ws_echo(
 	std::shared_ptr<bserv::session_type> session,
@@ -358,6 +396,72 @@ std::nullopt_t ws_echo(
 	return std::nullopt;
 }
 
+// the messages queued for a websocket, beyond which the oldest seat updates
+// are dropped (or, if there is none, the websocket stops being notified)
+const std::size_t ws_queue_size = 64;
+// the flights a websocket may follow
+const std::size_t max_ws_topics = 100;
+
+// pushes the notifications of the user and the seat changes of the flights
+// the browser follows (see notifications.h) over the websocket.
+// the browser follows flights by sending `{"subscribe": [flight numbers]}`.
+std::nullopt_t ws_notifications(
+	std::shared_ptr<bserv::session_type> session_ptr,
+	std::shared_ptr<bserv::websocket_server> ws_server,
+	boost::asio::yield_context& yield) {
+	bserv::session_type& session = *session_ptr;
+	auto sub = std::make_shared<bserv::subscriber>(ws_queue_size);
+	// only changed by the reader, which shares the strand of the session
+	auto topics = std::make_shared<std::vector<std::string>>();
+	if (session.contains("user")) {
+		topics->emplace_back(user_topic(
+			boost::json::value_to<std::string>(session["user"].as_object()["username"])));
+		notification_hub().subscribe(topics->back(), sub);
+	}
+	boost::asio::spawn(yield, [ws_server, sub, topics](boost::asio::yield_context reader) {
+		try {
+			while (true) {
+				std::string data = ws_server->read(reader);
+				boost::system::error_code ec;
+				boost::json::value request = boost::json::parse(data, ec);
+				if (ec) continue;
+				const boost::json::object* obj = request.if_object();
+				const boost::json::value* flights = obj != nullptr ? obj->if_contains("subscribe") : nullptr;
+				if (flights == nullptr || !flights->is_array()) continue;
+				for (const auto& flight_number : flights->as_array()) {
+					if (!flight_number.is_string() || topics->size() >= max_ws_topics) continue;
+					std::string topic = flight_topic(boost::json::value_to<std::string>(flight_number));
+					if (std::find(topics->begin(), topics->end(), topic) != topics->end()) continue;
+					topics->emplace_back(topic);
+					notification_hub().subscribe(topic, sub);
+				}
+			}
+		}
+		catch (const std::exception& /*e*/) {}
+		sub->close();
+	});
+	bool writable = true;
+	while (true) {
+		std::vector<bserv::shared_message> messages = sub->async_receive(yield);
+		// the reader has returned
+		if (messages.empty()) break;
+		for (const auto& message : messages) {
+			if (!writable) break;
+			try {
+				// the buffer is shared with the other subscribers
+				ws_server->write(message);
+			}
+			catch (const bserv::websocket_io_exception& /*e*/) {
+				writable = false;
+			}
+		}
+	}
+	for (const auto& topic : *topics) {
+		notification_hub().unsubscribe(topic, sub);
+	}
+	return std::nullopt;
+}
+
 std::nullopt_t serve_static_files(
 	bserv::response_type& response,
 	const std::string& path) {
@@ -402,11 +506,529 @@ std::nullopt_t update_user_info(
 	std::shared_ptr<bserv::db_connection> conn,
 	boost::json::object&& params,
 	std::shared_ptr<bserv::session_type> session_ptr,
-	bserv::response_type& response) {
-	boost::json::object context = user_update(request, session_ptr, std::move(params), conn);
+	bserv::response_type& response,
+	boost::asio::yield_context& yield) {
+	boost::json::object context = user_update(request, session_ptr, std::move(params), conn, yield);
 	return index("index.html", session_ptr, response, context);
 }
 
+// the total of a paginated listing is taken from the counter cache
+// (see counters.h), `count_query` is only sent (in the same round trip
+// as `page_query`) if the count of `key` is not cached.
+// the count is not cached if `key` is empty (e.g. for the filters of a search,
+// which are rarely repeated).
+std::pair<std::size_t, bserv::db_result> counted_page(
+	bserv::db_transaction& tx,
+	const std::string& key,
+	const bserv::db_query& count_query,
+	const bserv::db_query& page_query) {
+	std::optional<std::size_t> total;
+	if (key != "") total = find_count(key);
+	if (total.has_value()) {
+		auto [db_res] = tx.exec_pipeline(page_query);
+		return { total.value(), db_res };
+	}
+	auto [count_res, db_res] = tx.exec_pipeline(count_query, page_query);
+	std::size_t count = (*count_res.begin())[0].as<std::size_t>();
+	if (key != "") store_count(key, count);
+	return { count, db_res };
+}
+
+// keeps the counts in step with `delta` orders made (or cancelled, if negative)
+// by `username`. the searches are reloaded because the flights are not known here.
+void count_orders(const std::string& username, long long delta) {
+	adjust_count(count_key("orders"), delta);
+	adjust_count(count_key("orders", username), delta);
+	invalidate_counts(count_key("orders", username, "search"));
+	adjust_count(count_key("flightinfo", "unbooked", username), -delta);
+	invalidate_counts(count_key("flightinfo", "unbooked", username, "search"));
+}
+
+// keeps the counts in step with `delta` flights added (or cancelled, if negative)
+void count_flights(long long delta) {
+	adjust_count(count_key("flightinfo"), delta);
+	invalidate_counts(count_key("flightinfo", "search"));
+	invalidate_counts(count_key("flightinfo", "unbooked"));
+}
+
+// up to this many booked flights are excluded by an array parameter,
+// beyond it the `not exists` anti-join (on the orders index) is cheaper
+const std::size_t max_booked_array = 500;
+
+// the flight numbers booked by `username`, from the cache (see purchases.h),
+// or `std::nullopt` if there are too many of them for an array parameter
+std::optional<std::vector<std::string>> booked_flights(
+	bserv::db_transaction& tx,
+	const std::string& username) {
+	std::optional<std::vector<std::string>> booked = find_purchases(username);
+	if (!booked.has_value()) {
+		bserv::db_result db_res = tx.exec(
+			BSERV_SQL("select flight_number from orders where username = ?;"), username);
+		booked.emplace();
+		for (const auto& row : db_res) {
+			booked.value().emplace_back(row[0].as<std::string>());
+		}
+		// the orders the booking engine has not written yet are missing
+		if (booking() == nullptr || !booking()->has_pending(username))
+			store_purchases(username, booked.value());
+	}
+	if (booked.value().size() > max_booked_array) return std::nullopt;
+	return booked;
+}
+
+// the condition excluding the flights (in `flightinfo`) booked by a user.
+// its parameter is `booked` if it has a value, otherwise the username.
+std::string unbooked_condition(
+	const std::optional<std::vector<std::string>>& booked) {
+	return booked.has_value()
+		? "flight_number <> all(?::text[])"
+		: "not exists (select 1 from orders o where o.username = ? and o.flight_number = flightinfo.flight_number)";
+}
+
+void add_unbooked_parameter(
+	bserv::db_query& query,
+	const std::optional<std::vector<std::string>>& booked,
+	const std::string& username) {
+	if (booked.has_value()) query.add_parameter(booked.value());
+	else query.add_parameter(username);
+}
+
+// a seat of `flight_number` has been booked for `username` from the waitlist
+void waitlist_promoted(const std::string& flight_number, const std::string& username) {
+	count_orders(username, 1);
+	add_purchase(username, flight_number);
+	notify_user(username, {
+		{"type", "waitlist"},
+		{"flight_number", flight_number},
+		{"message", "A seat of flight " + flight_number + " has been booked for you from the waitlist!"}
+	});
+}
+
+// the engine reports the seat changes of its own, see `reserve_seat`
+const booking_observer booking_events{ &waitlist_promoted, &publish_seats };
+
+// books the available seats of `flight_number` for the users on its waitlist,
+// in the order of joining, and returns them.
+// it runs in the transaction that has freed the seats (which holds the row
+// lock of the flight), and the caller calls `waitlist_promoted` after commit.
+std::vector<std::string> promote_waitlist(
+	bserv::db_transaction& tx, const std::string& flight_number) {
+	bserv::db_result db_res = tx.exec(BSERV_SQL(
+		"with next as (select w.id, w.username from waitlist w where w.flight_number = ? "
+		"and not exists (select 1 from orders o where o.username = w.username and o.flight_number = w.flight_number) "
+		"order by w.id limit coalesce((select greatest(available_seat, 0) from flightinfo where flight_number = ?), 0)), "
+		"gone as (delete from waitlist w using next where w.id = next.id returning w.username), "
+		"made as (insert into orders(username, flight_number) select username, ? from gone returning username), "
+		"seat as (update flightinfo set available_seat = available_seat - (select count(*) from made) "
+		"where flight_number = ? returning flight_number) "
+		"select username from made;"), flight_number, flight_number, flight_number, flight_number);
+	std::vector<std::string> promoted;
+	for (const auto& row : db_res) {
+		promoted.emplace_back(row[0].as<std::string>());
+	}
+	return promoted;
+}
+
+void finish_promotion(const std::string& flight_number, const std::vector<std::string>& promoted) {
+	for (const auto& username : promoted) {
+		waitlist_promoted(flight_number, username);
+	}
+}
+
+// books a seat of `flight_number` for `username`, through the booking
+// engine (see booking.h) if it is enabled, otherwise in the database
+booking_status reserve_seat(
+	std::shared_ptr<bserv::db_connection> conn,
+	boost::asio::yield_context& yield,
+	const std::string& flight_number,
+	const std::string& username) {
+	if (booking() != nullptr) {
+		booking()->start(booking_events);
+		return booking()->async_reserve(flight_number, username, 1, yield);
+	}
+	bserv::db_result db_res;
+	try {
+		bserv::db_transaction tx{ conn };
+		// the seat is taken only if one is left, and the order is made in
+		// the same statement, so concurrent purchases cannot oversell.
+		// the row lock of the update serializes the buyers of a flight.
+		db_res = tx.exec(BSERV_SQL(
+			"with seat as (update flightinfo set available_seat = available_seat - 1 "
+			"where flight_number = ? and available_seat > 0 returning flight_number, available_seat), "
+			"made as (insert into orders(username, flight_number) select ?, flight_number from seat "
+			"returning flight_number) "
+			"select available_seat from seat;"), flight_number, username);
+		tx.commit();
+	}
+	// (username, flight_number) is unique, the seat is given back
+	// as the whole statement is rolled back
+	catch (const bserv::db_unique_violation&) {
+		return booking_status::already_booked;
+	}
+	if (db_res.size() == 0) return booking_status::sold_out;
+	publish_seats(flight_number, (*db_res.begin())[0].as<long long>());
+	return booking_status::booked;
+}
+
+// gives back the seats of `flight_number` booked by `username`, see `reserve_seat`.
+// they go to the users on the waitlist first.
+booking_status release_seat(
+	std::shared_ptr<bserv::db_connection> conn,
+	boost::asio::yield_context& yield,
+	const std::string& flight_number,
+	const std::string& username) {
+	if (booking() != nullptr) {
+		booking()->start(booking_events);
+		return booking()->async_release(flight_number, username, yield);
+	}
+	bserv::db_transaction tx{ conn };
+	bserv::db_result db_res = tx.exec(BSERV_SQL(
+		"with deleted as (delete from orders where username = ? and flight_number = ? returning flight_number, seats) "
+		"update flightinfo f set available_seat = f.available_seat + d.seats "
+		"from deleted d where f.flight_number = d.flight_number returning f.available_seat;"),
+		username, flight_number);
+	if (db_res.size() == 0) return booking_status::not_booked;
+	long long available = (*db_res.begin())[0].as<long long>();
+	std::vector<std::string> promoted = promote_waitlist(tx, flight_number);
+	tx.commit();
+	finish_promotion(flight_number, promoted);
+	publish_seats(flight_number, available - (long long)promoted.size());
+	return booking_status::cancelled;
+}
+
+// the message of a failed booking
+const char* booking_failure(booking_status status) {
+	switch (status) {
+	case booking_status::sold_out:
+		return "No available seat! You may join the waitlist of the flight.";
+	case booking_status::already_booked:
+		return "You have already booked this flight!";
+	case booking_status::not_booked:
+		return "The order does not exist!";
+	case booking_status::no_such_flight:
+		return "The flight does not exist!";
+	case booking_status::held:
+		return "You are holding a seat of this flight already!";
+	case booking_status::not_held:
+		return "The hold has expired!";
+	default:
+		return "The booking service is unavailable, please try again later!";
+	}
+}
+
+// the status of an item of a batch purchase, see `purchase_batch`
+const char* booking_status_name(booking_status status) {
+	switch (status) {
+	case booking_status::booked:
+		return "booked";
+	case booking_status::sold_out:
+		return "sold_out";
+	case booking_status::already_booked:
+		return "already_booked";
+	case booking_status::no_such_flight:
+		return "no_such_flight";
+	default:
+		return "failed";
+	}
+}
+
+// books all the `flights` (`seats[i]` seats of `flights[i]`) for `username`
+// in a single statement, or none of them. the statuses are in the same order.
+std::vector<booking_status> reserve_seats(
+	std::shared_ptr<bserv::db_connection> conn,
+	boost::asio::yield_context& yield,
+	const std::vector<std::string>& flights,
+	const std::vector<long long>& seats,
+	const std::string& username) {
+	if (booking() != nullptr) {
+		booking()->start(booking_events);
+		return booking()->async_reserve_batch(flights, seats, username, yield);
+	}
+	std::vector<booking_status> statuses;
+	bserv::db_transaction tx{ conn };
+	// the seats are taken and the orders are made for all the items at once,
+	// the other joins (on the snapshot before the changes) explain the failures
+	bserv::db_result db_res = tx.async_exec(BSERV_SQL(
+		"with items as (select * from unnest(?::text[], ?::int[]) with ordinality as i(flight_number, seats, idx)), "
+		"taken as (update flightinfo f set available_seat = f.available_seat - i.seats from items i "
+		"where f.flight_number = i.flight_number and f.available_seat >= i.seats "
+		"returning f.flight_number, f.available_seat), "
+		"made as (insert into orders(username, flight_number, seats) select ?, i.flight_number, i.seats "
+		"from items i join taken t on t.flight_number = i.flight_number "
+		"on conflict do nothing returning flight_number) "
+		"select m.flight_number is not null, f.flight_number is not null, o.username is not null, t.available_seat "
+		"from items i left join made m on m.flight_number = i.flight_number "
+		"left join taken t on t.flight_number = i.flight_number "
+		"left join flightinfo f on f.flight_number = i.flight_number "
+		"left join orders o on o.username = ? and o.flight_number = i.flight_number "
+		"order by i.idx;"), flights, seats, username, username);
+	bool failed = false;
+	std::vector<long long> available;
+	for (const auto& row : db_res) {
+		if (row[0].as<bool>()) {
+			statuses.emplace_back(booking_status::booked);
+			available.emplace_back(row[3].as<long long>());
+		}
+		else {
+			failed = true;
+			if (!row[1].as<bool>()) statuses.emplace_back(booking_status::no_such_flight);
+			else if (row[2].as<bool>()) statuses.emplace_back(booking_status::already_booked);
+			else statuses.emplace_back(booking_status::sold_out);
+		}
+	}
+	if (!failed) {
+		tx.commit();
+		for (std::size_t i = 0; i < flights.size(); ++i) {
+			publish_seats(flights[i], available[i]);
+		}
+	}
+	else {
+		for (auto& status : statuses) {
+			if (status == booking_status::booked) status = booking_status::cancelled;
+		}
+	}
+	return statuses;
+}
+
+// the longest `Idempotency-Key` accepted
+const std::size_t max_idempotency_key = 255;
+
+// answers the retries of a request with the same `Idempotency-Key` header
+// (of the same user and path) with the stored response of the first one,
+// see idempotency.h. the requests without the header always run.
+// Usage:
+// idempotency_guard guard{ request, response, session, params };
+// if (guard.answered()) return std::nullopt;
+// ... (the changes are committed)
+// guard.committed(context);
+// return guard.complete(render(...));
+class idempotency_guard {
+private:
+	bserv::response_type& response_;
+	std::string key_;
+	// the key is being used by this request
+	bool started_ = false;
+	// the changes of the request are made, so the key is kept
+	bool committed_ = false;
+	bool answered_ = false;
+	void answer(boost::beast::http::status status, const std::string& message) {
+		response_.result(status);
+		response_.set(bserv::http::field::content_type, "text/plain");
+		response_.body() = message;
+		response_.prepare_payload();
+		answered_ = true;
+	}
+public:
+	idempotency_guard(
+		bserv::request_type& request,
+		bserv::response_type& response,
+		bserv::session_type& session,
+		const boost::json::object& params)
+		: response_{ response } {
+		auto header = request.find("Idempotency-Key");
+		if (header == request.end()) return;
+		if (header->value().size() == 0 || header->value().size() > max_idempotency_key) {
+			answer(boost::beast::http::status::bad_request,
+				"`Idempotency-Key` must have 1 to " + std::to_string(max_idempotency_key) + " characters.");
+			return;
+		}
+		std::string username = session.contains("user")
+			? boost::json::value_to<std::string>(session["user"].as_object()["username"]) : "";
+		std::string target{ request.target() };
+		key_ = username + '\n' + target.substr(0, target.find('?'))
+			+ '\n' + std::string{ header->value() };
+		idempotent_response stored;
+		switch (begin_idempotent(key_, boost::json::serialize(params), stored)) {
+		case idempotency_status::started:
+			started_ = true;
+			break;
+		case idempotency_status::completed:
+			response_.result(stored.status);
+			response_.set(bserv::http::field::content_type, stored.content_type);
+			response_.set("Idempotent-Replayed", "true");
+			response_.body() = std::move(stored.body);
+			response_.prepare_payload();
+			answered_ = true;
+			break;
+		case idempotency_status::in_progress:
+			answer(boost::beast::http::status::conflict,
+				"A request with the same `Idempotency-Key` is in progress.");
+			break;
+		case idempotency_status::mismatched:
+			answer(boost::beast::http::status::unprocessable_entity,
+				"The `Idempotency-Key` has been used by a different request.");
+			break;
+		}
+	}
+	idempotency_guard(const idempotency_guard&) = delete;
+	idempotency_guard& operator=(const idempotency_guard&) = delete;
+	// the key is given up if the request fails before its changes are committed
+	~idempotency_guard() {
+		if (started_ && !committed_) abandon_idempotent(key_);
+	}
+	// whether the response has been made by the guard,
+	// in which case the request must not run
+	bool answered() const { return answered_; }
+	// stores the outcome of the request (as json) once its changes are
+	// committed, so that it is not run again if the page fails to render.
+	// it is replaced by the response passed to `complete`.
+	void committed(const boost::json::object& context) {
+		if (!started_) return;
+		complete_idempotent(key_, {
+			(unsigned)boost::beast::http::status::ok,
+			"application/json",
+			boost::json::serialize(context) });
+		committed_ = true;
+	}
+	// stores the response made by the request
+	std::nullopt_t complete(std::nullopt_t) {
+		if (started_) {
+			complete_idempotent(key_, {
+				response_.result_int(),
+				std::string{ response_[bserv::http::field::content_type] },
+				response_.body() });
+			started_ = false;
+		}
+		return std::nullopt;
+	}
+};
+
+// keyset (cursor) pagination.
+// instead of skipping `offset` rows, a page starts right after (or before)
+// the sort key of a row of the neighbouring page, which is found through
+// the index, so every page costs the same.
+// the sort key is carried in the url as a cursor, hex-encoded to fit in `<str>`.
+
+std::string encode_cursor(const std::pair<std::string, std::string>& key) {
+	static const char digits[] = "0123456789abcdef";
+	std::string raw = key.first + '\n' + key.second;
+	std::string cursor;
+	cursor.reserve(raw.size() * 2);
+	for (unsigned char c : raw) {
+		cursor += digits[c >> 4];
+		cursor += digits[c & 15];
+	}
+	return cursor;
+}
+
+std::pair<std::string, std::string> decode_cursor(const std::string& cursor) {
+	auto value_of = [](char c) {
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		throw bserv::url_not_found_exception{};
+	};
+	if (cursor.size() % 2 != 0)
+		throw bserv::url_not_found_exception{};
+	std::string raw;
+	for (std::size_t i = 0; i < cursor.size(); i += 2)
+		raw += (char)(value_of(cursor[i]) * 16 + value_of(cursor[i + 1]));
+	std::size_t pos = raw.find('\n');
+	if (pos == std::string::npos)
+		throw bserv::url_not_found_exception{};
+	return { raw.substr(0, pos), raw.substr(pos + 1) };
+}
+
+struct keyset_listing {
+	// the query without `where`, e.g. "select * from flightinfo"
+	std::string select;
+	// the sort key, e.g. "dept_time, id"
+	std::string key;
+	// the sort key in the reverse order, e.g. "dept_time desc, id desc"
+	std::string reversed_key;
+	bserv::db_relation_to_object& orm;
+	// gets the sort key of a row
+	std::pair<std::string, std::string>(*key_of)(const boost::json::object&);
+};
+
+keyset_listing flights_listing{
+	"select * from flightinfo",
+	"dept_time, id",
+	"dept_time desc, id desc",
+	orm_flight,
+	[](const boost::json::object& flight) {
+		return std::make_pair(
+			boost::json::value_to<std::string>(flight.at("dept_time")),
+			std::to_string(flight.at("id").as_int64()));
+	}
+};
+
+keyset_listing myorders_listing{
+	"select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+	"f.total_seat, f.available_seat from orders o, flightinfo f",
+	"f.dept_time, f.id",
+	"f.dept_time desc, f.id desc",
+	orm_flight,
+	flights_listing.key_of
+};
+
+// superusers first, as in `order by is_superuser desc`
+keyset_listing users_listing{
+	"select * from auth_user",
+	"not is_superuser, id",
+	"not is_superuser desc, id desc",
+	orm_user,
+	[](const boost::json::object& user) {
+		return std::make_pair(
+			std::string{ user.at("is_superuser").as_bool() ? "false" : "true" },
+			std::to_string(user.at("id").as_int64()));
+	}
+};
+
+// fetches the page of `listing` (restricted by `filter`, whose parameters
+// are `params`) in `direction` ("first", "after" or "before") of `cursor`,
+// and sets the cursors of the neighbouring pages to `context["keyset"]`.
+// the rows are allocated with the storage of `context`.
+template <typename ...Params>
+boost::json::array keyset_page(
+	bserv::db_transaction& tx,
+	const keyset_listing& listing,
+	const std::string& direction,
+	const std::string& cursor,
+	boost::json::object& context,
+	const std::string& filter,
+	const Params&... params) {
+	bserv::db_result db_res;
+	std::string query = listing.select;
+	// one more row tells if there is a next page
+	if (direction == "first") {
+		if (filter != "") query += " where " + filter;
+		query += " order by " + listing.key + " limit 11;";
+		db_res = tx.async_exec(query, params...);
+	}
+	else if (direction == "after" || direction == "before") {
+		auto key = decode_cursor(cursor);
+		bool after = direction == "after";
+		query += " where ";
+		if (filter != "") query += filter + " and ";
+		query += "(" + listing.key + ") " + (after ? ">" : "<") + " (?, ?) order by "
+			+ (after ? listing.key : listing.reversed_key) + " limit 11;";
+		db_res = tx.async_exec(query, params..., key.first, key.second);
+	}
+	else throw bserv::url_not_found_exception{};
+	lginfo << db_res.query();
+	auto rows = listing.orm.convert_to_vector(db_res, context.storage());
+	bool more = rows.size() > 10;
+	if (more) rows.pop_back();
+	if (direction == "before") std::reverse(rows.begin(), rows.end());
+	bool has_previous = direction == "after" || (direction == "before" && more);
+	bool has_next = direction == "before" || (direction != "before" && more);
+	boost::json::object keyset{ context.storage() };
+	if (!rows.empty()) {
+		if (has_previous) keyset["previous"] = encode_cursor(listing.key_of(rows.front()));
+		if (has_next) keyset["next"] = encode_cursor(listing.key_of(rows.back()));
+	}
+	// nothing beyond the cursor, so only going back is possible
+	else if (direction == "after") keyset["previous"] = cursor;
+	else if (direction == "before") keyset["next"] = cursor;
+	context["keyset"] = std::move(keyset);
+	boost::json::array json_rows{ context.storage() };
+	json_rows.reserve(rows.size());
+	for (auto& row : rows) {
+		json_rows.push_back(std::move(row));
+	}
+	return json_rows;
+}
+
 std::nullopt_t redirect_to_users(
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
@@ -415,15 +1037,14 @@ std::nullopt_t redirect_to_users(
 	boost::json::object&& context) {
 	lgdebug << "view users: " << page_id << std::endl;
 	bserv::db_transaction tx{ conn };
-	bserv::db_result db_res = tx.exec("select count(*) from auth_user;");
+	auto [total_users, db_res] = counted_page(tx, count_key("auth_user"),
+		bserv::db_query{ "select count(*) from auth_user;" },
+		bserv::db_query{ "select * from auth_user order by is_superuser desc limit 10 offset ?;", (page_id - 1) * 10 });
 	lginfo << db_res.query();
-	std::size_t total_users = (*db_res.begin())[0].as<std::size_t>();
 	lgdebug << "total users: " << total_users << std::endl;
 	int total_pages = (int)total_users / 10;
 	if (total_users % 10 != 0) ++total_pages;
 	lgdebug << "total pages: " << total_pages << std::endl;
-	db_res = tx.exec("select * from auth_user order by is_superuser desc limit 10 offset ?;", (page_id - 1) * 10);
-	lginfo << db_res.query();
 	auto users = orm_user.convert_to_vector(db_res);
 	boost::json::array json_users;
 	for (auto& user : users) {
@@ -478,24 +1099,25 @@ std::nullopt_t all_flights(
 	bserv::session_type& session = *session_ptr;
 	bserv::db_transaction tx{ conn };
 	bserv::db_result db_res;
+	std::size_t total_flights;
 	if (session.contains("user")) {
 		auto user = session["user"].as_object();
 		auto username = boost::json::value_to<std::string>(user["username"]);
-		db_res = tx.exec("select count(*) from flightinfo where flight_number not in (select flight_number from orders where username = ?);", username);
-	}		
+		auto booked = booked_flights(tx, username);
+		bserv::db_query count_query{ "select count(*) from flightinfo where " + unbooked_condition(booked) + ";" };
+		bserv::db_query page_query{ "select * from flightinfo where " + unbooked_condition(booked) + " order by dept_time asc limit 10 offset ?;" };
+		add_unbooked_parameter(count_query, booked, username);
+		add_unbooked_parameter(page_query, booked, username);
+		page_query.add_parameter((page_id - 1) * 10);
+		std::tie(total_flights, db_res) = counted_page(tx, count_key("flightinfo", "unbooked", username), count_query, page_query);
+	}
 	else
-		db_res = tx.exec("select count(*) from flightinfo;");
-	std::size_t total_flights = (*db_res.begin())[0].as<std::size_t>();
+		std::tie(total_flights, db_res) = counted_page(tx, count_key("flightinfo"),
+			bserv::db_query{ "select count(*) from flightinfo;" },
+			bserv::db_query{ "select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10 });
 	int total_pages = (int)total_flights / 10;
 	if (total_flights % 10 != 0) ++total_pages;
 	lgdebug << "total pages: " << total_pages << std::endl;
-	if (session.contains("user")) {
-		auto user = session["user"].as_object();
-		auto username = boost::json::value_to<std::string>(user["username"]);
-		db_res = tx.exec("select * from flightinfo where flight_number not in (select flight_number from orders where username = ?) order by dept_time asc limit 10 offset ?;", username, (page_id - 1) * 10);
-	}
-	else
-		db_res = tx.exec("select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
 	lginfo << db_res.query();
 	auto flights = orm_flight.convert_to_vector(db_res);
 	boost::json::array json_flights;
@@ -551,11 +1173,11 @@ std::nullopt_t all_flights_admin(
 	boost::json::object&& context) {
 	bserv::session_type& session = *session_ptr;
 	bserv::db_transaction tx{ conn };
-	bserv::db_result db_res = tx.exec("select count(*) from flightinfo;");
-	std::size_t total_flights = (*db_res.begin())[0].as<std::size_t>();
+	auto [total_flights, db_res] = counted_page(tx, count_key("flightinfo"),
+		bserv::db_query{ "select count(*) from flightinfo;" },
+		bserv::db_query{ "select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10 });
 	int total_pages = (int)total_flights / 10;
 	if (total_flights % 10 != 0) ++total_pages;
-	db_res = tx.exec("select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
 	lginfo << db_res.query();
 	auto flights = orm_flight.convert_to_vector(db_res);
 	boost::json::array json_flights;
@@ -615,14 +1237,15 @@ std::nullopt_t all_orders(
 	auto username = user["username"].as_string();
 	auto is_superuser = user["is_superuser"].as_bool();
 	bserv::db_result db_res;
+	std::size_t total_orders;
 	int total_pages;
 	boost::json::array json_orders;
 	if (is_superuser == true) {
-		db_res = tx.exec("select count(*) from orders;");
-		std::size_t total_orders = (*db_res.begin())[0].as<std::size_t>();
+		std::tie(total_orders, db_res) = counted_page(tx, count_key("orders"),
+			bserv::db_query{ "select count(*) from orders;" },
+			bserv::db_query{ "select f.flight_number, f.departure, f.destination, f.dept_time, f.arrv_time, f.airline, f.price, o.username from orders o, flightinfo f where o.flight_number = f.flight_number order by f.dept_time asc limit 10 offset ?;", (page_id - 1) * 10 });
 		total_pages = (int)total_orders / 10;
 		if (total_orders % 10 != 0) ++total_pages;
-		db_res = tx.exec("select f.flight_number, f.departure, f.destination, f.dept_time, f.arrv_time, f.airline, f.price, o.username from orders o, flightinfo f where o.flight_number = f.flight_number order by f.dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
 		auto orders = orm_order.convert_to_vector(db_res);
 		for (auto& order : orders) {
 			json_orders.push_back(order);
@@ -630,13 +1253,13 @@ std::nullopt_t all_orders(
 		lgdebug << json_orders;
 	}
 	else {
-		db_res = tx.exec("select count(*) from orders where username = ?;", username);
-		std::size_t total_orders = (*db_res.begin())[0].as<std::size_t>();
+		std::tie(total_orders, db_res) = counted_page(tx, count_key("orders", username),
+			bserv::db_query{ "select count(*) from orders where username = ?;", username },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+				"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number order by f.dept_time asc limit 10 offset ? ; "
+				, username, (page_id - 1) * 10 });
 		total_pages = (int)total_orders / 10;
 		if (total_orders % 10 != 0) ++total_pages;
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number order by f.dept_time asc limit 10 offset ? ; "
-			, username, (page_id - 1) * 10);
 		auto orders = orm_flight.convert_to_vector(db_res);
 		for (auto& order : orders) {
 			json_orders.push_back(order);
@@ -705,8 +1328,7 @@ std::nullopt_t view_flights(
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
 	bserv::response_type& response,
-	const std::string& page_num) {
-	int page_id = std::stoi(page_num);
+	int page_id) {
 	boost::json::object context;
 	return all_flights(conn, session_ptr, response, page_id, std::move(context));
 }
@@ -715,8 +1337,7 @@ std::nullopt_t view_flights_admin(
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
 	bserv::response_type& response,
-	const std::string& page_num) {
-	int page_id = std::stoi(page_num);
+	int page_id) {
 	boost::json::object context = {
 		{"admin", true}
 	};
@@ -727,8 +1348,7 @@ std::nullopt_t view_orders(
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
 	bserv::response_type& response,
-	const std::string& page_num) {
-	int page_id = std::stoi(page_num);
+	int page_id) {
 	boost::json::object context;
 	return all_orders(conn, session_ptr, response, page_id, std::move(context));
 }
@@ -737,12 +1357,84 @@ std::nullopt_t view_users(
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
 	bserv::response_type& response,
-	const std::string& page_num) {
-	int page_id = std::stoi(page_num);
+	int page_id) {
 	boost::json::object context = {{"admin", true}};
 	return redirect_to_users(conn, session_ptr, response, page_id, std::move(context));
 }
 
+std::nullopt_t view_flights_keyset(
+	std::shared_ptr<bserv::db_connection> conn,
+	std::shared_ptr<bserv::session_type> session_ptr,
+	bserv::response_type& response,
+	boost::json::storage_ptr storage,
+	const std::string& direction,
+	const std::string& cursor) {
+	bserv::session_type& session = *session_ptr;
+	bserv::db_transaction tx{ conn };
+	boost::json::object context{ storage };
+	if (session.contains("user")) {
+		auto user = session["user"].as_object();
+		auto username = boost::json::value_to<std::string>(user["username"]);
+		auto booked = booked_flights(tx, username);
+		if (booked.has_value())
+			context["flights"] = keyset_page(tx, flights_listing, direction, cursor, context,
+				unbooked_condition(booked), booked.value());
+		else
+			context["flights"] = keyset_page(tx, flights_listing, direction, cursor, context,
+				unbooked_condition(booked), username);
+	}
+	else context["flights"] = keyset_page(tx, flights_listing, direction, cursor, context, "");
+	return index("flights.html", session_ptr, response, context);
+}
+
+std::nullopt_t view_flights_admin_keyset(
+	std::shared_ptr<bserv::db_connection> conn,
+	std::shared_ptr<bserv::session_type> session_ptr,
+	bserv::response_type& response,
+	boost::json::storage_ptr storage,
+	const std::string& direction,
+	const std::string& cursor) {
+	bserv::db_transaction tx{ conn };
+	boost::json::object context{ { {"admin", true} }, storage };
+	context["flights"] = keyset_page(tx, flights_listing, direction, cursor, context, "");
+	return index("flights_admin.html", session_ptr, response, context);
+}
+
+std::nullopt_t view_orders_keyset(
+	std::shared_ptr<bserv::db_connection> conn,
+	std::shared_ptr<bserv::session_type> session_ptr,
+	bserv::response_type& response,
+	boost::json::storage_ptr storage,
+	const std::string& direction,
+	const std::string& cursor) {
+	bserv::session_type& session = *session_ptr;
+	auto user = session["user"].as_object();
+	// the orders of all users have no unique sort key, they are paged by number
+	if (user["is_superuser"].as_bool() == true) {
+		if (direction != "first") throw bserv::url_not_found_exception{};
+		return all_orders(conn, session_ptr, response, 1, {});
+	}
+	auto username = user["username"].as_string();
+	bserv::db_transaction tx{ conn };
+	boost::json::object context{ storage };
+	context["orders"] = keyset_page(tx, myorders_listing, direction, cursor, context,
+		"o.username = ? and o.flight_number = f.flight_number", username);
+	return index("myorders.html", session_ptr, response, context);
+}
+
+std::nullopt_t view_users_keyset(
+	std::shared_ptr<bserv::db_connection> conn,
+	std::shared_ptr<bserv::session_type> session_ptr,
+	bserv::response_type& response,
+	boost::json::storage_ptr storage,
+	const std::string& direction,
+	const std::string& cursor) {
+	bserv::db_transaction tx{ conn };
+	boost::json::object context{ { {"admin", true} }, storage };
+	context["users"] = keyset_page(tx, users_listing, direction, cursor, context, "");
+	return index("users.html", session_ptr, response, context);
+}
+
 std::nullopt_t alter_user_status(
 	std::shared_ptr<bserv::db_connection> conn,
 	boost::json::object&& params,
@@ -754,17 +1446,17 @@ std::nullopt_t alter_user_status(
 	auto userid = params["id"].as_string();
 	auto is_active = params["is_active"].as_string();
 	if (is_active == "true")
-		tx.exec("update auth_user set is_active = false where id = ?", userid);
+		tx.exec(BSERV_SQL("update auth_user set is_active = false where id = ?"), userid);
 	else
-		tx.exec("update auth_user set is_active = true where id = ?", userid);
+		tx.exec(BSERV_SQL("update auth_user set is_active = true where id = ?"), userid);
 	boost::json::object context = { {"admin", true} };
 	int page_id = 1;
-	bserv::db_result db_res = tx.exec("select count(*) from auth_user;");
-	std::size_t total_users = (*db_res.begin())[0].as<std::size_t>();
+	auto [total_users, db_res] = counted_page(tx, count_key("auth_user"),
+		bserv::db_query{ "select count(*) from auth_user;" },
+		bserv::db_query{ "select * from auth_user order by is_superuser desc limit 10 offset ?;", (page_id - 1) * 10 });
 	int total_pages = (int)total_users / 10;
 	if (total_users % 10 != 0) ++total_pages;
 	lgdebug << "total pages: " << total_pages << std::endl;
-	db_res = tx.exec("select * from auth_user order by is_superuser desc limit 10 offset ?;", (page_id - 1) * 10);
 	tx.commit();
 	auto users = orm_user.convert_to_vector(db_res);
 	boost::json::array json_users;
@@ -821,154 +1513,110 @@ std::nullopt_t form_add_user(
 	return index("index.html", session_ptr, response, context);
 }
 
+// the optional filters of the flight search, a filter is applied if its
+// parameter is not empty. the applied filters form a mask (bit `i` for
+// `flight_filters[i]`), and the sql text only depends on the mask, so each
+// combination of filters is a single statement, prepared once per connection.
+struct flight_filter {
+	const char* name;
+	const char* predicate;
+	// whether the value is bound as an integer
+	bool integer;
+};
+
+const std::vector<flight_filter> flight_filters{
+	{ "departure", "departure = ?", false },
+	{ "destination", "destination = ?", false },
+	{ "airline", "airline = ?", false },
+	{ "min_price", "price >= ?", true },
+	{ "max_price", "price <= ?", true },
+	{ "dept_after", "dept_time >= ?", false },
+	{ "dept_before", "dept_time <= ?", false },
+	{ "min_seats", "available_seat >= ?", true }
+};
+
+// the `where` clause of the filters in `mask`, followed by `unbooked`
+// (which excludes the flights booked by a user) if it is not empty
+std::string flight_search_where(unsigned mask, const std::string& unbooked) {
+	std::string where;
+	for (std::size_t i = 0; i < flight_filters.size(); ++i) {
+		if ((mask & (1u << i)) == 0) continue;
+		where += where == "" ? " where " : " and ";
+		where += flight_filters[i].predicate;
+	}
+	if (unbooked != "") {
+		where += where == "" ? " where " : " and ";
+		where += unbooked;
+	}
+	return where;
+}
+
+std::int64_t parse_filter_integer(const std::string& name, const std::string& value) {
+	std::int64_t number{};
+	const char* end = value.data() + value.size();
+	auto [ptr, ec] = std::from_chars(value.data(), end, number);
+	if (ec != std::errc{} || ptr != end)
+		throw bserv::bad_request_exception{ "'" + name + "' is not a valid number." };
+	return number;
+}
+
 std::nullopt_t search_flights(
 	bserv::request_type& request,
 	bserv::response_type& response,
 	boost::json::object&& params,
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
-	const std::string& page_num) {
+	int page_id) {
 	bserv::session_type& session = *session_ptr;
 	bserv::db_transaction tx{ conn };
 	lgdebug << params;
-	auto departure = params["departure"].as_string();
-	auto destination = params["destination"].as_string();
-	auto airline = params["airline"].as_string();
-	int page_id = std::stoi(page_num);
-	bserv::db_result db_res;
-	std::size_t total_flights;
+	// the flights already booked by a (non-admin) user are not listed
+	std::string uname;
 	lgdebug << session;
 	if (session.contains("user")) {
 		auto user = session["user"].as_object();
-		auto uname = user["username"].as_string();
-		auto is_superuser = user["is_superuser"].as_bool();
-		if (is_superuser == true) {
-			if (departure == "" && destination == "" && airline == "") {
-				db_res = tx.exec("select count(*) from flightinfo;");
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
-			}
-			if (departure == "" && destination == "" && airline != "") {
-				db_res = tx.exec("select count(*) from flightinfo where airline = ?;", airline);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where airline = ? order by dept_time asc limit 10 offset ?;", airline, (page_id - 1) * 10);
-			}
-			if (departure == "" && destination != "" && airline == "") {
-				db_res = tx.exec("select count(*) from flightinfo where destination = ?;", destination);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where destination = ? order by dept_time asc limit 10 offset ?;", destination, (page_id - 1) * 10);
-			}
-			if (departure == "" && destination != "" && airline != "") {
-				db_res = tx.exec("select count(*) from flightinfo where destination = ? and airline = ?;", destination, airline);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where destination = ? and airline = ? order by dept_time asc limit 10 offset ?;", destination, airline, (page_id - 1) * 10);
-			}
-			if (departure != "" && destination == "" && airline == "") {
-				db_res = tx.exec("select count(*) from flightinfo where departure = ?;", departure);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where departure = ? order by dept_time limit 10 offset ?;", departure, (page_id - 1) * 10);
-			}
-			if (departure != "" && destination == "" && airline != "") {
-				db_res = tx.exec("select count(*) from flightinfo where departure = ? and airline = ?;", departure, airline);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where departure = ? and airline = ? order by dept_time asc limit 10 offset ?;", departure, airline, (page_id - 1) * 10);
-			}
-			if (departure != "" && destination != "" && airline == "") {
-				db_res = tx.exec("select count(*) from flightinfo where departure = ? and destination = ?;", departure, destination);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where departure = ? and destination = ? order by dept_time asc limit 10 offset ?;", departure, destination, (page_id - 1) * 10);
-			}
-			if (departure != "" && destination != "" && airline != "") {
-				db_res = tx.exec("select count(*) from flightinfo where departure = ? and destination = ? and airline = ?;", departure, destination, airline);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where departure = ? and destination = ? and airline = ? order by dept_time asc limit 10 offset ?;", departure, destination, airline, (page_id - 1) * 10);
-			}
+		if (!user["is_superuser"].as_bool())
+			uname = boost::json::value_to<std::string>(user["username"]);
+	}
+	unsigned mask = 0;
+	std::string key = uname == ""
+		? count_key("flightinfo", "search")
+		: count_key("flightinfo", "unbooked", uname, "search");
+	std::string filters;
+	for (std::size_t i = 0; i < flight_filters.size(); ++i) {
+		std::string value = get_or_empty(params, flight_filters[i].name);
+		if (value == "") continue;
+		mask |= 1u << i;
+		if (filters != "") filters += "&";
+		filters += std::string{ flight_filters[i].name } + "=" + bserv::utils::encode_url(value);
+	}
+	std::optional<std::vector<std::string>> booked;
+	if (uname != "") booked = booked_flights(tx, uname);
+	std::string where = flight_search_where(mask,
+		uname != "" ? unbooked_condition(booked) : "");
+	bserv::db_query count_query{ "select count(*) from flightinfo" + where + ";" };
+	bserv::db_query page_query{ "select * from flightinfo" + where + " order by dept_time, id limit 10 offset ?;" };
+	for (std::size_t i = 0; i < flight_filters.size(); ++i) {
+		if ((mask & (1u << i)) == 0) continue;
+		std::string value = get_or_empty(params, flight_filters[i].name);
+		if (flight_filters[i].integer) {
+			std::int64_t number = parse_filter_integer(flight_filters[i].name, value);
+			count_query.add_parameter(number);
+			page_query.add_parameter(number);
 		}
 		else {
-			if (departure == "" && destination == "" && airline == "") {
-				db_res = tx.exec("select count(*) from flightinfo where flight_number not in (select flight_number from orders where username = ?);", uname);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where flight_number not in (select flight_number from orders where username = ?) order by dept_time asc limit 10 offset ?;", uname, (page_id - 1) * 10);
-			}
-			if (departure == "" && destination == "" && airline != "") {
-				db_res = tx.exec("select count(*) from flightinfo where airline = ? and flight_number not in (select flight_number from orders where username = ?);", airline, uname);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where airline = ? and flight_number not in (select flight_number from orders where username = ?) order by dept_time asc limit 10 offset ?;", airline, uname, (page_id - 1) * 10);
-			}
-			if (departure == "" && destination != "" && airline == "") {
-				db_res = tx.exec("select count(*) from flightinfo where destination = ? and flight_number not in (select flight_number from orders where username = ?);", destination, uname);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where destination = ? and flight_number not in (select flight_number from orders where username = ?) order by dept_time asc limit 10 offset ?;", destination, uname, (page_id - 1) * 10);
-			}
-			if (departure == "" && destination != "" && airline != "") {
-				db_res = tx.exec("select count(*) from flightinfo where destination = ? and airline = ? and flight_number not in (select flight_number from orders where username = ?);", destination, airline, uname);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where destination = ? and airline = ? and flight_number not in (select flight_number from orders where username = ?) order by dept_time asc limit 10 offset ?;", destination, airline, uname, (page_id - 1) * 10);
-			}
-			if (departure != "" && destination == "" && airline == "") {
-				db_res = tx.exec("select count(*) from flightinfo where departure = ? and flight_number not in (select flight_number from orders where username = ?);", departure, uname);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where departure = ? and flight_number not in (select flight_number from orders where username = ?) order by dept_time limit 10 offset ?;", departure, uname, (page_id - 1) * 10);
-			}
-			if (departure != "" && destination == "" && airline != "") {
-				db_res = tx.exec("select count(*) from flightinfo where departure = ? and airline = ? and flight_number not in (select flight_number from orders where username = ?);", departure, airline, uname);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where departure = ? and airline = ? and flight_number not in (select flight_number from orders where username = ?) order by dept_time asc limit 10 offset ?;", departure, airline, uname, (page_id - 1) * 10);
-			}
-			if (departure != "" && destination != "" && airline == "") {
-				db_res = tx.exec("select count(*) from flightinfo where departure = ? and destination = ? and flight_number not in (select flight_number from orders where username = ?);", departure, destination, uname);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where departure = ? and destination = ? and flight_number not in (select flight_number from orders where username = ?) order by dept_time asc limit 10 offset ?;", departure, destination, uname, (page_id - 1) * 10);
-			}
-			if (departure != "" && destination != "" && airline != "") {
-				db_res = tx.exec("select count(*) from flightinfo where departure = ? and destination = ? and airline = ? and flight_number not in (select flight_number from orders where username = ?);", departure, destination, airline, uname);
-				total_flights = (*db_res.begin())[0].as<std::size_t>();
-				db_res = tx.exec("select * from flightinfo where departure = ? and destination = ? and airline = ? and flight_number not in (select flight_number from orders where username = ?) order by dept_time asc limit 10 offset ?;", departure, destination, airline, uname, (page_id - 1) * 10);
-			}
+			count_query.add_parameter(value);
+			page_query.add_parameter(value);
 		}
 	}
-	else {
-		if (departure == "" && destination == "" && airline == "") {
-			db_res = tx.exec("select count(*) from flightinfo;");
-			total_flights = (*db_res.begin())[0].as<std::size_t>();
-			db_res = tx.exec("select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
-		}
-		if (departure == "" && destination == "" && airline != "") {
-			db_res = tx.exec("select count(*) from flightinfo where airline = ?;", airline);
-			total_flights = (*db_res.begin())[0].as<std::size_t>();
-			db_res = tx.exec("select * from flightinfo where airline = ? order by dept_time asc limit 10 offset ?;", airline, (page_id - 1) * 10);
-		}
-		if (departure == "" && destination != "" && airline == "") {
-			db_res = tx.exec("select count(*) from flightinfo where destination = ?;", destination);
-			total_flights = (*db_res.begin())[0].as<std::size_t>();
-			db_res = tx.exec("select * from flightinfo where destination = ? order by dept_time asc limit 10 offset ?;", destination, (page_id - 1) * 10);
-		}
-		if (departure == "" && destination != "" && airline != "") {
-			db_res = tx.exec("select count(*) from flightinfo where destination = ? and airline = ?;", destination, airline);
-			total_flights = (*db_res.begin())[0].as<std::size_t>();
-			db_res = tx.exec("select * from flightinfo where destination = ? and airline = ? order by dept_time asc limit 10 offset ?;", destination, airline, (page_id - 1) * 10);
-		}
-		if (departure != "" && destination == "" && airline == "") {
-			db_res = tx.exec("select count(*) from flightinfo where departure = ?;", departure);
-			total_flights = (*db_res.begin())[0].as<std::size_t>();
-			db_res = tx.exec("select * from flightinfo where departure = ? order by dept_time limit 10 offset ?;", departure, (page_id - 1) * 10);
-		}
-		if (departure != "" && destination == "" && airline != "") {
-			db_res = tx.exec("select count(*) from flightinfo where departure = ? and airline = ?;", departure, airline);
-			total_flights = (*db_res.begin())[0].as<std::size_t>();
-			db_res = tx.exec("select * from flightinfo where departure = ? and airline = ? order by dept_time asc limit 10 offset ?;", departure, airline, (page_id - 1) * 10);
-		}
-		if (departure != "" && destination != "" && airline == "") {
-			db_res = tx.exec("select count(*) from flightinfo where departure = ? and destination = ?;", departure, destination);
-			total_flights = (*db_res.begin())[0].as<std::size_t>();
-			db_res = tx.exec("select * from flightinfo where departure = ? and destination = ? order by dept_time asc limit 10 offset ?;", departure, destination, (page_id - 1) * 10);
-		}
-		if (departure != "" && destination != "" && airline != "") {
-			db_res = tx.exec("select count(*) from flightinfo where departure = ? and destination = ? and airline = ?;", departure, destination, airline);
-			total_flights = (*db_res.begin())[0].as<std::size_t>();
-			db_res = tx.exec("select * from flightinfo where departure = ? and destination = ? and airline = ? order by dept_time asc limit 10 offset ?;", departure, destination, airline, (page_id - 1) * 10);
-		}
+	if (uname != "") {
+		add_unbooked_parameter(count_query, booked, uname);
+		add_unbooked_parameter(page_query, booked, uname);
 	}
+	page_query.add_parameter((page_id - 1) * 10);
+	// only the count of the unfiltered search is cached
+	if (mask != 0) key = "";
+	auto [total_flights, db_res] = counted_page(tx, key, count_query, page_query);
 	int total_pages = (int)total_flights / 10;
 	if (total_flights % 10 != 0) ++total_pages;
 	auto flights = orm_flight.convert_to_vector(db_res);
@@ -1016,12 +1664,8 @@ std::nullopt_t search_flights(
 		lgdebug << context;
 	}
 	context["flights"] = json_flights;
-	std::string dep = boost::json::value_to<std::string>(params["departure"]);
-	std::string dest = boost::json::value_to<std::string>(params["destination"]);
-	std::string airl = boost::json::value_to<std::string>(params["airline"]);
-	context["departure"] = bserv::utils::encode_url(dep);
-	context["destination"] = bserv::utils::encode_url(dest);
-	context["airline"] = bserv::utils::encode_url(airl);
+	// the query string of the filters, for the links to the other pages
+	context["filters"] = filters;
 	lgdebug << context;
 	if (session.contains("user")) {
 		auto user = session["user"].as_object();
@@ -1040,23 +1684,100 @@ std::nullopt_t make_purchase(
 	bserv::response_type& response,
 	boost::json::object&& params,
 	std::shared_ptr<bserv::db_connection> conn,
-	std::shared_ptr<bserv::session_type> session_ptr) {
-	if (request.method() != boost::beast::http::verb::post) {
-		throw bserv::url_not_found_exception{};
+	std::shared_ptr<bserv::session_type> session_ptr,
+	boost::asio::yield_context& yield) {
+	bserv::session_type& session = *session_ptr;
+	idempotency_guard guard{ request, response, session, params };
+	if (guard.answered()) return std::nullopt;
+	boost::json::object context;
+	lgdebug << params;
+	auto user = session["user"].as_object();
+	auto username = boost::json::value_to<std::string>(user["username"]);
+	auto flight_number = boost::json::value_to<std::string>(params["flight_number"]);
+	booking_status status = reserve_seat(conn, yield, flight_number, username);
+	if (status == booking_status::booked) {
+		count_orders(username, 1);
+		add_purchase(username, flight_number);
+		context = {
+			{"success", true},
+			{"message", "Order successfully made!"}
+		};
+	}
+	else {
+		context = {
+			{"success", false},
+			{"message", booking_failure(status)}
+		};
 	}
+	guard.committed(context);
+	return guard.complete(all_flights(conn, session_ptr, response, 1, std::move(context)));
+}
+
+// holds a seat for the hold duration, the order is made by `confirm_seat`.
+// the holds are kept by the booking engine only.
+std::nullopt_t hold_seat(
+	bserv::request_type& request,
+	bserv::response_type& response,
+	boost::json::object&& params,
+	std::shared_ptr<bserv::db_connection> conn,
+	std::shared_ptr<bserv::session_type> session_ptr,
+	boost::asio::yield_context& yield) {
 	bserv::session_type& session = *session_ptr;
 	boost::json::object context;
 	lgdebug << params;
 	auto user = session["user"].as_object();
-	auto username = user["username"].as_string();
-	auto flight_number = params["flight_number"].as_string();
-	auto available_seat = params["available_seat"].as_string();
-	if (available_seat != "0") {
-		bserv::db_transaction tx{ conn };
-		bserv::db_result db_res;
-		db_res = tx.exec("insert into orders(username, flight_number) values(?, ?);", username, flight_number);
-		tx.exec("update flightinfo set available_seat = available_seat - 1 where flight_number = ?", flight_number);
-		tx.commit();
+	auto username = boost::json::value_to<std::string>(user["username"]);
+	auto flight_number = boost::json::value_to<std::string>(params["flight_number"]);
+	if (booking() == nullptr) {
+		context = {
+			{"success", false},
+			{"message", "Holding a seat is not supported!"}
+		};
+		return all_flights(conn, session_ptr, response, 1, std::move(context));
+	}
+	booking()->start(booking_events);
+	booking_status status = booking()->async_hold(flight_number, username, yield);
+	if (status == booking_status::held) {
+		auto minutes = booking()->hold_duration().count();
+		context = {
+			{"success", true},
+			{"message", "The seat is held for " + std::to_string(minutes) + " minutes!"},
+			{"hold", {
+				{"flight_number", flight_number},
+				{"minutes", minutes}
+			}}
+		};
+	}
+	else {
+		context = {
+			{"success", false},
+			{"message", booking_failure(status)}
+		};
+	}
+	return all_flights(conn, session_ptr, response, 1, std::move(context));
+}
+
+std::nullopt_t confirm_seat(
+	bserv::request_type& request,
+	bserv::response_type& response,
+	boost::json::object&& params,
+	std::shared_ptr<bserv::db_connection> conn,
+	std::shared_ptr<bserv::session_type> session_ptr,
+	boost::asio::yield_context& yield) {
+	bserv::session_type& session = *session_ptr;
+	boost::json::object context;
+	lgdebug << params;
+	auto user = session["user"].as_object();
+	auto username = boost::json::value_to<std::string>(user["username"]);
+	auto flight_number = boost::json::value_to<std::string>(params["flight_number"]);
+	booking_status status = booking_status::not_held;
+	if (booking() != nullptr) {
+		booking()->start(booking_events);
+		status = booking()->async_confirm(flight_number, username, yield);
+	}
+	if (status == booking_status::booked) {
+		count_orders(username, 1);
+		add_purchase(username, flight_number);
 		context = {
 			{"success", true},
 			{"message", "Order successfully made!"}
@@ -1065,19 +1786,153 @@ std::nullopt_t make_purchase(
 	else {
 		context = {
 			{"success", false},
-			{"message", "No available seat!"}
+			{"message", booking_failure(status)}
+		};
+	}
+	return all_flights(conn, session_ptr, response, 1, std::move(context));
+}
+
+// the user is booked a seat once one is given back, and is notified
+// through `ws_notifications`
+std::nullopt_t join_waitlist(
+	bserv::request_type& request,
+	bserv::response_type& response,
+	boost::json::object&& params,
+	std::shared_ptr<bserv::db_connection> conn,
+	std::shared_ptr<bserv::session_type> session_ptr) {
+	bserv::session_type& session = *session_ptr;
+	boost::json::object context;
+	lgdebug << params;
+	auto user = session["user"].as_object();
+	auto username = boost::json::value_to<std::string>(user["username"]);
+	auto flight_number = boost::json::value_to<std::string>(params["flight_number"]);
+	bserv::db_transaction tx{ conn };
+	bserv::db_result db_res = tx.exec(BSERV_SQL(
+		"insert into waitlist(username, flight_number) select ?, flight_number from flightinfo f "
+		"where f.flight_number = ? and not exists "
+		"(select 1 from orders o where o.username = ? and o.flight_number = f.flight_number) "
+		"on conflict do nothing returning id;"), username, flight_number, username);
+	if (db_res.size() == 0) {
+		context = {
+			{"success", false},
+			{"message", "You have booked this flight or joined its waitlist already!"}
+		};
+		return all_flights(conn, session_ptr, response, 1, std::move(context));
+	}
+	std::vector<std::string> promoted;
+	std::optional<long long> available;
+	// a seat left now goes to the waitlist at once
+	// (by the booking engine, if the flight is loaded)
+	if (booking() == nullptr) promoted = promote_waitlist(tx, flight_number);
+	if (!promoted.empty()) {
+		db_res = tx.exec(BSERV_SQL(
+			"select available_seat from flightinfo where flight_number = ?;"), flight_number);
+		available = (*db_res.begin())[0].as<long long>();
+	}
+	tx.commit();
+	if (booking() != nullptr) booking()->join_waitlist(flight_number, username);
+	finish_promotion(flight_number, promoted);
+	if (available.has_value()) publish_seats(flight_number, available.value());
+	if (std::find(promoted.begin(), promoted.end(), username) != promoted.end()) {
+		context = {
+			{"success", true},
+			{"message", "Order successfully made!"}
+		};
+	}
+	else {
+		context = {
+			{"success", true},
+			{"message", "You have joined the waitlist, you will be notified when a seat is booked for you."}
 		};
 	}
 	return all_flights(conn, session_ptr, response, 1, std::move(context));
 }
 
+// the limits of a batch purchase
+const std::size_t max_batch_items = 50;
+const long long max_batch_seats = 100;
+
+// books a group or an itinerary in one request, all or nothing:
+// {"items": [{"flight_number": "CA1234", "count": 2}, ...]}.
+// the result of each item is one of `booked`, `sold_out`, `already_booked`,
+// `no_such_flight`, `failed`, or `aborted` if it is not booked because
+// another item has failed.
+boost::json::object purchase_batch(
+	bserv::request_type& request,
+	boost::json::object&& params,
+	std::shared_ptr<bserv::db_connection> conn,
+	std::shared_ptr<bserv::session_type> session_ptr,
+	boost::asio::yield_context& yield) {
+	bserv::session_type& session = *session_ptr;
+	if (!session.contains("user")) {
+		return {
+			{"success", false},
+			{"message", "Not logged in"}
+		};
+	}
+	auto username = boost::json::value_to<std::string>(session["user"].as_object()["username"]);
+	const boost::json::array* items = params.contains("items") ? params["items"].if_array() : nullptr;
+	if (items == nullptr || items->empty() || items->size() > max_batch_items) {
+		return {
+			{"success", false},
+			{"message", "`items` must be a list of 1 to " + std::to_string(max_batch_items) + " flights"}
+		};
+	}
+	std::vector<std::string> flights;
+	std::vector<long long> seats;
+	for (const auto& item : *items) {
+		const boost::json::object* obj = item.if_object();
+		const boost::json::value* flight_number = obj != nullptr ? obj->if_contains("flight_number") : nullptr;
+		const boost::json::value* count = obj != nullptr ? obj->if_contains("count") : nullptr;
+		if (flight_number == nullptr || !flight_number->is_string()
+			|| (count != nullptr && (!count->is_int64()
+				|| count->as_int64() < 1 || count->as_int64() > max_batch_seats))) {
+			return {
+				{"success", false},
+				{"message", "an item must have a `flight_number` and a `count` of 1 to " + std::to_string(max_batch_seats)}
+			};
+		}
+		auto flight = boost::json::value_to<std::string>(*flight_number);
+		// an order holds all the seats of a flight
+		if (std::find(flights.begin(), flights.end(), flight) != flights.end()) {
+			return {
+				{"success", false},
+				{"message", "`" + flight + "` appears more than once"}
+			};
+		}
+		flights.emplace_back(flight);
+		seats.emplace_back(count != nullptr ? count->as_int64() : 1);
+	}
+	std::vector<booking_status> statuses = reserve_seats(conn, yield, flights, seats, username);
+	bool success = std::all_of(statuses.begin(), statuses.end(),
+		[](booking_status status) { return status == booking_status::booked; });
+	boost::json::array results;
+	for (std::size_t i = 0; i < flights.size(); ++i) {
+		results.push_back({
+			{"flight_number", flights[i]},
+			{"count", seats[i]},
+			{"status", statuses[i] == booking_status::cancelled ? "aborted" : booking_status_name(statuses[i])}
+		});
+	}
+	if (success) {
+		count_orders(username, (long long)flights.size());
+		for (const auto& flight_number : flights) {
+			add_purchase(username, flight_number);
+		}
+	}
+	return {
+		{"success", success},
+		{"results", results}
+	};
+}
+
 std::nullopt_t search_myorders(
 	bserv::request_type& request,
 	bserv::response_type& response,
 	boost::json::object&& params,
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
-	const std::string& page_num) {
+	int page_id) {
 	bserv::session_type& session = *session_ptr;
 	boost::json::object context;
 	auto user = session["user"].as_object();
@@ -1086,56 +1941,59 @@ std::nullopt_t search_myorders(
 	auto departure = params["departure"].as_string();
 	auto destination = params["destination"].as_string();
 	auto airline = params["airline"].as_string();
-	int page_id = std::stoi(page_num);
 	bserv::db_result db_res;
 	std::size_t total_orders;
+	// only the count of the unfiltered search is cached
+	std::string key;
+	if (departure == "" && destination == "" && airline == "")
+		key = count_key("orders", username, "search");
 	if (departure == "" && destination == "" && airline == "") {
-		db_res = tx.exec("select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number;", username);
-		total_orders = (*db_res.begin())[0].as<std::size_t>();
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number order by f.dept_time asc limit 10 offset ?;", username, (page_id - 1) * 10);
+		std::tie(total_orders, db_res) = counted_page(tx, key,
+			bserv::db_query{ "select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number;", username },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+			"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number order by f.dept_time asc limit 10 offset ?;", username, (page_id - 1) * 10 });
 	}
 	if (departure == "" && destination == "" && airline != "") {
-		db_res = tx.exec("select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.airline = ?;", username, airline);
-		total_orders = (*db_res.begin())[0].as<std::size_t>();
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.airline = ? order by f.dept_time asc limit 10 offset ?;", username, airline, (page_id - 1) * 10);
+		std::tie(total_orders, db_res) = counted_page(tx, key,
+			bserv::db_query{ "select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.airline = ?;", username, airline },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+			"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.airline = ? order by f.dept_time asc limit 10 offset ?;", username, airline, (page_id - 1) * 10 });
 	}
 	if (departure == "" && destination != "" && airline == "") {
-		db_res = tx.exec("select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.destination = ?;", username, destination);
-		total_orders = (*db_res.begin())[0].as<std::size_t>();
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.destination = ? order by f.dept_time asc limit 10 offset ?;", username, destination, (page_id - 1) * 10);
+		std::tie(total_orders, db_res) = counted_page(tx, key,
+			bserv::db_query{ "select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.destination = ?;", username, destination },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+			"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.destination = ? order by f.dept_time asc limit 10 offset ?;", username, destination, (page_id - 1) * 10 });
 	}
 	if (departure == "" && destination != "" && airline != "") {
-		db_res = tx.exec("select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.destination = ? and f.airline = ?;", username, destination, airline);
-		total_orders = (*db_res.begin())[0].as<std::size_t>();
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.destination = ? and f.airline = ? order by f.dept_time asc limit 10 offset ?;", username, destination, airline, (page_id - 1) * 10);
+		std::tie(total_orders, db_res) = counted_page(tx, key,
+			bserv::db_query{ "select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.destination = ? and f.airline = ?;", username, destination, airline },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+			"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.destination = ? and f.airline = ? order by f.dept_time asc limit 10 offset ?;", username, destination, airline, (page_id - 1) * 10 });
 	}
 	if (departure != "" && destination == "" && airline == "") {
-		db_res = tx.exec("select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ?;", username, departure);
-		total_orders = (*db_res.begin())[0].as<std::size_t>();
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? order by f.dept_time asc limit 10 offset ?;", username, departure, (page_id - 1) * 10);
+		std::tie(total_orders, db_res) = counted_page(tx, key,
+			bserv::db_query{ "select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ?;", username, departure },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+			"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? order by f.dept_time asc limit 10 offset ?;", username, departure, (page_id - 1) * 10 });
 	}
 	if (departure != "" && destination == "" && airline != "") {
-		db_res = tx.exec("select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.airline = ?;", username, departure, airline);
-		total_orders = (*db_res.begin())[0].as<std::size_t>();
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.airline = ? order by f.dept_time asc limit 10 offset ?;", username, departure, airline, (page_id - 1) * 10);
+		std::tie(total_orders, db_res) = counted_page(tx, key,
+			bserv::db_query{ "select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.airline = ?;", username, departure, airline },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+			"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.airline = ? order by f.dept_time asc limit 10 offset ?;", username, departure, airline, (page_id - 1) * 10 });
 	}
 	if (departure != "" && destination != "" && airline == "") {
-		db_res = tx.exec("select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.destination = ?;", username, departure, destination);
-		total_orders = (*db_res.begin())[0].as<std::size_t>();
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.destination = ? order by f.dept_time asc limit 10 offset ?;", username, departure, destination, (page_id - 1) * 10);
+		std::tie(total_orders, db_res) = counted_page(tx, key,
+			bserv::db_query{ "select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.destination = ?;", username, departure, destination },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+			"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.destination = ? order by f.dept_time asc limit 10 offset ?;", username, departure, destination, (page_id - 1) * 10 });
 	}
 	if (departure != "" && destination != "" && airline != "") {
-		db_res = tx.exec("select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.destination = ? and f.airline = ?;", username, departure, destination, airline);
-		total_orders = (*db_res.begin())[0].as<std::size_t>();
-		db_res = tx.exec("select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
-		"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.destination = ? and f.airline = ? order by f.dept_time asc limit 10 offset ?;", username, departure, destination, airline, (page_id - 1) * 10);
+		std::tie(total_orders, db_res) = counted_page(tx, key,
+			bserv::db_query{ "select count(*) from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.destination = ? and f.airline = ?;", username, departure, destination, airline },
+			bserv::db_query{ "select f.id, f.flight_number, f.departure, f.destination, f.dept_time, f.dept_ap, f.arrv_time, f.arrv_ap, f.airline, f.price, "
+			"f.total_seat, f.available_seat from orders o, flightinfo f where o.username = ? and o.flight_number = f.flight_number and f.departure = ? and f.destination = ? and f.airline = ? order by f.dept_time asc limit 10 offset ?;", username, departure, destination, airline, (page_id - 1) * 10 });
 	}
 	int total_pages = (int)total_orders / 10;
 	if (total_orders % 10 != 0) ++total_pages;
@@ -1196,60 +2054,87 @@ std::nullopt_t cancel_orders(
 	bserv::response_type& response,
 	boost::json::object&& params,
 	std::shared_ptr<bserv::db_connection> conn,
-	std::shared_ptr<bserv::session_type> session_ptr) {
-	if (request.method() != boost::beast::http::verb::post) {
-		throw bserv::url_not_found_exception{};
-	}
-	bserv::db_transaction tx{ conn };
-	lgdebug << params;
-	auto flight_number = params["flight_number"].as_string();
+	std::shared_ptr<bserv::session_type> session_ptr,
+	boost::asio::yield_context& yield) {
 	bserv::session_type& session = *session_ptr;
+	idempotency_guard guard{ request, response, session, params };
+	if (guard.answered()) return std::nullopt;
+	lgdebug << params;
+	auto flight_number = boost::json::value_to<std::string>(params["flight_number"]);
 	boost::json::object context;
 	auto user = session["user"].as_object();
-	auto username = user["username"].as_string();
-	bserv::db_result db_res;
-	db_res = tx.exec("delete from orders where username = ? and flight_number = ?;", username, flight_number);
-	tx.exec("update flightinfo set available_seat = available_seat + 1 where flight_number = ?", flight_number);
-	tx.commit();
-	context = {
-		{"success", true},
-		{"message", "Order successfully cancelled!"}
-	};
-	return all_orders(conn, session_ptr, response, 1, std::move(context));
+	auto username = boost::json::value_to<std::string>(user["username"]);
+	booking_status status = release_seat(conn, yield, flight_number, username);
+	if (status == booking_status::cancelled) {
+		count_orders(username, -1);
+		remove_purchase(username, flight_number);
+		context = {
+			{"success", true},
+			{"message", "Order successfully cancelled!"}
+		};
+	}
+	else {
+		context = {
+			{"success", false},
+			{"message", booking_failure(status)}
+		};
+	}
+	guard.committed(context);
+	return guard.complete(all_orders(conn, session_ptr, response, 1, std::move(context)));
 }
 
 std::nullopt_t reset_flights_admin(
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
-	boost::json::object&& params,
-	bserv::response_type& response) {
-	lgdebug << params;
-	auto id = params["id"].as_string();
-	auto flight_number = params["flight_number"].as_string();
-	auto departure = params["departure"].as_string();
-	auto destination = params["destination"].as_string();
-	auto dept_time = params["departure_time"].as_string();
-	auto dept_ap = params["departure_airport"].as_string();
-	auto arrv_time = params["arrival_time"].as_string();
-	auto arrv_ap = params["arrival_airport"].as_string();
-	auto airline = params["airline"].as_string();
-	auto price = params["price"].as_string();
-	auto total_seat_before = boost::json::value_to<std::string>(params["total_seat_before"]);
-	auto total_seat = boost::json::value_to<std::string>(params["total_seat"]);
-	auto available_seat_before = boost::json::value_to<std::string>(params["available_seat"]);
-	int tsb = std::stoi(total_seat_before);
-	int ts = std::stoi(total_seat);
-	int as = std::stoi(available_seat_before);
-	auto available_seat = as - tsb + ts;
+	bserv::request_params& params,
+	bserv::response_type& response,
+	boost::asio::yield_context& yield) {
+	// only the fields used are decoded
+	auto id = params.required<std::string>("id");
+	auto flight_number = params.required<std::string>("flight_number");
+	auto departure = params.required<std::string>("departure");
+	auto destination = params.required<std::string>("destination");
+	auto dept_time = params.required<std::string>("departure_time");
+	auto dept_ap = params.required<std::string>("departure_airport");
+	auto arrv_time = params.required<std::string>("arrival_time");
+	auto arrv_ap = params.required<std::string>("arrival_airport");
+	auto airline = params.required<std::string>("airline");
+	auto price = params.required<std::string>("price");
+	int ts = params.required<int>("total_seat");
 	boost::json::object context;
-	if (tsb - ts > as)
+	// the flight number may change, and the orders the booking engine
+	// has not written yet are kept under the old one
+	if (booking() != nullptr) {
+		booking()->forget_all();
+		booking()->async_drain(yield);
+	}
+	bserv::db_transaction tx{ conn };
+	// the seats are changed by the difference of the totals, so that the
+	// orders made since the form was shown (and those the booking engine
+	// has not written yet) are kept
+	bserv::db_result db_res = tx.exec(BSERV_SQL(
+		"update flightinfo set flight_number = ?, departure = ?, destination = ?, dept_time = ?, "
+		"dept_ap = ?, arrv_time = ?, arrv_ap = ?, airline = ?, price = ?, total_seat = ?, "
+		"available_seat = available_seat + (? - total_seat) "
+		"where id = ? and available_seat + (? - total_seat) >= 0 returning available_seat;"),
+		flight_number, departure, destination, dept_time, dept_ap, arrv_time, arrv_ap, airline, price, ts,
+		ts, id, ts);
+	if (db_res.size() == 0) {
+		tx.abort();
 		context = { {"admin", true}, {"success", false}, {"message", "The number of seat can't be smaller than existing orders"} };
+	}
 	else {
-		bserv::db_transaction tx{ conn };
-		tx.exec("update flightinfo set flight_number = ?, departure = ?, destination = ?, dept_time = ?,"
-			"dept_ap = ?, arrv_time = ?, arrv_ap = ?, airline = ?, price = ?, total_seat = ?, available_seat = ? where id = ?;"
-			, flight_number, departure, destination, dept_time, dept_ap, arrv_time, arrv_ap, airline, price, total_seat, available_seat, id);
+		long long available_seat = (*db_res.begin())[0].as<long long>();
+		// the new seats go to the waitlist first
+		std::vector<std::string> promoted;
+		if (available_seat > 0) promoted = promote_waitlist(tx, flight_number);
 		tx.commit();
+		finish_promotion(flight_number, promoted);
+		publish_seats(flight_number, available_seat - (long long)promoted.size());
+		// the flight may now match other searches, including those of orders
+		invalidate_counts("");
+		// the seats (and maybe the flight number) have changed
+		if (booking() != nullptr) booking()->forget_all();
 		context = { {"admin", true}, {"success", true}, {"message", "Flight Infomation successfully reset!"} };
 	}
 	return all_flights_admin(conn, session_ptr, response, 1, std::move(context));
@@ -1259,9 +2144,17 @@ std::nullopt_t cancel_flights_admin(
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
 	boost::json::object&& params,
-	bserv::response_type& response) {
+	bserv::response_type& response,
+	boost::asio::yield_context& yield) {
 	auto flight_number = params["flight_number"];
 	boost::json::object context;
+	// the orders the booking engine has not written yet are counted as well,
+	// and no more are taken until the flight is loaded again
+	if (booking() != nullptr && flight_number.is_string()) {
+		std::string number = boost::json::value_to<std::string>(flight_number);
+		booking()->forget(number);
+		booking()->async_drain(number, yield);
+	}
 	bserv::db_transaction tx{ conn };
 	bserv::db_result db_res;
 	db_res = tx.exec("select count(*) from orders where flight_number = ?;", flight_number);
@@ -1270,11 +2163,11 @@ std::nullopt_t cancel_flights_admin(
 	if (total_orders != 0) {
 		context = { {"admin", true}, {"success", false}, {"message", "You can't cancel a flight already ordered."} };
 		bserv::session_type& session = *session_ptr;
-		bserv::db_result db_res = tx.exec("select count(*) from flightinfo;");
-		std::size_t total_flights = (*db_res.begin())[0].as<std::size_t>();
+		auto [total_flights, db_res] = counted_page(tx, count_key("flightinfo"),
+			bserv::db_query{ "select count(*) from flightinfo;" },
+			bserv::db_query{ "select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10 });
 		int total_pages = (int)total_flights / 10;
 		if (total_flights % 10 != 0) ++total_pages;
-		db_res = tx.exec("select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
 		auto flights = orm_flight.convert_to_vector(db_res);
 		boost::json::array json_flights;
 		for (auto& flight : flights) {
@@ -1320,14 +2213,18 @@ std::nullopt_t cancel_flights_admin(
 		return index("flights_admin.html", session_ptr, response, context);
 	}
 	else {
+		// a flight added later with the same number must not book them
+		tx.exec(BSERV_SQL("delete from waitlist where flight_number = ?;"), flight_number);
 		tx.exec("delete from flightinfo where flight_number = ?", flight_number);
+		count_flights(-1);
+		if (booking() != nullptr) booking()->forget(boost::json::value_to<std::string>(params["flight_number"]));
 		context = { {"admin", true}, {"success", true}, {"message", "Flight successfully cancelled!"} };
 		bserv::session_type& session = *session_ptr;
-		bserv::db_result db_res = tx.exec("select count(*) from flightinfo;");
-		std::size_t total_flights = (*db_res.begin())[0].as<std::size_t>();
+		auto [total_flights, db_res] = counted_page(tx, count_key("flightinfo"),
+			bserv::db_query{ "select count(*) from flightinfo;" },
+			bserv::db_query{ "select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10 });
 		int total_pages = (int)total_flights / 10;
 		if (total_flights % 10 != 0) ++total_pages;
-		db_res = tx.exec("select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
 		tx.commit();
 		auto flights = orm_flight.convert_to_vector(db_res);
 		boost::json::array json_flights;
@@ -1378,29 +2275,22 @@ std::nullopt_t cancel_flights_admin(
 std::nullopt_t add_flights_admin(
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
-	boost::json::object&& params,
+	flight_form&& form,
 	bserv::response_type& response) {
 	int page_id = 1;
 	boost::json::object context;
-	auto flight_number = params["flight_number"].as_string();
-	auto departure = params["departure"].as_string();
-	auto destination = params["destination"].as_string();
-	auto dept_time = params["departure_time"].as_string();
-	auto dept_ap = params["departure_airport"].as_string();
-	auto arrv_time = params["arrival_time"].as_string();
-	auto arrv_ap = params["arrival_airport"].as_string();
-	auto airline = params["airline"].as_string();
-	auto price = params["price"].as_string();
-	auto total_seat = params["total_seat"].as_int64();
 	bserv::db_transaction tx{ conn };
 	tx.exec("insert into flightinfo(flight_number, departure, destination, dept_time, dept_ap, arrv_time, arrv_ap, airline, price, total_seat, available_seat) values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);"
-		, flight_number, departure, destination, dept_time, dept_ap, arrv_time, arrv_ap, airline, price, total_seat, total_seat);
+		, form.flight_number, form.departure, form.destination, form.departure_time, form.departure_airport,
+		form.arrival_time, form.arrival_airport, form.airline, form.price, form.total_seat, form.total_seat);
+	// before the page is counted below
+	count_flights(1);
 	context = { {"admin", true}, {"success", true}, {"message", "New flight successfully added!"} };
-	bserv::db_result db_res = tx.exec("select count(*) from flightinfo;");
-	std::size_t total_flights = (*db_res.begin())[0].as<std::size_t>();
+	auto [total_flights, db_res] = counted_page(tx, count_key("flightinfo"),
+		bserv::db_query{ "select count(*) from flightinfo;" },
+		bserv::db_query{ "select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10 });
 	int total_pages = (int)total_flights / 10;
 	if (total_flights % 10 != 0) ++total_pages;
-	db_res = tx.exec("select * from flightinfo order by dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
 	tx.commit();
 	auto flights = orm_flight.convert_to_vector(db_res);
 	boost::json::array json_flights;
@@ -1448,26 +2338,37 @@ std::nullopt_t add_flights_admin(
 }
 
 std::nullopt_t delete_orders(
+	bserv::request_type& request,
 	std::shared_ptr<bserv::db_connection> conn,
 	std::shared_ptr<bserv::session_type> session_ptr,
 	boost::json::object&& params,
-	bserv::response_type& response) {
+	bserv::response_type& response,
+	boost::asio::yield_context& yield) {
 	bserv::session_type& session = *session_ptr;
+	idempotency_guard guard{ request, response, session, params };
+	if (guard.answered()) return std::nullopt;
 	bserv::json::object context;
 	lgdebug << params;
-	auto flight_number = params["flight_number"].as_string();
-	auto username = params["username"].as_string();
+	auto flight_number = boost::json::value_to<std::string>(params["flight_number"]);
+	auto username = boost::json::value_to<std::string>(params["username"]);
+	// before the page is counted below
+	if (release_seat(conn, yield, flight_number, username)
+		== booking_status::cancelled) {
+		count_orders(username, -1);
+		remove_purchase(username, flight_number);
+	}
+	guard.committed({
+		{"success", true},
+		{"message", "Order successfully deleted!"}
+	});
 	bserv::db_transaction tx{ conn };
-	tx.exec("delete from orders where flight_number = ? and username = ?", flight_number, username);
-	tx.exec("update flightinfo set available_seat = available_seat + 1 where flight_number = ?;", flight_number);
 	int page_id = 1, total_pages;
 	boost::json::array json_orders;
-	bserv::db_result db_res;
-	db_res = tx.exec("select count(*) from orders;");
-	std::size_t total_orders = (*db_res.begin())[0].as<std::size_t>();
+	auto [total_orders, db_res] = counted_page(tx, count_key("orders"),
+		bserv::db_query{ "select count(*) from orders;" },
+		bserv::db_query{ "select f.flight_number, f.departure, f.destination, f.dept_time, f.arrv_time, f.airline, f.price, o.username from orders o, flightinfo f where o.flight_number = f.flight_number order by f.dept_time asc limit 10 offset ?;", (page_id - 1) * 10 });
 	total_pages = (int)total_orders / 10;
 	if (total_orders % 10 != 0) ++total_pages;
-	db_res = tx.exec("select f.flight_number, f.departure, f.destination, f.dept_time, f.arrv_time, f.airline, f.price, o.username from orders o, flightinfo f where o.flight_number = f.flight_number order by f.dept_time asc limit 10 offset ?;", (page_id - 1) * 10);
 	auto orders = orm_order.convert_to_vector(db_res);
 	tx.commit();
 	for (auto& order : orders) {
@@ -1514,7 +2415,7 @@ std::nullopt_t delete_orders(
 	context["admin"] = true;
 	context["success"] = true;
 	context["message"] = "Order successfully deleted!";
-	return index("orders.html", session_ptr, response, context);
+	return guard.complete(index("orders.html", session_ptr, response, context));
 }
 
 std::nullopt_t search_flight_number(
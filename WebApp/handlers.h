@@ -38,11 +38,20 @@ boost::json::object send_request(
 boost::json::object echo(
     boost::json::object&& params);
 
+boost::json::object db_stats(
+    std::shared_ptr<bserv::session_type> session_ptr,
+    std::shared_ptr<bserv::db_connection_manager> db_conn_mgr);
+
 // websocket
 std::nullopt_t ws_echo(
     std::shared_ptr<bserv::session_type> session,
     std::shared_ptr<bserv::websocket_server> ws_server);
 
+std::nullopt_t ws_notifications(
+    std::shared_ptr<bserv::session_type> session_ptr,
+    std::shared_ptr<bserv::websocket_server> ws_server,
+    boost::asio::yield_context& yield);
+
 std::nullopt_t serve_static_files(
     bserv::response_type& response,
     const std::string& path);
@@ -55,19 +64,44 @@ std::nullopt_t view_flights(
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
     bserv::response_type& response,
-    const std::string& page_num);
+    int page_id);
+
+// `direction` is "first", "after" or "before" (`cursor`)
+std::nullopt_t view_flights_keyset(
+    std::shared_ptr<bserv::db_connection> conn,
+    std::shared_ptr<bserv::session_type> session_ptr,
+    bserv::response_type& response,
+    boost::json::storage_ptr storage,
+    const std::string& direction,
+    const std::string& cursor);
 
 std::nullopt_t view_flights_admin(
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
     bserv::response_type& response,
-    const std::string& page_num);
+    int page_id);
+
+std::nullopt_t view_flights_admin_keyset(
+    std::shared_ptr<bserv::db_connection> conn,
+    std::shared_ptr<bserv::session_type> session_ptr,
+    bserv::response_type& response,
+    boost::json::storage_ptr storage,
+    const std::string& direction,
+    const std::string& cursor);
 
 std::nullopt_t view_orders(
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
     bserv::response_type& response,
-    const std::string& page_num);
+    int page_id);
+
+std::nullopt_t view_orders_keyset(
+    std::shared_ptr<bserv::db_connection> conn,
+    std::shared_ptr<bserv::session_type> session_ptr,
+    bserv::response_type& response,
+    boost::json::storage_ptr storage,
+    const std::string& direction,
+    const std::string& cursor);
 
 std::nullopt_t form_login(
     bserv::request_type& request,
@@ -85,13 +119,22 @@ std::nullopt_t update_user_info(
     std::shared_ptr<bserv::db_connection> conn,
     boost::json::object&& params,
     std::shared_ptr<bserv::session_type> session_ptr,
-    bserv::response_type& response);
+    bserv::response_type& response,
+    boost::asio::yield_context& yield);
 
 std::nullopt_t view_users(
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
     bserv::response_type& response,
-    const std::string& page_num);
+    int page_id);
+
+std::nullopt_t view_users_keyset(
+    std::shared_ptr<bserv::db_connection> conn,
+    std::shared_ptr<bserv::session_type> session_ptr,
+    bserv::response_type& response,
+    boost::json::storage_ptr storage,
+    const std::string& direction,
+    const std::string& cursor);
 
 std::nullopt_t alter_user_status(
     std::shared_ptr<bserv::db_connection> conn,
@@ -112,22 +155,53 @@ std::nullopt_t search_flights(
     boost::json::object&& params,
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
-    const std::string& page_num);
+    int page_id);
 
 std::nullopt_t make_purchase(
+    bserv::request_type& request,
+    bserv::response_type& response,
+    boost::json::object&& params,
+    std::shared_ptr<bserv::db_connection> conn,
+    std::shared_ptr<bserv::session_type> session_ptr,
+    boost::asio::yield_context& yield);
+
+std::nullopt_t join_waitlist(
     bserv::request_type& request,
     bserv::response_type& response,
     boost::json::object&& params,
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr);
 
+boost::json::object purchase_batch(
+    bserv::request_type& request,
+    boost::json::object&& params,
+    std::shared_ptr<bserv::db_connection> conn,
+    std::shared_ptr<bserv::session_type> session_ptr,
+    boost::asio::yield_context& yield);
+
+std::nullopt_t hold_seat(
+    bserv::request_type& request,
+    bserv::response_type& response,
+    boost::json::object&& params,
+    std::shared_ptr<bserv::db_connection> conn,
+    std::shared_ptr<bserv::session_type> session_ptr,
+    boost::asio::yield_context& yield);
+
+std::nullopt_t confirm_seat(
+    bserv::request_type& request,
+    bserv::response_type& response,
+    boost::json::object&& params,
+    std::shared_ptr<bserv::db_connection> conn,
+    std::shared_ptr<bserv::session_type> session_ptr,
+    boost::asio::yield_context& yield);
+
 std::nullopt_t search_myorders(
     bserv::request_type& request,
     bserv::response_type& response,
     boost::json::object&& params,
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
-    const std::string& page_num);
+    int page_id);
 
 std::nullopt_t search_flight_number(
     bserv::request_type& request,
@@ -211,28 +285,60 @@ std::nullopt_t cancel_orders(
     bserv::response_type& response,
     boost::json::object&& params,
     std::shared_ptr<bserv::db_connection> conn,
-    std::shared_ptr<bserv::session_type> session_ptr);
+    std::shared_ptr<bserv::session_type> session_ptr,
+    boost::asio::yield_context& yield);
 
 std::nullopt_t reset_flights_admin(
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
-    boost::json::object&& params,
-    bserv::response_type& response);
+    bserv::request_params& params,
+    bserv::response_type& response,
+    boost::asio::yield_context& yield);
 
 std::nullopt_t cancel_flights_admin(
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
     boost::json::object&& params,
-    bserv::response_type& response);
+    bserv::response_type& response,
+    boost::asio::yield_context& yield);
+
+// the form of `add_flights_admin`
+struct flight_form {
+    std::string flight_number;
+    std::string departure;
+    std::string destination;
+    std::string departure_time;
+    std::string departure_airport;
+    std::string arrival_time;
+    std::string arrival_airport;
+    std::string airline;
+    std::string price;
+    long long total_seat;
+    static constexpr auto fields() {
+        return std::make_tuple(
+            BSERV_FIELD(flight_form, flight_number),
+            BSERV_FIELD(flight_form, departure),
+            BSERV_FIELD(flight_form, destination),
+            BSERV_FIELD(flight_form, departure_time),
+            BSERV_FIELD(flight_form, departure_airport),
+            BSERV_FIELD(flight_form, arrival_time),
+            BSERV_FIELD(flight_form, arrival_airport),
+            BSERV_FIELD(flight_form, airline),
+            BSERV_FIELD(flight_form, price),
+            BSERV_FIELD(flight_form, total_seat));
+    }
+};
 
 std::nullopt_t add_flights_admin(
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
-    boost::json::object&& params,
+    flight_form&& form,
     bserv::response_type& response);
 
 std::nullopt_t delete_orders(
+    bserv::request_type& request,
     std::shared_ptr<bserv::db_connection> conn,
     std::shared_ptr<bserv::session_type> session_ptr,
     boost::json::object&& params,
-    bserv::response_type& response);
+    bserv::response_type& response,
+    boost::asio::yield_context& yield);
@@ -0,0 +1,87 @@
+#include "idempotency.h"
+
+#include <list>
+#include <unordered_map>
+#include <optional>
+#include <mutex>
+#include <chrono>
+
+struct idempotency_entry {
+	std::string key;
+	std::string fingerprint;
+	// empty while the request is running
+	std::optional<idempotent_response> response;
+	std::chrono::steady_clock::time_point created_at;
+};
+
+// the most recently used entry is at the front
+std::list<idempotency_entry> idempotency_entries_;
+std::unordered_map<std::string, std::list<idempotency_entry>::iterator> idempotency_index_;
+std::mutex idempotency_lock_;
+std::size_t idempotency_capacity_ = 10000;
+std::chrono::seconds idempotency_ttl_{ 600 };
+
+void init_idempotency(std::size_t capacity, int ttl_seconds) {
+	std::lock_guard<std::mutex> lg{ idempotency_lock_ };
+	idempotency_capacity_ = capacity;
+	idempotency_ttl_ = std::chrono::seconds{ ttl_seconds };
+}
+
+// `idempotency_lock_` must be held
+void evict_idempotent(std::chrono::steady_clock::time_point now) {
+	auto it = idempotency_entries_.end();
+	while (it != idempotency_entries_.begin()) {
+		--it;
+		bool expired = now - it->created_at >= idempotency_ttl_;
+		if (!expired && idempotency_entries_.size() <= idempotency_capacity_) break;
+		// the running requests are kept until they complete (or expire),
+		// otherwise a retry would run them again
+		if (!expired && !it->response.has_value()) continue;
+		idempotency_index_.erase(it->key);
+		it = idempotency_entries_.erase(it);
+	}
+}
+
+idempotency_status begin_idempotent(
+	const std::string& key,
+	const std::string& fingerprint,
+	idempotent_response& response) {
+	std::lock_guard<std::mutex> lg{ idempotency_lock_ };
+	auto now = std::chrono::steady_clock::now();
+	auto it = idempotency_index_.find(key);
+	if (it != idempotency_index_.end()
+		&& now - it->second->created_at >= idempotency_ttl_) {
+		idempotency_entries_.erase(it->second);
+		idempotency_index_.erase(it);
+		it = idempotency_index_.end();
+	}
+	if (it == idempotency_index_.end()) {
+		idempotency_entries_.push_front({ key, fingerprint, std::nullopt, now });
+		idempotency_index_[key] = idempotency_entries_.begin();
+		evict_idempotent(now);
+		return idempotency_status::started;
+	}
+	idempotency_entries_.splice(
+		idempotency_entries_.begin(), idempotency_entries_, it->second);
+	const idempotency_entry& entry = *it->second;
+	if (entry.fingerprint != fingerprint) return idempotency_status::mismatched;
+	if (!entry.response.has_value()) return idempotency_status::in_progress;
+	response = entry.response.value();
+	return idempotency_status::completed;
+}
+
+void complete_idempotent(const std::string& key, idempotent_response&& response) {
+	std::lock_guard<std::mutex> lg{ idempotency_lock_ };
+	auto it = idempotency_index_.find(key);
+	// it has been evicted while the request was running
+	if (it == idempotency_index_.end()) return;
+	it->second->response = std::move(response);
+}
+
+void abandon_idempotent(const std::string& key) {
+	std::lock_guard<std::mutex> lg{ idempotency_lock_ };
+	auto it = idempotency_index_.find(key);
+	if (it == idempotency_index_.end()) return;
+	idempotency_entries_.erase(it->second);
+	idempotency_index_.erase(it);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// the responses of the requests with an `Idempotency-Key` header, so that
+// a retry of such a request (a double click, or a retry of the load balancer)
+// is answered with the stored response instead of being run again.
+// the table is bounded: the least recently used responses are evicted
+// first (but not the requests still running), and the responses older
+// than the ttl are dropped.
+
+struct idempotent_response {
+	unsigned status;
+	std::string content_type;
+	std::string body;
+};
+
+enum class idempotency_status {
+	// the key is new, the request should run and then be completed
+	started,
+	// the request with the key is still running
+	in_progress,
+	// `response` has been set to the stored response
+	completed,
+	// the key has been used by a request with other parameters
+	mismatched
+};
+
+void init_idempotency(std::size_t capacity, int ttl_seconds);
+
+// `fingerprint` identifies the parameters of the request
+idempotency_status begin_idempotent(
+	const std::string& key,
+	const std::string& fingerprint,
+	idempotent_response& response);
+
+// it may be called again, to replace the stored response
+void complete_idempotent(const std::string& key, idempotent_response&& response);
+
+// forgets the key of a request that has failed, so that it can be retried
+void abandon_idempotent(const std::string& key);
@@ -0,0 +1,27 @@
+#include "notifications.h"
+
+bserv::pubsub_hub notification_hub_;
+
+bserv::pubsub_hub& notification_hub() {
+	return notification_hub_;
+}
+
+std::string user_topic(const std::string& username) {
+	return "user/" + username;
+}
+
+std::string flight_topic(const std::string& flight_number) {
+	return "flight/" + flight_number;
+}
+
+void notify_user(const std::string& username, const boost::json::value& message) {
+	notification_hub_.publish(user_topic(username), message);
+}
+
+void publish_seats(const std::string& flight_number, long long available) {
+	notification_hub_.publish(flight_topic(flight_number), {
+		{"type", "seats"},
+		{"flight_number", flight_number},
+		{"available_seat", available}
+	}, true);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <boost/json.hpp>
+
+#include <string>
+
+#include "bserv/common.hpp"
+
+// the messages pushed to the browsers over their websockets
+// (see `ws_notifications`), through a publish/subscribe hub:
+// the messages of a user go to `user_topic(username)`, a user may be
+// connected more than once, and the seat changes of a flight go to
+// `flight_topic(flight_number)`.
+
+bserv::pubsub_hub& notification_hub();
+
+std::string user_topic(const std::string& username);
+
+std::string flight_topic(const std::string& flight_number);
+
+// it is dropped if the user is not connected
+void notify_user(const std::string& username, const boost::json::value& message);
+
+// pushes the number of available seats of `flight_number`
+// to the pages listing it, only the latest number is queued
+void publish_seats(const std::string& flight_number, long long available);
@@ -0,0 +1,88 @@
+#include "purchases.h"
+
+#include <map>
+#include <set>
+#include <list>
+#include <iterator>
+#include <mutex>
+#include <chrono>
+
+struct purchase_entry {
+	std::set<std::string> flight_numbers;
+	std::chrono::steady_clock::time_point loaded_at;
+	// the position of its username in `purchase_order_`
+	std::list<std::string>::iterator order;
+};
+
+std::map<std::string, purchase_entry> purchases_;
+// the usernames in the order their sets are loaded, the oldest is at the front
+std::list<std::string> purchase_order_;
+std::mutex purchases_lock_;
+std::chrono::seconds purchases_reconcile_interval_{ 60 };
+std::size_t purchases_capacity_ = 10000;
+
+void init_purchases(int reconcile_seconds, std::size_t capacity) {
+	std::lock_guard<std::mutex> lg{ purchases_lock_ };
+	purchases_reconcile_interval_ = std::chrono::seconds{ reconcile_seconds };
+	purchases_capacity_ = capacity;
+}
+
+// `purchases_lock_` must be held
+void erase_purchases(std::map<std::string, purchase_entry>::iterator it) {
+	purchase_order_.erase(it->second.order);
+	purchases_.erase(it);
+}
+
+std::optional<std::vector<std::string>> find_purchases(const std::string& username) {
+	std::lock_guard<std::mutex> lg{ purchases_lock_ };
+	auto it = purchases_.find(username);
+	if (it == purchases_.end()) return std::nullopt;
+	if (std::chrono::steady_clock::now() - it->second.loaded_at
+		>= purchases_reconcile_interval_) {
+		erase_purchases(it);
+		return std::nullopt;
+	}
+	return std::vector<std::string>{
+		it->second.flight_numbers.begin(), it->second.flight_numbers.end() };
+}
+
+void store_purchases(
+	const std::string& username,
+	const std::vector<std::string>& flight_numbers) {
+	std::lock_guard<std::mutex> lg{ purchases_lock_ };
+	auto now = std::chrono::steady_clock::now();
+	auto it = purchases_.find(username);
+	if (it != purchases_.end()) erase_purchases(it);
+	// the expired sets are dropped as well
+	while (!purchase_order_.empty()) {
+		auto oldest = purchases_.find(purchase_order_.front());
+		if (purchases_.size() < purchases_capacity_
+			&& now - oldest->second.loaded_at < purchases_reconcile_interval_) break;
+		erase_purchases(oldest);
+	}
+	if (purchases_capacity_ == 0) return;
+	purchase_order_.push_back(username);
+	purchases_.emplace(username, purchase_entry{
+		{ flight_numbers.begin(), flight_numbers.end() },
+		now, std::prev(purchase_order_.end()) });
+}
+
+void add_purchase(const std::string& username, const std::string& flight_number) {
+	std::lock_guard<std::mutex> lg{ purchases_lock_ };
+	auto it = purchases_.find(username);
+	if (it == purchases_.end()) return;
+	it->second.flight_numbers.insert(flight_number);
+}
+
+void remove_purchase(const std::string& username, const std::string& flight_number) {
+	std::lock_guard<std::mutex> lg{ purchases_lock_ };
+	auto it = purchases_.find(username);
+	if (it == purchases_.end()) return;
+	it->second.flight_numbers.erase(flight_number);
+}
+
+void invalidate_purchases(const std::string& username) {
+	std::lock_guard<std::mutex> lg{ purchases_lock_ };
+	auto it = purchases_.find(username);
+	if (it != purchases_.end()) erase_purchases(it);
+}
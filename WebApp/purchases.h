@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <cstddef>
+
+// the flight numbers booked by each user, kept in memory so that the
+// listings of the flights a user has not booked can exclude them by an
+// array parameter, instead of a subquery on `orders`.
+// a set is loaded from the database the first time it is needed, updated
+// by the handlers that make or cancel orders, and reloaded once it is
+// older than the reconcile interval.
+// at most `capacity` sets are kept, the oldest are dropped first.
+
+void init_purchases(int reconcile_seconds, std::size_t capacity);
+
+// returns the (sorted) flight numbers booked by `username`,
+// or `std::nullopt` if they are not cached or are due for reconciliation
+std::optional<std::vector<std::string>> find_purchases(const std::string& username);
+
+void store_purchases(
+	const std::string& username,
+	const std::vector<std::string>& flight_numbers);
+
+// the following only change the set of `username` if it is cached
+
+void add_purchase(const std::string& username, const std::string& flight_number);
+
+void remove_purchase(const std::string& username, const std::string& flight_number);
+
+// drops the set of `username`, it is reloaded the next time it is needed
+void invalidate_purchases(const std::string& username);
@@ -0,0 +1,57 @@
+#include "pch.h"
+#include "bserv/arena.hpp"
+
+#include <algorithm>
+
+namespace bserv {
+
+	void* request_arena::overflow_resource::do_allocate(
+		std::size_t bytes, std::size_t alignment) {
+		allocated_ += bytes;
+		return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+	}
+
+	void request_arena::overflow_resource::do_deallocate(
+		void* p, std::size_t bytes, std::size_t alignment) {
+		std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+	}
+
+	bool request_arena::overflow_resource::do_is_equal(
+		const std::pmr::memory_resource& other) const noexcept {
+		return this == &other;
+	}
+
+	void* request_arena::json_resource::do_allocate(
+		std::size_t bytes, std::size_t alignment) {
+		return arena_.memory()->allocate(bytes, alignment);
+	}
+
+	// freed with the arena
+	void request_arena::json_resource::do_deallocate(
+		void*, std::size_t, std::size_t) {}
+
+	bool request_arena::json_resource::do_is_equal(
+		const boost::json::memory_resource& other) const noexcept {
+		return this == &other;
+	}
+
+	request_arena::request_arena()
+		: block_size_{ initial_block_size },
+		block_{ new std::byte[initial_block_size] },
+		json_resource_{ *this } {
+		resource_.emplace(block_.get(), block_size_, &overflow_);
+	}
+
+	void request_arena::reset() {
+		// gives the overflow back
+		resource_.reset();
+		// so that the next requests like this one fit in the block
+		if (overflow_.allocated() != 0 && block_size_ < max_block_size) {
+			block_size_ = std::min(max_block_size, block_size_ + overflow_.allocated());
+			block_.reset(new std::byte[block_size_]);
+		}
+		overflow_.clear();
+		resource_.emplace(block_.get(), block_size_, &overflow_);
+	}
+
+}  // bserv
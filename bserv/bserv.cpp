@@ -10,6 +10,7 @@
 #include <functional>
 #include <thread>
 #include <chrono>
+#include <algorithm>
 
 #include "bserv/server.hpp"
 
@@ -29,7 +30,7 @@ namespace bserv {
 
 	http::response<http::string_body> handle_request(
 		http::request<http::string_body>& req, router& routes,
-		std::shared_ptr<websocket_session> ws_session,
+		std::shared_ptr<websocket_session> ws_session, request_arena& arena,
 		asio::io_context& ioc, asio::yield_context& yield) {
 
 		const auto bad_request = [&req](beast::string_view why) {
@@ -55,6 +56,32 @@ namespace bserv {
 			return res;
 		};
 
+		const auto method_not_allowed = [&req](beast::string_view target, const std::string& allow) {
+			http::response<http::string_body> res{
+				http::status::method_not_allowed, req.version() };
+			res.set(http::field::server, NAME);
+			res.set(http::field::content_type, "text/html");
+			res.set(http::field::allow, allow);
+			res.keep_alive(req.keep_alive());
+			res.body() = "The requested url '"
+				+ std::string{ target } + "' does not allow the method '"
+				+ std::string{ req.method_string() } + "'.";
+			res.prepare_payload();
+			return res;
+		};
+
+		const auto service_unavailable = [&req](beast::string_view why) {
+			http::response<http::string_body> res{
+				http::status::service_unavailable, req.version() };
+			res.set(http::field::server, NAME);
+			res.set(http::field::content_type, "text/html");
+			res.set(http::field::retry_after, "1");
+			res.keep_alive(req.keep_alive());
+			res.body() = std::string{ why };
+			res.prepare_payload();
+			return res;
+		};
+
 		const auto server_error = [&req](beast::string_view what) {
 			http::response<http::string_body> res{
 				http::status::internal_server_error, req.version() };
@@ -80,13 +107,20 @@ namespace bserv {
 
 		std::optional<boost::json::value> val;
 		try {
-			val = routes(ioc, yield, ws_session, std::string{ url }, req, res);
+			val = routes(ioc, yield, ws_session, arena,
+				std::string_view{ url.data(), url.size() }, req, res);
 		}
 		catch (const url_not_found_exception& /*e*/) {
 			return not_found(url);
 		}
-		catch (const bad_request_exception& /*e*/) {
-			return bad_request("Request body is not a valid JSON string.");
+		catch (const method_not_allowed_exception& e) {
+			return method_not_allowed(url, e.allow());
+		}
+		catch (const bad_request_exception& e) {
+			return bad_request(e.what());
+		}
+		catch (const db_connection_timeout_exception& e) {
+			return service_unavailable(e.what());
 		}
 		catch (const std::exception& e) {
 			return server_error(e.what());
@@ -100,6 +134,13 @@ namespace bserv {
 			res.prepare_payload();
 		}
 
+		// HEAD is served by the GET route, without the body
+		if (req.method() == http::verb::head) {
+			std::size_t length = res.body().size();
+			res.body().clear();
+			res.content_length(length);
+		}
+
 		return res;
 	}
 
@@ -145,10 +186,11 @@ namespace bserv {
 			asio::io_context& ioc,
 			tcp::socket&& socket,
 			http::request<http::string_body>&& req,
-			router& routes)
+			router& routes,
+			const websocket_options& ws_options)
 			: address_{ get_address(socket) },
 			session_{ std::make_shared<
-				websocket_session>(address_, ioc, std::move(socket)) },
+				websocket_session>(address_, ioc, std::move(socket), ws_options) },
 			req_{ std::move(req) }, routes_{ routes } {
 			lgtrace << "websocket_session_server opened: " << address_;
 		}
@@ -161,6 +203,15 @@ namespace bserv {
 			session_->ws_.set_option(
 				websocket::stream_base::timeout::suggested(
 					beast::role_type::server));
+			// offers permessage-deflate unless the route opts out
+			boost::string_view target = req_.target();
+			std::string url{ target.substr(0, target.find('?')) };
+			websocket::permessage_deflate deflate = session_->options_.deflate;
+			if (!routes_.compresses(url)) {
+				deflate.server_enable = false;
+				deflate.client_enable = false;
+			}
+			session_->ws_.set_option(deflate);
 			// sets a decorator to change the Server of the handshake
 			session_->ws_.set_option(
 				websocket::stream_base::decorator(
@@ -183,14 +234,22 @@ namespace bserv {
 		std::shared_ptr<websocket_session> session,
 		http::request<http::string_body>& req, router& routes,
 		asio::io_context& ioc, asio::yield_context yield) {
-		handle_request(req, routes, session, ioc, yield);
+		// the handler runs as long as the connection
+		request_arena arena;
+		handle_request(req, routes, session, arena, ioc, yield);
 	}
 
-	std::string websocket_server::read() {
+	// a larger read buffer is given back after the message
+	const std::size_t WS_READ_BUFFER_KEPT = 64 * 1024;
+
+	std::string websocket_server::read(asio::yield_context& yield) {
 		beast::error_code ec;
-		beast::flat_buffer buffer;
+		beast::flat_buffer& buffer = session_.read_buffer_;
+		// keeps the storage of the previous message
+		buffer.consume(buffer.size());
+		if (buffer.capacity() > WS_READ_BUFFER_KEPT) buffer.shrink_to_fit();
 		// reads a message into the buffer
-		session_.ws_.async_read(buffer, yield_[ec]);
+		session_.ws_.async_read(buffer, yield[ec]);
 		lgtrace << "websocket_server: read from " << session_.address_;
 		// this indicates that the session was closed
 		if (ec == websocket::error::closed) {
@@ -200,19 +259,72 @@ namespace bserv {
 			fail(ec, "websocket_server read");
 			throw websocket_io_exception{ "websocket_server read: " + ec.message() };
 		}
-		// lgtrace << "websocket_server: received text? " << ws_.got_text() << " from " << address_;
+		session_.got_binary_ = session_.ws_.got_binary();
 		return beast::buffers_to_string(buffer.data());
 	}
 
-	void websocket_server::write(const std::string& data) {
-		beast::error_code ec;
-		// ws_.text(ws_.got_text());
-		session_.ws_.async_write(asio::buffer(data), yield_[ec]);
-		lgtrace << "websocket_server: write to " << session_.address_;
-		if (ec) {
-			fail(ec, "websocket_server write");
-			throw websocket_io_exception{ "websocket_server write: " + ec.message() };
+	void websocket_server::write(
+		std::shared_ptr<const std::string> data, asio::yield_context& yield,
+		bool binary, const std::string& key) {
+		websocket_session& s = session_;
+		if (s.write_error_) {
+			throw websocket_io_exception{ "websocket_server write: " + s.write_error_.message() };
+		}
+		std::size_t size = data->size();
+		auto it = s.write_queue_.end();
+		if (key != "") {
+			it = std::find_if(s.write_queue_.begin(), s.write_queue_.end(),
+				[&key](const websocket_message& m) { return m.key == key; });
+		}
+		if (it != s.write_queue_.end()) {
+			// coalesces with the queued message, keeping its place
+			s.queued_bytes_ = s.queued_bytes_ - it->data->size() + size;
+			it->data = std::move(data);
+			it->binary = binary;
+			++s.dropped_;
+		}
+		else {
+			s.queued_bytes_ += size;
+			s.write_queue_.push_back({ std::move(data), binary, key });
+		}
+		// the message being sent is no longer in the queue
+		if (s.queued_bytes_ > s.options_.high_water_mark) {
+			if (!s.options_.drop_slow) {
+				lgwarning << "websocket_server: closing slow consumer " << s.address_;
+				s.write_error_ = asio::error::no_buffer_space;
+				s.write_queue_.clear();
+				s.queued_bytes_ = 0;
+				// the pending read and write of the session fail
+				beast::get_lowest_layer(s.ws_).close();
+				throw websocket_io_exception{ "websocket_server write: slow consumer" };
+			}
+			// keeps at least the newest message
+			while (s.queued_bytes_ > s.options_.high_water_mark && s.write_queue_.size() > 1) {
+				s.queued_bytes_ -= s.write_queue_.front().data->size();
+				s.write_queue_.pop_front();
+				++s.dropped_;
+			}
+		}
+		if (s.writing_) return;
+		s.writing_ = true;
+		while (!s.write_queue_.empty()) {
+			websocket_message message = std::move(s.write_queue_.front());
+			s.write_queue_.pop_front();
+			s.queued_bytes_ -= message.data->size();
+			beast::error_code ec;
+			s.ws_.binary(message.binary);
+			s.ws_.async_write(asio::buffer(*message.data), yield[ec]);
+			lgtrace << "websocket_server: write to " << s.address_;
+			if (ec) {
+				s.writing_ = false;
+				s.write_error_ = ec;
+				s.write_queue_.clear();
+				s.queued_bytes_ = 0;
+				fail(ec, "websocket_server write");
+				throw websocket_io_exception{ "websocket_server write: " + ec.message() };
+			}
 		}
+		s.writing_ = false;
 	}
 
 
@@ -227,8 +339,14 @@ namespace bserv {
 	void handle_http_request(
 		std::shared_ptr<http_session>,
 		http::request<http::string_body> req,
-		Send& send, router& routes, asio::io_context& ioc, asio::yield_context yield) {
-		send(handle_request(req, routes, nullptr, ioc, yield));
+		Send& send, router& routes, request_arena& arena,
+		asio::io_context& ioc, asio::yield_context yield) {
+		http::response<http::string_body> res =
+			handle_request(req, routes, nullptr, arena, ioc, yield);
+		// the next request of the connection is read after the response
+		// is sent, so the arena is free again before that
+		arena.reset();
+		send(std::move(res));
 	}
 
 	// handles an HTTP server connection
@@ -271,7 +389,10 @@ namespace bserv {
 		std::shared_ptr<void> res_;
 		router& routes_;
 		router& ws_routes_;
+		const websocket_options& ws_options_;
 		const std::string address_;
+		// reused by the requests of the connection, one at a time
+		request_arena arena_;
 		void do_read() {
 			// constructs a new parser for each message
 			parser_.emplace();
@@ -310,7 +431,8 @@ namespace bserv {
 					ioc_,
 					stream_.release_socket(),
 					parser_->release(),
-					ws_routes_
+					ws_routes_,
+					ws_options_
 					)->do_accept();
 				return;
 			}
@@ -325,6 +447,7 @@ namespace bserv {
 					parser_->release(),
 					std::ref(lambda_),
 					std::ref(routes_),
+					std::ref(arena_),
 					std::ref(ioc_),
 					std::placeholders::_1)
 #ifdef _MSC_VER
@@ -369,12 +492,14 @@ namespace bserv {
 			asio::io_context& ioc,
 			tcp::socket&& socket,
 			router& routes,
-			router& ws_routes)
+			router& ws_routes,
+			const websocket_options& ws_options)
 			: lambda_{ *this },
 			ioc_{ ioc },
 			stream_{ std::move(socket) },
 			routes_{ routes },
 			ws_routes_{ ws_routes },
+			ws_options_{ ws_options },
 			address_{ get_address(stream_.socket()) } {
 			lgtrace << "http session opened: " << address_;
 		}
@@ -398,6 +523,7 @@ namespace bserv {
 		tcp::acceptor acceptor_;
 		router& routes_;
 		router& ws_routes_;
+		const websocket_options& ws_options_;
 		void do_accept() {
 			acceptor_.async_accept(
 				asio::make_strand(ioc_),
@@ -412,7 +538,7 @@ namespace bserv {
 			else {
 				lgtrace << "listener accepts: " << get_address(socket);
 				std::make_shared<http_session>(
-					ioc_, std::move(socket), routes_, ws_routes_)->run();
+					ioc_, std::move(socket), routes_, ws_routes_, ws_options_)->run();
 			}
 			do_accept();
 		}
@@ -421,11 +547,13 @@ namespace bserv {
 			asio::io_context& ioc,
 			tcp::endpoint endpoint,
 			router& routes,
-			router& ws_routes)
+			router& ws_routes,
+			const websocket_options& ws_options)
 			: ioc_{ ioc },
 			acceptor_{ asio::make_strand(ioc) },
 			routes_{ routes },
-			ws_routes_{ ws_routes } {
+			ws_routes_{ ws_routes },
+			ws_options_{ ws_options } {
 			beast::error_code ec;
 			acceptor_.open(endpoint.protocol(), ec);
 			if (ec) {
@@ -464,24 +592,43 @@ namespace bserv {
 	};
 
 
+	websocket_options make_websocket_options(const server_config& config) {
+		websocket_options options{
+			config.get_ws_high_water_mark(), config.get_ws_drop_slow(), {} };
+		websocket::permessage_deflate& deflate = options.deflate;
+		deflate.server_enable = config.get_ws_deflate();
+		deflate.client_enable = config.get_ws_deflate();
+		deflate.server_max_window_bits = std::clamp(config.get_ws_deflate_window_bits(), 9, 15);
+		deflate.client_max_window_bits = deflate.server_max_window_bits;
+		deflate.memLevel = std::clamp(config.get_ws_deflate_mem_level(), 1, 9);
+		deflate.server_no_context_takeover = config.get_ws_deflate_server_no_context_takeover();
+		deflate.client_no_context_takeover = config.get_ws_deflate_client_no_context_takeover();
+		return options;
+	}
+
 	server::server(const server_config& config, router&& routes, router&& ws_routes)
 		: ioc_{ config.get_num_threads() },
 		routes_{ std::move(routes) },
-		ws_routes_{ std::move(ws_routes) } {
+		ws_routes_{ std::move(ws_routes) },
+		ws_options_{ make_websocket_options(config) } {
 		init_logging(config);
 
 		if (config.get_db_conn_str() != "") {
 			// database connection
 			try {
 				db_conn_mgr_ = std::make_shared<
-					db_connection_manager>(config.get_db_conn_str(), config.get_num_db_conn());
+					db_connection_manager>(
+						config.get_db_conn_str(), config.get_num_db_conn(),
+						std::chrono::milliseconds{ config.get_db_conn_timeout() });
 			}
 			catch (const std::exception& e) {
 				lgfatal << "db connection initialization failed: " << e.what() << std::endl;
 				exit(EXIT_FAILURE);
 			}
 		}
-		session_mgr_ = std::make_shared<memory_session_manager>();
+		// a few shards per thread keep them from waiting on each other
+		session_mgr_ = std::make_shared<sharded_session_manager>(
+			4 * (std::size_t)std::max(config.get_num_threads(), 1));
 
 		std::shared_ptr<server_resources> resources_ptr = std::make_shared<server_resources>();
 		resources_ptr->session_mgr = session_mgr_;
@@ -492,7 +639,7 @@ namespace bserv {
 
 		// creates and launches a listening port
 		std::make_shared<listener>(
-			ioc_, tcp::endpoint{ tcp::v4(), config.get_port() }, routes_, ws_routes_)->run();
+			ioc_, tcp::endpoint{ tcp::v4(), config.get_port() }, routes_, ws_routes_, ws_options_)->run();
 
 		// captures SIGINT and SIGTERM to perform a clean shutdown
 		asio::signal_set signals{ ioc_, SIGINT, SIGTERM };
@@ -1,36 +1,236 @@
 #include "pch.h"
 #include "bserv/database.hpp"
 
+#ifdef BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
+#include <unistd.h>
+#endif
+
 namespace bserv {
 
-    std::shared_ptr<db_connection> db_connection_manager::get_or_block() {
-        // `counter_lock_` must be acquired first.
-        // exchanging this statement with the next will cause dead-lock,
-        // because if the request is blocked by `counter_lock_`,
-        // the destructor of `db_connection` will not be able to put
-        // itself back due to the `queue_lock_` has already been acquired
-        // by this request!
-        counter_lock_.lock();
-        // `queue_lock_` is acquired so that only one thread will
-        // modify the `queue_`
-        std::lock_guard<std::mutex> lg{ queue_lock_ };
-        std::shared_ptr<raw_db_connection_type> conn = queue_.front();
-        queue_.pop();
-        // if there are no connections in the `queue_`,
-        // `counter_lock_` remains to be locked
-        // so that the following requests will be blocked
-        if (queue_.size() != 0) counter_lock_.unlock();
-        return std::make_shared<db_connection>(*this, conn);
+    std::shared_ptr<db_connection> db_connection_manager::get_or_wait(
+        asio::io_context& ioc, asio::yield_context& yield) {
+        boost::system::error_code ec;
+        // only this coroutine is suspended while waiting,
+        // the thread goes on serving the other requests
+        std::shared_ptr<db_connection> conn = async_get(ioc.get_executor(), yield[ec]);
+        if (ec == asio::error::timed_out) {
+            throw db_connection_timeout_exception{};
+        }
+        if (ec) {
+            throw boost::system::system_error{ ec };
+        }
+        conn->set_context(ioc, yield);
+        return conn;
+    }
+
+    void db_connection_manager::release(raw_db_connection_ptr conn) {
+        std::lock_guard<std::mutex> lg{ lock_ };
+        if (waiters_.empty()) {
+            queue_.emplace(conn);
+            return;
+        }
+        // the connection goes directly to the request
+        // which has been waiting for the longest time
+        waiter_ptr waiter = waiters_.front();
+        waiters_.pop_front();
+        record_wait(waiter);
+        waiter->complete(std::make_shared<db_connection>(*this, conn));
+    }
+
+    void db_connection_manager::expire(const waiter_ptr& waiter) {
+        std::lock_guard<std::mutex> lg{ lock_ };
+        auto it = std::find(waiters_.begin(), waiters_.end(), waiter);
+        // the waiter has already been given a connection
+        if (it == waiters_.end()) return;
+        waiters_.erase(it);
+        record_wait(waiter);
+        ++timed_out_;
+        waiter->complete(nullptr);
+    }
+
+    // `lock_` must be held
+    void db_connection_manager::record_wait(const waiter_ptr& waiter) {
+        auto wait_time = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - waiter->since);
+        ++waited_;
+        total_wait_time_ += wait_time;
+        max_wait_time_ = std::max(max_wait_time_, wait_time);
+    }
+
+    db_connection_pool_stats db_connection_manager::stats() const {
+        std::lock_guard<std::mutex> lg{ lock_ };
+        return {
+            size_,
+            queue_.size(),
+            waiters_.size(),
+            acquired_,
+            waited_,
+            timed_out_,
+            total_wait_time_,
+            max_wait_time_
+        };
+    }
+
+    const std::string& db_connection::prepare(const std::string& text) {
+        auto it = conn_->statements.find(text);
+        if (it != conn_->statements.end()) {
+            return it->second;
+        }
+        std::string name = "bserv_" + std::to_string(conn_->statements.size());
+        // only recorded after postgresql has accepted the statement
+        conn_->conn.prepare(name, text);
+        return conn_->statements.emplace(text, name).first->second;
+    }
+
+    const std::string& db_connection::prepare_static(std::string_view text) {
+        auto it = conn_->static_statements.find(text.data());
+        if (it != conn_->static_statements.end()) {
+            return it->second;
+        }
+        const std::string& name = prepare(std::string{ text });
+        return conn_->static_statements.emplace(text.data(), name).first->second;
+    }
+
+    db_internal::db_statement db_transaction::translate(
+        const std::string& s,
+        const std::vector<std::shared_ptr<db_parameter>>& params) {
+        // `db_name`s are part of the statement, so they do not prevent caching
+        bool cacheable = true;
+        for (const auto& param : params) {
+            if (!param->bindable()
+                && dynamic_cast<db_name*>(param.get()) == nullptr) {
+                cacheable = false;
+            }
+        }
+        db_internal::db_statement statement{ "", {}, cacheable };
+        std::size_t idx = 0;
+        for (std::size_t i = 0; i < s.length(); ++i) {
+            if (s[i] == '?') {
+                if (i + 1 < s.length() && s[i + 1] == '?') {
+                    statement.text += s[++i];
+                }
+                else {
+                    if (idx >= params.size())
+                        throw std::out_of_range{ "too few parameters" };
+                    const auto& param = params[idx++];
+                    if (cacheable && param->bindable()) {
+                        statement.params.emplace_back(param->get_text());
+                        statement.text += "$" + std::to_string(statement.params.size());
+                    }
+                    else statement.text += param->get_value(tx_);
+                }
+            }
+            else statement.text += s[i];
+        }
+        if (idx != params.size())
+            throw invalid_operation_exception{ "too many parameters" };
+        return statement;
+    }
+
+    db_result db_transaction::exec_statement(
+        const db_internal::db_statement& statement) {
+        if (!statement.cacheable) {
+            return tx_.exec(statement.text);
+        }
+        pqxx::params params;
+        params.reserve(statement.params.size());
+        for (const auto& param : statement.params) {
+            params.append(param);
+        }
+        return tx_.exec_prepared(conn_->prepare(statement.text), params);
+    }
+
+    std::string db_transaction::pipeline_query(
+        const db_internal::db_statement& statement) {
+        if (!statement.cacheable) {
+            return statement.text;
+        }
+        // the pipeline only carries sql text, so the prepared statement
+        // is run by `execute` with the parameters as quoted literals.
+        // it still saves parsing and planning the statement.
+        std::string query = "execute " + tx_.quote_name(conn_->prepare(statement.text));
+        if (!statement.params.empty()) {
+            std::string args;
+            for (const auto& param : statement.params) {
+                if (args.size() != 0) args += ", ";
+                args += param.has_value() ? tx_.quote(param.value()) : "null";
+            }
+            query += "(" + args + ")";
+        }
+        return query;
+    }
+
+    void db_transaction::wait_pipeline(
+        pqxx::pipeline& pipeline, pqxx::pipeline::query_id id) {
+#ifdef BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
+        // without a coroutine, `retrieve` blocks until the result arrives
+        if (conn_->io_context() == nullptr) return;
+        // the descriptor owns a duplicate, so closing it
+        // leaves the connection's socket untouched
+        asio::posix::stream_descriptor socket{
+            *conn_->io_context(), ::dup(conn_->get().sock()) };
+        while (!pipeline.is_finished(id)) {
+            boost::system::error_code ec;
+            socket.async_wait(
+                asio::posix::stream_descriptor::wait_read,
+                (*conn_->yield())[ec]);
+            if (ec) {
+                throw boost::system::system_error{ ec };
+            }
+            // consumes whatever has arrived without blocking
+            pipeline.resume();
+        }
+#else
+        // windows sockets cannot be wrapped as posix descriptors
+        (void)pipeline;
+        (void)id;
+#endif
+    }
+
+    db_result db_transaction::exec_statement_async(
+        const db_internal::db_statement& statement) {
+        if (conn_->io_context() == nullptr) {
+            return exec_statement(statement);
+        }
+        std::string query = pipeline_query(statement);
+        // `pqxx::pipeline` sends the query without waiting for the result
+        pqxx::pipeline pipeline{ tx_ };
+        pqxx::pipeline::query_id id = pipeline.insert(query);
+        wait_pipeline(pipeline, id);
+        db_result result = pipeline.retrieve(id);
+        pipeline.complete();
+        return result;
+    }
+
+    std::vector<db_result> db_transaction::exec_statements(
+        const std::vector<db_internal::db_statement>& statements) {
+        std::vector<db_result> results;
+        if (statements.empty()) return results;
+        // the statements are prepared before the pipeline takes the connection
+        std::vector<std::string> queries;
+        for (const auto& statement : statements) {
+            queries.emplace_back(pipeline_query(statement));
+        }
+        pqxx::pipeline pipeline{ tx_ };
+        // the queries are held back until all of them are inserted,
+        // and then sent together
+        pipeline.retain((int)queries.size());
+        std::vector<pqxx::pipeline::query_id> ids;
+        for (const auto& query : queries) {
+            ids.emplace_back(pipeline.insert(query));
+        }
+        pipeline.resume();
+        // the results arrive in order
+        wait_pipeline(pipeline, ids.back());
+        for (auto id : ids) {
+            results.emplace_back(pipeline.retrieve(id));
+        }
+        pipeline.complete();
+        return results;
     }
 
     db_connection::~db_connection() {
-        std::lock_guard<std::mutex> lg{ mgr_.queue_lock_ };
-        mgr_.queue_.emplace(conn_);
-        // if this is the first available connection back to the queue,
-        // `counter_lock_` is unlocked so that the blocked requests will
-        // be notified
-        if (mgr_.queue_.size() == 1)
-            mgr_.counter_lock_.unlock();
+        mgr_.release(conn_);
     }
 
-}  // bserv
\ No newline at end of file
+}  // bserv
@@ -0,0 +1,65 @@
+#ifndef _ARENA_HPP
+#define _ARENA_HPP
+
+#include <boost/json.hpp>
+
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <cstddef>
+
+namespace bserv {
+
+	// the memory of a request: its parameters and the JSON built by its
+	// handler are allocated one after another from a block, and freed all
+	// at once when the request is done.
+	// the block is kept by the connection for its next requests, and it
+	// grows (up to `max_block_size`) when a request does not fit in it.
+	// NOTE: nothing allocated from the arena may outlive the request.
+	class request_arena {
+	public:
+		static constexpr std::size_t initial_block_size = 8 * 1024;
+		static constexpr std::size_t max_block_size = 256 * 1024;
+	private:
+		// allocates what does not fit in the block, and counts it
+		class overflow_resource : public std::pmr::memory_resource {
+		private:
+			std::size_t allocated_ = 0;
+		public:
+			std::size_t allocated() const { return allocated_; }
+			void clear() { allocated_ = 0; }
+		protected:
+			void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+			void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+			bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+		};
+		// lets the JSON values use the arena
+		class json_resource : public boost::json::memory_resource {
+		private:
+			request_arena& arena_;
+		public:
+			explicit json_resource(request_arena& arena) : arena_{ arena } {}
+		protected:
+			void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+			void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+			bool do_is_equal(const boost::json::memory_resource& other) const noexcept override;
+		};
+		std::size_t block_size_;
+		std::unique_ptr<std::byte[]> block_;
+		overflow_resource overflow_;
+		std::optional<std::pmr::monotonic_buffer_resource> resource_;
+		json_resource json_resource_;
+	public:
+		request_arena();
+		request_arena(const request_arena&) = delete;
+		request_arena& operator=(const request_arena&) = delete;
+		std::pmr::memory_resource* memory() { return &resource_.value(); }
+		// for `boost::json::object obj{ arena.storage() }`, etc.
+		boost::json::storage_ptr storage() { return &json_resource_; }
+		// frees what the request allocated
+		void reset();
+	};
+
+}  // bserv
+
+#endif  // _ARENA_HPP
@@ -5,10 +5,13 @@
 #define _WIN32_WINNT 0x0601
 #endif
 
+#include "arena.hpp"
 #include "client.hpp"
 #include "config.hpp"
 #include "database.hpp"
 #include "logging.hpp"
+#include "params.hpp"
+#include "pubsub.hpp"
 #include "router.hpp"
 #include "server.hpp"
 #include "session.hpp"
@@ -22,7 +22,20 @@ namespace bserv {
 	//const std::string LOG_PATH = "./log/" + NAME;
 	const std::string LOG_PATH = "";
 
+	// the bytes queued for a websocket before it is a slow consumer
+	const std::size_t WS_HIGH_WATER_MARK = 1024 * 1024;
+	// a slow consumer loses its oldest messages, otherwise it is closed
+	const bool WS_DROP_SLOW = true;
+	// permessage-deflate, negotiated with the clients that offer it
+	const bool WS_DEFLATE = false;
+	const int WS_DEFLATE_WINDOW_BITS = 15;  // 9 to 15
+	const int WS_DEFLATE_MEM_LEVEL = 4;  // 1 to 9
+	const bool WS_DEFLATE_SERVER_NO_CONTEXT_TAKEOVER = false;
+	const bool WS_DEFLATE_CLIENT_NO_CONTEXT_TAKEOVER = false;
+
 	const int NUM_DB_CONN = 10;
+	// how long a request may wait for a db connection, 0 means waiting forever
+	const int DB_CONN_TIMEOUT = 5000;  // milliseconds
 	//const std::string DB_CONN_STR = "dbname=bserv";
 	const std::string DB_CONN_STR = "";
 
@@ -43,7 +56,15 @@ public: \
 		decl_field(int, num_threads, NUM_THREADS)
 		decl_field(std::size_t, log_rotation_size, LOG_ROTATION_SIZE)
 		decl_field(std::string, log_path, LOG_PATH)
+		decl_field(std::size_t, ws_high_water_mark, WS_HIGH_WATER_MARK)
+		decl_field(bool, ws_drop_slow, WS_DROP_SLOW)
+		decl_field(bool, ws_deflate, WS_DEFLATE)
+		decl_field(int, ws_deflate_window_bits, WS_DEFLATE_WINDOW_BITS)
+		decl_field(int, ws_deflate_mem_level, WS_DEFLATE_MEM_LEVEL)
+		decl_field(bool, ws_deflate_server_no_context_takeover, WS_DEFLATE_SERVER_NO_CONTEXT_TAKEOVER)
+		decl_field(bool, ws_deflate_client_no_context_takeover, WS_DEFLATE_CLIENT_NO_CONTEXT_TAKEOVER)
 		decl_field(int, num_db_conn, NUM_DB_CONN)
+		decl_field(int, db_conn_timeout, DB_CONN_TIMEOUT)
 		decl_field(std::string, db_conn_str, DB_CONN_STR)
 	public:
 		server_config() = default;
@@ -1,15 +1,25 @@
 #ifndef _DATABASE_HPP
 #define _DATABASE_HPP
 
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
 #include <boost/json.hpp>
 
 #include <cstddef>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <type_traits>
+#include <tuple>
+#include <utility>
 #include <queue>
+#include <deque>
 #include <optional>
+#include <unordered_map>
 #include <mutex>
 #include <memory>
+#include <chrono>
+#include <algorithm>
 #include <initializer_list>
 
 #include <pqxx/pqxx>
@@ -24,6 +34,14 @@ namespace bserv {
 	using raw_db_connection_type = pqxx::connection;
 	using raw_db_transaction_type = pqxx::work;
 
+	// thrown by `exec` if a unique constraint is violated,
+	// the transaction has been aborted then
+	using db_unique_violation = pqxx::unique_violation;
+
+	// thrown by `exec` if the database rejects the statement
+	// (a broken connection is not one of them)
+	using db_sql_error = pqxx::sql_error;
+
 	class db_field {
 	private:
 		pqxx::field field_;
@@ -64,51 +82,211 @@ namespace bserv {
 		db_result(const pqxx::result& result) : result_{ result } {}
 		const_iterator begin() const { return result_.begin(); }
 		const_iterator end() const { return result_.end(); }
+		std::size_t size() const { return result_.size(); }
 		std::string query() const { return result_.query(); }
 	};
 
+	namespace asio = boost::asio;
+
+	namespace db_internal {
+
+		// a connection in the pool, together with the statements prepared on it
+		struct pooled_connection {
+			raw_db_connection_type conn;
+			// sql text -> name of the prepared statement
+			std::unordered_map<std::string, std::string> statements;
+			// the same, for the compile-time templates (`bserv::sql`),
+			// which are looked up by the address of their text
+			std::unordered_map<const char*, std::string> static_statements;
+			pooled_connection(const std::string& conn_str)
+				: conn{ conn_str } {}
+		};
+
+	}  // db_internal
+
+	using raw_db_connection_ptr = std::shared_ptr<db_internal::pooled_connection>;
+
 	class db_connection_manager;
 
 	class db_connection {
 	private:
 		db_connection_manager& mgr_;
-		std::shared_ptr<raw_db_connection_type> conn_;
+		raw_db_connection_ptr conn_;
+		// the coroutine that holds the connection, if any.
+		// it is used to wait for query results asynchronously.
+		asio::io_context* ioc_;
+		asio::yield_context* yield_;
 	public:
 		db_connection(
 			db_connection_manager& mgr,
-			std::shared_ptr<raw_db_connection_type> conn)
-			: mgr_{ mgr }, conn_{ conn } {}
+			raw_db_connection_ptr conn)
+			: mgr_{ mgr }, conn_{ conn },
+			ioc_{ nullptr }, yield_{ nullptr } {}
 		// non-copiable, non-assignable
 		db_connection(const db_connection&) = delete;
 		db_connection& operator=(const db_connection&) = delete;
 		// during the destruction, it should put itself back to the 
 		// manager's queue
 		~db_connection();
-		raw_db_connection_type& get() { return *conn_; }
+		raw_db_connection_type& get() { return conn_->conn; }
+		// returns the name of the statement prepared for `text`,
+		// the statement is prepared the first time it is used on this connection.
+		const std::string& prepare(const std::string& text);
+		// the same as `prepare`, but `text` must have static storage duration
+		// because it is looked up by address, without constructing a string.
+		const std::string& prepare_static(std::string_view text);
+		void set_context(asio::io_context& ioc, asio::yield_context& yield) {
+			ioc_ = &ioc;
+			yield_ = &yield;
+		}
+		asio::io_context* io_context() const { return ioc_; }
+		asio::yield_context* yield() const { return yield_; }
 	};
 
-	// provides the database connection pool functionality
+	class db_connection_timeout_exception : public std::exception {
+	public:
+		db_connection_timeout_exception() = default;
+		const char* what() const noexcept { return "timed out waiting for a database connection"; }
+	};
+
+	struct db_connection_pool_stats {
+		// number of connections in the pool
+		std::size_t size;
+		// number of connections that are not in use
+		std::size_t idle;
+		// number of requests waiting for a connection
+		std::size_t waiting;
+		// the following are accumulated since the pool is created
+		std::size_t acquired;
+		std::size_t waited;
+		std::size_t timed_out;
+		std::chrono::microseconds total_wait_time;
+		std::chrono::microseconds max_wait_time;
+	};
+
+	namespace db_internal {
+
+		// a request that is queued because all connections are in use
+		struct db_connection_waiter {
+			std::chrono::steady_clock::time_point since;
+			db_connection_waiter()
+				: since{ std::chrono::steady_clock::now() } {}
+			virtual ~db_connection_waiter() = default;
+			// hands `conn` to the waiting request (`conn` is null if it timed out).
+			// it is called exactly once, with the manager's lock held.
+			virtual void complete(std::shared_ptr<db_connection> conn) = 0;
+		};
+
+	}  // db_internal
+
+	// provides the database connection pool functionality.
+	// when all connections are in use, the requests are queued (FIFO)
+	// and only the waiting coroutines are suspended, not the threads.
 	class db_connection_manager {
 	private:
-		std::queue<std::shared_ptr<raw_db_connection_type>> queue_;
-		// this lock is for manipulating the `queue_`
-		mutable std::mutex queue_lock_;
-		// since C++ 17 doesn't provide the semaphore functionality,
-		// mutex is used to mimic it. (boost provides it)
-		// if there are no available connections, trying to lock on
-		// it will cause blocking.
-		mutable std::mutex counter_lock_;
+		using waiter_ptr = std::shared_ptr<db_internal::db_connection_waiter>;
+		const std::size_t size_;
+		const std::chrono::milliseconds timeout_;
+		std::queue<raw_db_connection_ptr> queue_;
+		std::deque<waiter_ptr> waiters_;
+		// this lock is for manipulating `queue_`, `waiters_` and the stats
+		mutable std::mutex lock_;
+		std::size_t acquired_;
+		std::size_t waited_;
+		std::size_t timed_out_;
+		std::chrono::microseconds total_wait_time_;
+		std::chrono::microseconds max_wait_time_;
+		// puts `conn` back to the pool, or hands it to the first waiting request
+		void release(raw_db_connection_ptr conn);
+		// called when `waiter` has been waiting for longer than `timeout_`
+		void expire(const waiter_ptr& waiter);
+		void record_wait(const waiter_ptr& waiter);
 		friend db_connection;
+
+		template <typename Executor, typename Handler>
+		class waiter : public db_internal::db_connection_waiter,
+			public std::enable_shared_from_this<waiter<Executor, Handler>> {
+		private:
+			Handler handler_;
+			Executor executor_;
+			asio::steady_timer timer_;
+		public:
+			waiter(const Executor& executor, Handler&& handler)
+				: handler_{ std::move(handler) },
+				executor_{ executor }, timer_{ executor } {}
+			void start(db_connection_manager& mgr) {
+				if (mgr.timeout_.count() <= 0) return;
+				timer_.expires_after(mgr.timeout_);
+				timer_.async_wait(
+					[&mgr, self = this->shared_from_this()](
+						const boost::system::error_code& ec) {
+							if (ec != asio::error::operation_aborted)
+								mgr.expire(self);
+					});
+			}
+			void complete(std::shared_ptr<db_connection> conn) {
+				timer_.cancel();
+				boost::system::error_code ec;
+				if (conn == nullptr) ec = asio::error::timed_out;
+				// resumes the request on its own executor
+				auto executor = asio::get_associated_executor(handler_, executor_);
+				asio::post(executor,
+					[handler = std::move(handler_), ec, conn]() mutable {
+						handler(ec, conn);
+					});
+			}
+		};
+
 	public:
-		db_connection_manager(const std::string& conn_str, int n) {
+		// `timeout` is how long a request may wait for a connection,
+		// zero means waiting forever.
+		db_connection_manager(
+			const std::string& conn_str, int n,
+			std::chrono::milliseconds timeout = std::chrono::milliseconds{ 0 })
+			: size_{ (std::size_t)n }, timeout_{ timeout },
+			acquired_{ 0 }, waited_{ 0 }, timed_out_{ 0 },
+			total_wait_time_{ 0 }, max_wait_time_{ 0 } {
 			for (int i = 0; i < n; ++i)
 				queue_.emplace(
-					std::make_shared<raw_db_connection_type>(conn_str));
+					std::make_shared<db_internal::pooled_connection>(conn_str));
+		}
+		// asynchronously acquires a connection.
+		// the completion handler has the signature:
+		//     void(boost::system::error_code, std::shared_ptr<db_connection>)
+		// where the error code is `asio::error::timed_out` if no connection
+		// becomes available in time.
+		// `executor` is where the timeout timer runs, the handler is invoked
+		// through its associated executor.
+		template <typename Executor, typename CompletionToken>
+		auto async_get(const Executor& executor, CompletionToken&& token) {
+			return asio::async_initiate<CompletionToken,
+				void(boost::system::error_code, std::shared_ptr<db_connection>)>(
+					[this, executor](auto handler) {
+						using handler_type = std::decay_t<decltype(handler)>;
+						std::lock_guard<std::mutex> lg{ lock_ };
+						++acquired_;
+						if (!queue_.empty()) {
+							auto conn = std::make_shared<db_connection>(*this, queue_.front());
+							queue_.pop();
+							auto handler_executor = asio::get_associated_executor(handler, executor);
+							asio::post(handler_executor,
+								[handler = std::move(handler), conn]() mutable {
+									handler(boost::system::error_code{}, conn);
+								});
+							return;
+						}
+						// all connections are in use, so the request is queued
+						auto w = std::make_shared<waiter<Executor, handler_type>>(
+							executor, std::move(handler));
+						waiters_.push_back(w);
+						w->start(*this);
+					}, token);
 		}
-		// if there are no available database connections, this function
-		// blocks until there is any;
-		// otherwise, this function returns a pointer to `db_connection`.
-		std::shared_ptr<db_connection> get_or_block();
+		// suspends the calling coroutine until a connection is available.
+		// throws `db_connection_timeout_exception` if it waits for too long.
+		std::shared_ptr<db_connection> get_or_wait(
+			asio::io_context& ioc, asio::yield_context& yield);
+		db_connection_pool_stats stats() const;
 	};
 
 	// **************************************************************************
@@ -116,7 +294,14 @@ namespace bserv {
 	class db_parameter {
 	public:
 		virtual ~db_parameter() = default;
+		// the value as a literal that can be spliced into the sql text
 		virtual std::string get_value(raw_db_transaction_type&) = 0;
+		// whether the value can be sent separately from the sql text,
+		// as a parameter of a prepared statement
+		virtual bool bindable() const { return false; }
+		// the value in postgresql's text format, `std::nullopt` means null.
+		// it is used only if `bindable()` is true.
+		virtual std::optional<std::string> get_text() const { return std::nullopt; }
 	};
 
 	class db_name : public db_parameter {
@@ -140,6 +325,10 @@ namespace bserv {
 		std::string get_value(raw_db_transaction_type&) {
 			return std::to_string(value_);
 		}
+		bool bindable() const { return true; }
+		std::optional<std::string> get_text() const {
+			return std::to_string(value_);
+		}
 	};
 
 	template <>
@@ -152,6 +341,8 @@ namespace bserv {
 		std::string get_value(raw_db_transaction_type& tx) {
 			return tx.quote(value_);
 		}
+		bool bindable() const { return true; }
+		std::optional<std::string> get_text() const { return value_; }
 	};
 
 	template <>
@@ -164,6 +355,8 @@ namespace bserv {
 		std::string get_value(raw_db_transaction_type& tx) {
 			return tx.quote(value_);
 		}
+		bool bindable() const { return true; }
+		std::optional<std::string> get_text() const { return value_; }
 	};
 
 	template <>
@@ -176,6 +369,10 @@ namespace bserv {
 		std::string get_value(raw_db_transaction_type&) {
 			return value_ ? "true" : "false";
 		}
+		bool bindable() const { return true; }
+		std::optional<std::string> get_text() const {
+			return value_ ? "true" : "false";
+		}
 	};
 
 	template <>
@@ -185,6 +382,8 @@ namespace bserv {
 		std::string get_value(raw_db_transaction_type&) {
 			return "null";
 		}
+		bool bindable() const { return true; }
+		std::optional<std::string> get_text() const { return std::nullopt; }
 	};
 
 	template <typename Type>
@@ -199,8 +398,27 @@ namespace bserv {
 				? db_value<Type>{value_.value()}.get_value(tx)
 				: "null";
 		}
+		bool bindable() const {
+			return !value_.has_value()
+				|| db_value<Type>{value_.value()}.bindable();
+		}
+		std::optional<std::string> get_text() const {
+			return value_.has_value()
+				? db_value<Type>{value_.value()}.get_text()
+				: std::nullopt;
+		}
 	};
 
+	namespace db_internal {
+
+		template <typename Type>
+		struct is_vector : std::false_type {};
+
+		template <typename Type>
+		struct is_vector<std::vector<Type>> : std::true_type {};
+
+	}  // db_internal
+
 	template <typename Type>
 	class db_value<std::vector<Type>> : public db_parameter {
 	private:
@@ -216,6 +434,26 @@ namespace bserv {
 			}
 			return "ARRAY[" + res + "]";
 		}
+		// one-dimensional arrays are bound as array literals, e.g. {"a","b"}
+		bool bindable() const { return !db_internal::is_vector<Type>::value; }
+		std::optional<std::string> get_text() const {
+			std::string res = "{";
+			for (const auto& elem : value_) {
+				if (res.size() != 1) res += ',';
+				std::optional<std::string> text = db_value<Type>{elem}.get_text();
+				if (!text.has_value()) {
+					res += "NULL";
+					continue;
+				}
+				res += '"';
+				for (char c : text.value()) {
+					if (c == '"' || c == '\\') res += '\\';
+					res += c;
+				}
+				res += '"';
+			}
+			return res + "}";
+		}
 	};
 
 	class unsupported_json_value_type : public std::exception {
@@ -278,6 +516,30 @@ namespace bserv {
 				throw unsupported_json_value_type{};
 			}
 		}
+		bool bindable() const { return true; }
+		std::optional<std::string> get_text() const {
+			if (value_.is_bool()) {
+				return db_value<bool>{value_.as_bool()}.get_text();
+			}
+			else if (value_.is_double()) {
+				return db_value<double>{value_.as_double()}.get_text();
+			}
+			else if (value_.is_int64()) {
+				return db_value<std::int64_t>{value_.as_int64()}.get_text();
+			}
+			else if (value_.is_null()) {
+				return std::nullopt;
+			}
+			else if (value_.is_string()) {
+				return db_value<boost::json::string>{value_.as_string()}.get_text();
+			}
+			else if (value_.is_uint64()) {
+				return db_value<std::uint64_t>{value_.as_uint64()}.get_text();
+			}
+			else {
+				throw unsupported_json_value_type{};
+			}
+		}
 	};
 
 	namespace db_internal {
@@ -304,11 +566,16 @@ namespace bserv {
 			return std::make_shared<db_name>(param);
 		}
 
-		template <typename ...Params>
-		std::vector<std::string> convert_parameters(
-			raw_db_transaction_type& tx, std::shared_ptr<Params>... params) {
-			return { params->get_value(tx)... };
-		}
+		// a `?` template translated into a statement
+		struct db_statement {
+			// the sql text, where the bindable parameters are `$1..$n`
+			std::string text;
+			std::vector<std::optional<std::string>> params;
+			// whether `text` can be prepared and reused.
+			// it is false if some values have been spliced into the text,
+			// in which case `params` is empty.
+			bool cacheable;
+		};
 
 		// *************************************
 
@@ -403,41 +670,259 @@ namespace bserv {
 			const std::initializer_list<
 			std::shared_ptr<db_internal::db_field_holder>>&fields)
 			: fields_{ fields } {}
-		boost::json::object convert_row(const db_row& row) {
-			boost::json::object obj;
+		// the objects are allocated from `storage`,
+		// e.g. the arena of the request (see `placeholders::json_storage`)
+		boost::json::object convert_row(
+			const db_row& row, boost::json::storage_ptr storage = {}) {
+			boost::json::object obj{ storage };
+			obj.reserve(fields_.size());
 			for (std::size_t i = 0; i < fields_.size(); ++i)
 				fields_[i]->add(row, i, obj);
 			return obj;
 		}
 		std::vector<boost::json::object> convert_to_vector(
-			const db_result& result) {
+			const db_result& result, boost::json::storage_ptr storage = {}) {
 			std::vector<boost::json::object> results;
+			results.reserve(result.size());
+			for (const auto& row : result)
+				results.emplace_back(convert_row(row, storage));
+			return results;
+		}
+		boost::json::array convert_to_array(
+			const db_result& result, boost::json::storage_ptr storage = {}) {
+			boost::json::array results{ storage };
+			results.reserve(result.size());
 			for (const auto& row : result)
-				results.emplace_back(convert_row(row));
+				results.emplace_back(convert_row(row, storage));
 			return results;
 		}
 		std::optional<boost::json::object> convert_to_optional(
-			const db_result& result) {
+			const db_result& result, boost::json::storage_ptr storage = {}) {
 			// result.size() == 0
 			if (result.begin() == result.end()) return std::nullopt;
 			auto iterator = result.begin();
 			auto first = iterator;
 			// result.size() == 1
 			if (++iterator == result.end())
-				return convert_row(*first);
+				return convert_row(*first, storage);
 			// result.size() > 1
 			throw invalid_operation_exception{
 				"too many objects to convert" };
 		}
 	};
 
+	namespace db_internal {
+
+		constexpr std::size_t count_placeholders(std::string_view s) {
+			std::size_t count = 0;
+			for (std::size_t i = 0; i < s.size(); ++i) {
+				if (s[i] == '?') {
+					if (i + 1 < s.size() && s[i + 1] == '?') ++i;
+					else ++count;
+				}
+			}
+			return count;
+		}
+
+		constexpr std::size_t count_digits(std::size_t n) {
+			std::size_t digits = 1;
+			while (n >= 10) {
+				n /= 10;
+				++digits;
+			}
+			return digits;
+		}
+
+		template <std::size_t N>
+		struct sql_text {
+			char data[N];
+			std::size_t size;
+		};
+
+		// "?" -> "$1".."$n", "??" -> "?"
+		template <std::size_t N>
+		constexpr sql_text<N> translate_placeholders(std::string_view s) {
+			sql_text<N> text{};
+			std::size_t idx = 0;
+			for (std::size_t i = 0; i < s.size(); ++i) {
+				if (s[i] == '?') {
+					if (i + 1 < s.size() && s[i + 1] == '?') {
+						text.data[text.size++] = s[++i];
+						continue;
+					}
+					text.data[text.size++] = '$';
+					std::size_t digits = count_digits(++idx);
+					for (std::size_t j = digits, n = idx; j > 0; --j, n /= 10)
+						text.data[text.size + j - 1] = (char)('0' + n % 10);
+					text.size += digits;
+				}
+				else text.data[text.size++] = s[i];
+			}
+			return text;
+		}
+
+		// whether the type can be bound to a compile-time template
+		template <typename Type>
+		struct is_bindable : std::true_type {};
+
+		template <>
+		struct is_bindable<db_name> : std::false_type {};
+
+		// only one-dimensional arrays
+		template <typename Type>
+		struct is_bindable<std::vector<Type>>
+			: std::bool_constant<!is_vector<Type>::value && is_bindable<Type>::value> {};
+
+		template <typename Type>
+		struct is_bindable<db_value<Type>> : is_bindable<Type> {};
+
+		inline void append_text(
+			pqxx::params& params, std::optional<std::string>&& text) {
+			if (text.has_value()) params.append(std::move(text.value()));
+			else params.append();
+		}
+
+		// numbers are short enough for the small string buffer
+		template <typename Type>
+		void bind_parameter(pqxx::params& params, const Type& param) {
+			append_text(params, db_value<Type>{ param }.get_text());
+		}
+
+		// the strings are bound as views, so they are not copied
+		inline void bind_parameter(pqxx::params& params, const std::string& param) {
+			params.append(pqxx::zview{ param.c_str(), param.size() });
+		}
+
+		inline void bind_parameter(pqxx::params& params, const boost::json::string& param) {
+			params.append(pqxx::zview{ param.c_str(), param.size() });
+		}
+
+		inline void bind_parameter(pqxx::params& params, const char* param) {
+			params.append(pqxx::zview{ param });
+		}
+
+		inline void bind_parameter(pqxx::params& params, bool param) {
+			params.append(pqxx::zview{ param ? "true" : "false" });
+		}
+
+		inline void bind_parameter(pqxx::params& params, std::nullptr_t) {
+			params.append();
+		}
+
+		template <typename Type>
+		void bind_parameter(pqxx::params& params, const std::optional<Type>& param) {
+			if (param.has_value()) bind_parameter(params, param.value());
+			else params.append();
+		}
+
+		template <typename Type>
+		void bind_parameter(pqxx::params& params, const db_value<Type>& param) {
+			append_text(params, param.get_text());
+		}
+
+		template <typename Type>
+		std::optional<std::string> parameter_text(const Type& param) {
+			return db_value<Type>{ param }.get_text();
+		}
+
+		template <typename Type>
+		std::optional<std::string> parameter_text(const db_value<Type>& param) {
+			return param.get_text();
+		}
+
+		inline std::optional<std::string> parameter_text(const char* param) {
+			return param;
+		}
+
+	}  // db_internal
+
+	// a sql template whose placeholders are found at compile time.
+	// `Source` provides the template by `static constexpr std::string_view value()`,
+	// it is usually created by `BSERV_SQL`.
+	template <typename Source>
+	class sql {
+	public:
+		static constexpr std::string_view source = Source::value();
+		static constexpr std::size_t parameter_count =
+			db_internal::count_placeholders(source);
+	private:
+		// each "?" grows into "$" followed by at most this many digits,
+		// plus the null terminator
+		static constexpr std::size_t capacity_ = source.size() + parameter_count
+			* db_internal::count_digits(parameter_count) + 1;
+		static constexpr db_internal::sql_text<capacity_> text_ =
+			db_internal::translate_placeholders<capacity_>(source);
+	public:
+		// the translated text (null-terminated), with "$1".."$n" as placeholders
+		static constexpr std::string_view text() {
+			return { text_.data, text_.size };
+		}
+	};
+
+	// Usage:
+	// tx.exec(BSERV_SQL("select * from auth_user where username = ?"), username);
+	// (c++17 does not allow string literals as template arguments,
+	//  so the template is carried by a local type.)
+#define BSERV_SQL(str) \
+	([] { \
+		struct bserv_sql_source { \
+			static constexpr std::string_view value() { return str; } \
+		}; \
+		return ::bserv::sql<bserv_sql_source>{}; \
+	}())
+
+	class db_transaction;
+
+	// a query that is sent together with others, see `db_transaction::exec_pipeline`
+	class db_query {
+	private:
+		std::string template_;
+		std::vector<std::shared_ptr<db_parameter>> params_;
+		friend db_transaction;
+	public:
+		template <typename ...Params>
+		db_query(const std::string& s, const Params&... params)
+			: template_{ s },
+			params_{ db_internal::convert_parameter(params)... } {}
+		// adds a parameter for the next `?` of the template,
+		// for queries whose conditions are chosen at runtime
+		template <typename Param>
+		db_query& add_parameter(const Param& param) {
+			params_.emplace_back(db_internal::convert_parameter(param));
+			return *this;
+		}
+	};
+
+	namespace db_internal {
+
+		template <std::size_t ...Indices>
+		auto make_result_tuple(
+			std::vector<db_result>& results,
+			std::index_sequence<Indices...>) {
+			return std::make_tuple(std::move(results[Indices])...);
+		}
+
+	}  // db_internal
+
 	class db_transaction {
 	private:
+		std::shared_ptr<db_connection> conn_;
 		raw_db_transaction_type tx_;
+		db_internal::db_statement translate(
+			const std::string& s,
+			const std::vector<std::shared_ptr<db_parameter>>& params);
+		db_result exec_statement(const db_internal::db_statement& statement);
+		db_result exec_statement_async(const db_internal::db_statement& statement);
+		std::vector<db_result> exec_statements(
+			const std::vector<db_internal::db_statement>& statements);
+		// the text sent through `pqxx::pipeline` for `statement`
+		std::string pipeline_query(const db_internal::db_statement& statement);
+		// suspends the coroutine (if any) until the query `id` is finished
+		void wait_pipeline(pqxx::pipeline& pipeline, pqxx::pipeline::query_id id);
 	public:
 		db_transaction(
 			std::shared_ptr<db_connection> connection_ptr
-		) : tx_{ connection_ptr->get() } {}
+		) : conn_{ connection_ptr }, tx_{ connection_ptr->get() } {}
 		// non-copiable, non-assignable
 		db_transaction(const db_transaction&) = delete;
 		db_transaction& operator=(const db_transaction&) = delete;
@@ -452,30 +937,67 @@ namespace bserv {
 		// ======================================================================================
 		// Note: "?" is the placeholder for parameters, and "??" will be converted to "?" in SQL.
 		//       But, "??" in the parameters remains.
+		// ======================================================================================
+		// The template is translated into a prepared statement ("?" -> "$1".."$n"), which is
+		// prepared once per connection and executed with bound parameters.
+		// `db_name`s are spliced into the statement. Other values that cannot be bound
+		// (e.g. nested arrays) make the query be executed as plain sql text.
 		template <typename ...Params>
 		db_result exec(const std::string& s, const Params&... params) {
-			std::vector<std::string> param_vec =
-				db_internal::convert_parameters(
-					tx_, db_internal::convert_parameter(params)...);
-			std::size_t idx = 0;
-			std::string query;
-			for (std::size_t i = 0; i < s.length(); ++i) {
-				if (s[i] == '?') {
-					if (i + 1 < s.length() && s[i + 1] == '?') {
-						query += s[++i];
-					}
-					else {
-						if (idx < param_vec.size()) {
-							query += param_vec[idx++];
-						}
-						else throw std::out_of_range{ "too few parameters" };
-					}
-				}
-				else query += s[i];
-			}
-			if (idx != param_vec.size())
-				throw invalid_operation_exception{ "too many parameters" };
-			return tx_.exec(query);
+			return exec_statement(translate(s,
+				{ db_internal::convert_parameter(params)... }));
+		}
+		// the same as `exec`, except that the calling coroutine (rather than
+		// the thread) is suspended while the database is executing the query.
+		// the query is sent through libpq's asynchronous api, and the coroutine
+		// is resumed when the connection's socket becomes readable.
+		// NOTE: it falls back to `exec` if the connection is not obtained
+		//       by a request (`placeholders::db_connection_ptr`).
+		template <typename ...Params>
+		db_result async_exec(const std::string& s, const Params&... params) {
+			return exec_statement_async(translate(s,
+				{ db_internal::convert_parameter(params)... }));
+		}
+		// sends all the queries at once and then waits for all of their results,
+		// so that they cost a single round trip. the results are in the same order.
+		// the coroutine is suspended while waiting, like `async_exec`.
+		// Usage:
+		// auto [count_res, page_res] = tx.exec_pipeline(
+		//     db_query{ "select count(*) from auth_user;" },
+		//     db_query{ "select * from auth_user limit 10 offset ?;", offset });
+		template <typename ...Queries>
+		auto exec_pipeline(const Queries&... queries) {
+			static_assert((std::is_same_v<Queries, db_query> && ...),
+				"the arguments of a pipeline must be `db_query`s");
+			std::vector<db_result> results = exec_statements(
+				{ translate(queries.template_, queries.params_)... });
+			return db_internal::make_result_tuple(
+				results, std::index_sequence_for<Queries...>{});
+		}
+		// the same as `exec`, except that the template is parsed at compile time
+		// and the parameters are bound without being converted to `db_parameter`s.
+		// `db_name`s and nested arrays are not supported.
+		template <typename Source, typename ...Params>
+		db_result exec(sql<Source>, const Params&... params) {
+			static_assert(sizeof...(Params) == sql<Source>::parameter_count,
+				"the number of parameters does not match the sql template");
+			static_assert((db_internal::is_bindable<Params>::value && ...),
+				"the parameters of a sql template must be values");
+			pqxx::params bound;
+			bound.reserve(sizeof...(Params));
+			(db_internal::bind_parameter(bound, params), ...);
+			return tx_.exec_prepared(
+				conn_->prepare_static(sql<Source>::text()), bound);
+		}
+		template <typename Source, typename ...Params>
+		db_result async_exec(sql<Source>, const Params&... params) {
+			static_assert(sizeof...(Params) == sql<Source>::parameter_count,
+				"the number of parameters does not match the sql template");
+			static_assert((db_internal::is_bindable<Params>::value && ...),
+				"the parameters of a sql template must be values");
+			return exec_statement_async(db_internal::db_statement{
+				std::string{ sql<Source>::text() },
+				{ db_internal::parameter_text(params)... }, true });
 		}
 		void commit() { tx_.commit(); }
 		void abort() { tx_.abort(); }
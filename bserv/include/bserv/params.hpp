@@ -0,0 +1,215 @@
+#ifndef _PARAMS_HPP
+#define _PARAMS_HPP
+
+#include <boost/beast.hpp>
+#include <boost/json.hpp>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <tuple>
+#include <utility>
+#include <optional>
+#include <memory_resource>
+#include <charconv>
+#include <type_traits>
+#include <cstddef>
+
+#include "arena.hpp"
+#include "client.hpp"
+
+namespace bserv {
+
+	class bad_request_exception : public std::exception {
+	private:
+		const std::string msg_;
+	public:
+		bad_request_exception()
+			: msg_{ "Request body is not a valid JSON string." } {}
+		explicit bad_request_exception(const std::string& msg) : msg_{ msg } {}
+		const char* what() const noexcept { return msg_.c_str(); }
+	};
+
+	// a field of a struct bound from the parameters (see `request_params::bind`)
+	template <typename Struct, typename Member>
+	struct param_field {
+		const char* name;
+		Member Struct::* member;
+	};
+
+	template <typename Struct, typename Member>
+	constexpr param_field<Struct, Member> field(const char* name, Member Struct::* member) {
+		return { name, member };
+	}
+
+	// the field has the name of the member
+#define BSERV_FIELD(type, name) ::bserv::field(#name, &type::name)
+
+	namespace params_internal {
+
+		template <typename Type>
+		struct is_optional : std::false_type {};
+
+		template <typename Type>
+		struct is_optional<std::optional<Type>> : std::true_type {};
+
+	}  // params_internal
+
+	// the parameters of a request: the fields of the body (a JSON object,
+	// or an url-encoded form) and then those of the query string.
+	// nothing is parsed until a field is asked for, the fields are views of
+	// the request, and only the values with escapes are decoded, into the
+	// arena of the request.
+	class request_params {
+	private:
+		struct field {
+			std::string_view key;
+			std::string_view value;
+			// whether the value needs no decoding
+			bool plain;
+		};
+		request_type& request_;
+		request_arena& arena_;
+		bool indexed_ = false;
+		// the fields of the form body, followed by those of the query string
+		std::pmr::vector<field> fields_;
+		std::size_t body_fields_ = 0;
+		std::optional<boost::json::object> json_;
+		void index();
+		void index_fields(std::string_view source);
+		std::string_view decode(std::string_view raw);
+		std::string_view value(field& f);
+		std::optional<std::string_view> json_value(const boost::json::value& value);
+	public:
+		// converts `text`, the value of `key`, to `std::string`,
+		// `std::string_view`, `bool` or an integer.
+		// a value that cannot be converted is a bad request.
+		template <typename Type>
+		static Type convert(std::string_view key, std::string_view text) {
+			if constexpr (std::is_same_v<Type, bool>) {
+				if (text == "true" || text == "on" || text == "1") return true;
+				if (text == "false" || text == "off" || text == "0" || text.empty()) return false;
+				throw bad_request_exception{ "'" + std::string{ key } + "' is not a valid boolean." };
+			}
+			else if constexpr (std::is_integral_v<Type>) {
+				Type number{};
+				const char* end = text.data() + text.size();
+				auto [ptr, ec] = std::from_chars(text.data(), end, number);
+				if (ec != std::errc{} || ptr != end)
+					throw bad_request_exception{ "'" + std::string{ key } + "' is not a valid number." };
+				return number;
+			}
+			else return Type{ text };
+		}
+		request_params(request_type& request, request_arena& arena)
+			: request_{ request },
+			arena_{ arena },
+			fields_{ arena.memory() } {}
+		request_params(const request_params&) = delete;
+		request_params& operator=(const request_params&) = delete;
+		bool contains(std::string_view key);
+		// the first value of `key`
+		std::optional<std::string_view> get(std::string_view key);
+		std::vector<std::string_view> get_all(std::string_view key);
+		// the first value of `key` as `std::string`, `std::string_view` or an integer.
+		// a value that is not a number of the integer is a bad request.
+		template <typename Type>
+		std::optional<Type> get_as(std::string_view key) {
+			std::optional<std::string_view> value = get(key);
+			if (!value.has_value()) return std::nullopt;
+			return convert<Type>(key, value.value());
+		}
+		// the same as `get_as`, except that a missing field is a bad request
+		template <typename Type>
+		Type required(std::string_view key) {
+			std::optional<Type> value = get_as<Type>(key);
+			if (!value.has_value())
+				throw bad_request_exception{ "'" + std::string{ key } + "' is required." };
+			return std::move(value.value());
+		}
+		// all the parameters, a key with several values is an array
+		boost::json::object to_object();
+		// calls `visit(key, value)` for the fields in order (the body first)
+		// until it returns false, the values of a JSON body are read in place
+		template <typename Visit>
+		void visit(Visit&& visit);
+		// fills the struct described by its static `fields()`, a tuple of
+		// `BSERV_FIELD`s. the first value of a field is used, and the fields
+		// are read only until the struct is filled. a missing field is a
+		// bad request, unless its member is a `std::optional`.
+		// e.g.
+		// struct login {
+		//     std::string username;
+		//     std::optional<bool> remember;
+		//     static constexpr auto fields() {
+		//         return std::make_tuple(
+		//             BSERV_FIELD(login, username), BSERV_FIELD(login, remember));
+		//     }
+		// };
+		template <typename Type>
+		Type bind();
+	private:
+		template <typename Member>
+		static void assign(Member& member, std::string_view key, std::string_view text) {
+			if constexpr (params_internal::is_optional<Member>::value)
+				member = convert<typename Member::value_type>(key, text);
+			else member = convert<Member>(key, text);
+		}
+		// sets the first field left that is named `key`
+		template <typename Type, typename Fields, std::size_t ...Idx>
+		static void bind_field(
+			Type& object, const Fields& fields, std::string_view key, std::string_view text,
+			std::array<bool, sizeof...(Idx)>& found, std::size_t& remaining,
+			std::index_sequence<Idx...>) {
+			(void)((!found[Idx] && key == std::get<Idx>(fields).name
+				&& (assign(object.*std::get<Idx>(fields).member, key, text),
+					found[Idx] = true, --remaining, true)) || ...);
+		}
+		template <typename Type, typename Fields, std::size_t ...Idx>
+		static void check_required(
+			Type& object, const Fields& fields,
+			const std::array<bool, sizeof...(Idx)>& found,
+			std::index_sequence<Idx...>) {
+			(void)((!found[Idx] && !params_internal::is_optional<
+				std::decay_t<decltype(object.*std::get<Idx>(fields).member)>>::value
+				? throw bad_request_exception{
+					"'" + std::string{ std::get<Idx>(fields).name } + "' is required." }
+				: 0), ...);
+		}
+	};
+
+	template <typename Visit>
+	void request_params::visit(Visit&& visit) {
+		index();
+		if (json_.has_value()) {
+			for (auto& kv : json_.value()) {
+				std::optional<std::string_view> text = json_value(kv.value());
+				if (!text.has_value()) continue;
+				if (!visit(std::string_view{ kv.key().data(), kv.key().size() }, text.value())) return;
+			}
+		}
+		for (auto& f : fields_) {
+			if (!visit(f.key, value(f))) return;
+		}
+	}
+
+	template <typename Type>
+	Type request_params::bind() {
+		Type object{};
+		constexpr auto fields = Type::fields();
+		constexpr std::size_t count = std::tuple_size_v<std::decay_t<decltype(fields)>>;
+		std::array<bool, count> found{};
+		std::size_t remaining = count;
+		visit([&](std::string_view key, std::string_view text) {
+			bind_field(object, fields, key, text, found, remaining,
+				std::make_index_sequence<count>{});
+			return remaining != 0;
+		});
+		check_required(object, fields, found, std::make_index_sequence<count>{});
+		return object;
+	}
+
+}  // bserv
+
+#endif  // _PARAMS_HPP
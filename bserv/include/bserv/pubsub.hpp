@@ -0,0 +1,97 @@
+#ifndef _PUBSUB_HPP
+#define _PUBSUB_HPP
+
+#include <boost/asio.hpp>
+#include <boost/json.hpp>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <cstddef>
+
+namespace bserv {
+
+	namespace asio = boost::asio;
+
+	// a message is serialized once and shared by all its subscribers
+	using shared_message = std::shared_ptr<const std::string>;
+
+	// the messages waiting to be sent to one connection.
+	// a message pushed with a key (e.g. the latest state of a topic) replaces
+	// the queued message with the same key, so a slow connection misses the
+	// intermediate updates instead of holding a backlog of them.
+	// when the queue is full, the oldest message with a key is dropped.
+	// the messages without a key are never dropped: if the queue is full
+	// of them, the subscriber is closed instead, so that the queue stays bounded.
+	class subscriber {
+	private:
+		struct entry {
+			shared_message message;
+			std::string key;
+		};
+		std::mutex lock_;
+		std::deque<entry> queue_;
+		const std::size_t capacity_;
+		std::size_t dropped_ = 0;
+		bool closed_ = false;
+		// resumes the receiver, if it is waiting
+		std::function<void()> waiter_;
+		void wait(std::function<void()>&& waiter);
+		std::vector<shared_message> take();
+	public:
+		explicit subscriber(std::size_t capacity) : capacity_{ capacity } {}
+		void push(const shared_message& message, const std::string& key = "");
+		// the pending `async_receive` completes with no messages
+		void close();
+		// the number of messages dropped or replaced
+		std::size_t dropped();
+		// takes all the queued messages, waiting for one if there is none.
+		// the completion handler has the signature `void(std::vector<shared_message>)`,
+		// the messages are empty only if the subscriber has been closed.
+		template <typename CompletionToken>
+		auto async_receive(CompletionToken&& token) {
+			return asio::async_initiate<CompletionToken, void(std::vector<shared_message>)>(
+				[this](auto handler) {
+					auto handler_ptr = std::make_shared<std::decay_t<decltype(handler)>>(std::move(handler));
+					wait([this, handler_ptr] {
+						// resumes the receiver on its own executor
+						auto executor = asio::get_associated_executor(*handler_ptr);
+						asio::post(executor, [handler_ptr, messages = take()]() mutable {
+							(*handler_ptr)(std::move(messages));
+						});
+					});
+				}, token);
+		}
+	};
+
+	// topics (e.g. a flight number, or a route) and their subscribers.
+	// the subscribers of a topic are an immutable list that is replaced
+	// when someone subscribes or leaves, so publishing only copies a pointer
+	// under a shared lock and the fan-out runs without holding it.
+	class pubsub_hub {
+	private:
+		using subscriber_list = std::vector<std::shared_ptr<subscriber>>;
+		mutable std::shared_mutex lock_;
+		std::unordered_map<std::string, std::shared_ptr<const subscriber_list>> topics_;
+	public:
+		void subscribe(const std::string& topic, const std::shared_ptr<subscriber>& sub);
+		void unsubscribe(const std::string& topic, const std::shared_ptr<subscriber>& sub);
+		// returns the number of subscribers the message is queued for.
+		// if `latest_only`, it replaces the message of `topic` a subscriber
+		// has not received yet (see `subscriber`).
+		std::size_t publish(const std::string& topic, const shared_message& message,
+			bool latest_only = false);
+		// serializes `message` only if the topic has subscribers
+		std::size_t publish(const std::string& topic, const boost::json::value& message,
+			bool latest_only = false);
+		std::size_t subscriber_count(const std::string& topic) const;
+	};
+
+}  // bserv
+
+#endif  // _PUBSUB_HPP
@@ -7,17 +7,25 @@
 #include <boost/json.hpp>
 
 #include <string>
-#include <regex>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <memory>
 #include <initializer_list>
 #include <optional>
+#include <functional>
+#include <array>
+#include <charconv>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
 
 #include <pqxx/pqxx>
 
+#include "arena.hpp"
 #include "client.hpp"
 #include "database.hpp"
+#include "params.hpp"
 #include "session.hpp"
 #include "utils.hpp"
 #include "config.hpp"
@@ -34,20 +42,37 @@ namespace bserv {
 		std::shared_ptr<db_connection_manager> db_conn_mgr;
 	};
 
+	// the url of a request followed by the captures of its route,
+	// which point into the url
+	class url_captures {
+	public:
+		static constexpr std::size_t capacity = 16;
+	private:
+		std::array<std::string_view, capacity> views_;
+		std::size_t size_ = 0;
+	public:
+		std::size_t size() const { return size_; }
+		std::string_view operator[](std::size_t i) const { return views_[i]; }
+		void push_back(std::string_view view) { views_[size_++] = view; }
+		void resize(std::size_t size) { size_ = size; }
+	};
+
 	struct request_resources {
 		server_resources& resources;
 
 		asio::io_context& ioc;
 		asio::yield_context& yield;
 		std::shared_ptr<websocket_session> ws_session;
-		const std::vector<std::string>& url_params;
+		const url_captures& url_params;
 		request_type& request;
 		response_type& response;
+		request_arena& arena;
 
 		std::shared_ptr<session_type> session_ptr;
 		std::shared_ptr<db_connection> db_connection_ptr;
 		std::shared_ptr<http_client> http_client_ptr;
 		std::shared_ptr<websocket_server> websocket_server_ptr;
+		std::optional<request_params> params;
 	};
 
 	namespace placeholders {
@@ -83,15 +108,55 @@ namespace bserv {
 		constexpr placeholder<-6> http_client_ptr;
 		// std::shared_ptr<bserv::websocket_server>
 		constexpr placeholder<-7> websocket_server_ptr;
+		// std::shared_ptr<bserv::db_connection_manager>
+		constexpr placeholder<-8> db_connection_manager_ptr;
+		// boost::asio::yield_context&, the coroutine of the request,
+		// for handlers that wait on asynchronous operations
+		constexpr placeholder<-9> yield;
+		// bserv::request_params&, the parameters parsed only when asked for
+		constexpr placeholder<-10> params;
+		// boost::json::storage_ptr, the arena of the request, for the JSON
+		// that is not kept after the response
+		constexpr placeholder<-11> json_storage;
+
+		template <typename Type>
+		struct body_placeholder {};
+
+		// Type, the body bound to a struct (see `request_params::bind`),
+		// a missing or invalid field is a bad request
+		template <typename Type>
+		constexpr body_placeholder<Type> body;
 
 	}  // placeholders
 
-	class bad_request_exception : public std::exception {
+	class url_not_found_exception : public std::exception {
+	public:
+		url_not_found_exception() = default;
+		const char* what() const noexcept { return "url not found"; }
+	};
+
+	// the url exists, but none of its routes accepts the method
+	class method_not_allowed_exception : public std::exception {
+	private:
+		const std::string allow_;
 	public:
-		bad_request_exception() = default;
-		const char* what() const noexcept { return "bad request"; }
+		explicit method_not_allowed_exception(const std::string& allow) : allow_{ allow } {}
+		const char* what() const noexcept { return "method not allowed"; }
+		// the value of the `Allow` header
+		const std::string& allow() const { return allow_; }
 	};
 
+	// the methods of a route, as a set of bits
+	using method_set = std::uint64_t;
+
+	inline constexpr method_set method_bit(http::verb method) {
+		return method_set{ 1 } << static_cast<unsigned>(method);
+	}
+
+	// a route registered without a method accepts all of them,
+	// except OPTIONS, which is answered by the router
+	constexpr method_set any_method = ~method_bit(http::verb::options);
+
 	namespace router_internal {
 
 		template <typename ...Types>
@@ -147,11 +212,33 @@ namespace bserv {
 			return static_cast<Type&&>(val);
 		}
 
+		// a capture of the url, converted to the type of the handler parameter:
+		// `std::string`, `std::string_view` or an integer (e.g. for `<int>`).
+		// a capture that is not a number in the range of the integer
+		// is a url that does not exist.
+		class url_param {
+		private:
+			std::string_view value_;
+		public:
+			explicit url_param(std::string_view value) : value_{ value } {}
+			operator std::string_view() const { return value_; }
+			operator std::string() const { return std::string{ value_ }; }
+			template <typename Int, std::enable_if_t<
+				std::is_integral_v<Int> && !std::is_same_v<Int, bool>, int> = 0>
+			operator Int() const {
+				Int number{};
+				const char* end = value_.data() + value_.size();
+				auto [ptr, ec] = std::from_chars(value_.data(), end, number);
+				if (ec != std::errc{} || ptr != end) throw url_not_found_exception{};
+				return number;
+			}
+		};
+
 		template <int N, std::enable_if_t<(N >= 0), int> = 0>
-		const std::string& get_parameter_data(
+		url_param get_parameter_data(
 			request_resources& resources,
 			placeholders::placeholder<N>) {
-			return resources.url_params[N];
+			return url_param{ resources.url_params[N] };
 		}
 
 		inline std::shared_ptr<session_type> get_parameter_data(
@@ -197,64 +284,31 @@ namespace bserv {
 			return resources.response;
 		}
 
+		inline request_params& get_parameter_data(
+			request_resources& resources,
+			placeholders::placeholder<-10>) {
+			if (!resources.params.has_value())
+				resources.params.emplace(resources.request, resources.arena);
+			return resources.params.value();
+		}
+
+		template <typename Type>
+		Type get_parameter_data(
+			request_resources& resources,
+			placeholders::body_placeholder<Type>) {
+			return get_parameter_data(resources, placeholders::params).template bind<Type>();
+		}
+
 		inline boost::json::object get_parameter_data(
 			request_resources& resources,
 			placeholders::placeholder<-4>) {
-			boost::json::object body;
-			auto add_to_body = [&body](
-				const std::map<std::string, std::string>& dict_param,
-				const std::map<std::string, std::vector<std::string>>& list_param) {
-					for (auto& [k, v] : dict_param) {
-						if (!body.contains(k)) {
-							body[k] = v;
-						}
-					}
-					for (auto& [k, vs] : list_param) {
-						if (!body.contains(k)) {
-							boost::json::array a;
-							for (auto& v : vs) {
-								a.push_back(boost::json::string{ v });
-							}
-							body[k] = a;
-						}
-					}
-			};
-			if (!resources.request.body().empty()) {
-				auto& content_type = resources.request[http::field::content_type];
-				/*
-					for reference:
-					Content-Type: text/html; charset=UTF-8
-					Content-Type: multipart/form-data; boundary=something
-				*/
-				std::string media_type;
-				for (auto& c : content_type) {
-					if (c == ' ') {
-						continue;
-					}
-					else if (c == ';') {
-						break;
-					}
-					media_type += c;
-				}
-				if (media_type == "application/json") {
-					try {
-						body = boost::json::parse(resources.request.body()).as_object();
-					}
-					catch (const std::exception& /*e*/) {
-						throw bad_request_exception{};
-					}
-				}
-				else if (media_type == "application/x-www-form-urlencoded") {
-					std::string copied_body{ resources.request.body() };
-					auto&& [dict_params, list_params] = utils::parse_params(copied_body);
-					add_to_body(dict_params, list_params);
-				}
-			}
-			std::string target{ resources.request.target() };
-			auto&& [url, dict_params, list_params] = utils::parse_url(target);
-			boost::ignore_unused(url);
-			add_to_body(dict_params, list_params);
-			return body;
+			return get_parameter_data(resources, placeholders::params).to_object();
+		}
+
+		inline boost::json::storage_ptr get_parameter_data(
+			request_resources& resources,
+			placeholders::placeholder<-11>) {
+			return resources.arena.storage();
 		}
 
 		inline std::shared_ptr<db_connection> get_parameter_data(
@@ -262,7 +316,8 @@ namespace bserv {
 			placeholders::placeholder<-5>) {
 			if (resources.db_connection_ptr == nullptr)
 				resources.db_connection_ptr =
-				resources.resources.db_conn_mgr->get_or_block();
+				resources.resources.db_conn_mgr->get_or_wait(
+					resources.ioc, resources.yield);
 			return resources.db_connection_ptr;
 		}
 
@@ -284,6 +339,18 @@ namespace bserv {
 			return resources.websocket_server_ptr;
 		}
 
+		inline std::shared_ptr<db_connection_manager> get_parameter_data(
+			request_resources& resources,
+			placeholders::placeholder<-8>) {
+			return resources.resources.db_conn_mgr;
+		}
+
+		inline asio::yield_context& get_parameter_data(
+			request_resources& resources,
+			placeholders::placeholder<-9>) {
+			return resources.yield;
+		}
+
 		template <int Idx, typename Func, typename Params, typename ...Args>
 		struct path_handler;
 
@@ -331,27 +398,65 @@ namespace bserv {
 			}
 		};
 
-		const std::vector<std::pair<std::regex, std::string>> url_regex_mapping{
-			{std::regex{"<int>"}, "([0-9]+)"},
-			{std::regex{"<str>"}, R"(([A-Za-z0-9_\.\-]+))"},
-			{std::regex{"<path>"}, R"(([A-Za-z0-9_/\.\-]+))"}
+		// a piece of a url pattern: a literal, or one of
+		// `<int>` ([0-9]+), `<str>` ([A-Za-z0-9_.-]+) and `<path>` ([A-Za-z0-9_/.-]+)
+		struct url_piece {
+			enum class kind { literal, int_param, str_param, path_param } type;
+			std::string text;
+			bool operator==(const url_piece& other) const {
+				return type == other.type && text == other.text;
+			}
 		};
 
-		inline std::string get_re_url(const std::string& url) {
-			std::string re_url = url;
-			for (auto& [r, s] : url_regex_mapping)
-				re_url = std::regex_replace(re_url, r, s);
-			return re_url;
-		}
+		using url_pattern = std::vector<url_piece>;
+
+		// the url patterns compiled into a tree of their '/'-separated segments.
+		// a segment without placeholders is looked up by its text, the others
+		// are matched piece by piece, and a segment with `<path>` matches the
+		// rest of the url together with the segments after it.
+		// a url may match several patterns, the first one inserted wins.
+		class route_tree {
+		public:
+			static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+		private:
+			struct node {
+				std::map<std::string, std::unique_ptr<node>, std::less<>> literals;
+				std::vector<std::pair<url_pattern, std::unique_ptr<node>>> patterns;
+				std::vector<std::pair<url_pattern, std::size_t>> tails;
+				// the routes ending at the node (e.g. one for each method), in order
+				std::vector<std::size_t> routes;
+				// the first route in the subtree, to skip it
+				std::size_t first = npos;
+			};
+			node root_;
+			std::vector<method_set> methods_;
+			// `pos` is where the segment to match begins, `npos` after the last one
+			void find(
+				const node& n, std::string_view url, std::size_t pos,
+				method_set methods, url_captures& captures,
+				std::size_t& best, url_captures& best_captures, method_set& allowed) const;
+		public:
+			void insert(const std::string& pattern, std::size_t route, method_set methods);
+			// returns the first route matching the url and one of `methods`,
+			// or `npos` if there is none, in which case `allowed` has the
+			// methods of the routes matching the url (none if it does not exist)
+			std::size_t match(
+				std::string_view url, method_set methods,
+				url_captures& result, method_set& allowed) const;
+		};
 
 		struct path_holder : std::enable_shared_from_this<path_holder> {
-			path_holder() = default;
+		private:
+			const std::string url_;
+		public:
+			explicit path_holder(const std::string& url) : url_{ url } {}
 			virtual ~path_holder() = default;
-			virtual bool match(
-				const std::string&,
-				std::vector<std::string>&) const = 0;
+			const std::string& url() const { return url_; }
 			virtual std::optional<boost::json::value> invoke(
 				request_resources&) = 0;
+			// whether a websocket of the path may use permessage-deflate
+			bool compress = true;
+			method_set methods = any_method;
 		};
 
 		template <typename Func, typename Params>
@@ -361,24 +466,13 @@ namespace bserv {
 		class path<Ret(*)(Args ...), parameter_pack<Params...>>
 			: public path_holder {
 		private:
-			std::regex re_;
 			Ret(*pf_)(Args ...);
 			parameter_pack<Params...> params_;
 			path_handler<0, Ret(*)(Args ...), parameter_pack<Params...>, Params...> handler_;
 		public:
 			path(const std::string& url, Ret(*pf)(Args ...), Params&& ...params)
-				: re_{ get_re_url(url) }, pf_{ pf },
+				: path_holder{ url }, pf_{ pf },
 				params_{ static_cast<Params&&>(params)... } {}
-			bool match(const std::string& url, std::vector<std::string>& result) const {
-				std::smatch r;
-				bool matched = std::regex_match(url, r, re_);
-				if (matched) {
-					result.clear();
-					for (auto& sub : r)
-						result.push_back(sub.str());
-				}
-				return matched;
-			}
 			std::optional<boost::json::value> invoke(
 				request_resources& resources) {
 				return handler_.invoke(
@@ -408,50 +502,106 @@ namespace bserv {
 			>(url, pf, static_cast<Params&&>(params)...);
 	}
 
-	class url_not_found_exception : public std::exception {
-	public:
-		url_not_found_exception() = default;
-		const char* what() const noexcept { return "url not found"; }
-	};
+	// a route for only one method, the others are rejected before
+	// any parameter (e.g. the session or a db connection) is resolved.
+	// a GET route also answers HEAD.
+	template <typename Ret, typename ...Args, typename ...Params>
+	std::shared_ptr<router_internal::path<Ret(*)(Args ...),
+		router_internal::parameter_pack<Params...>>> make_path(
+			http::verb method, const std::string& url,
+			Ret(*pf)(Args ...), Params&& ...params) {
+		auto path = make_path(url, pf, static_cast<Params&&>(params)...);
+		path->methods = method_bit(method);
+		return path;
+	}
+
+	// for the websocket routes whose messages are not worth compressing,
+	// e.g. they are already compressed or too small
+	template <typename Path>
+	std::shared_ptr<Path> without_compression(std::shared_ptr<Path> path) {
+		path->compress = false;
+		return path;
+	}
+
+	namespace router_internal {
+
+		// the `Allow` header of a url whose routes accept `methods`
+		inline std::string allow_header(method_set methods) {
+			if (methods & method_bit(http::verb::get))
+				methods |= method_bit(http::verb::head);
+			methods |= method_bit(http::verb::options);
+			std::string allow;
+			for (http::verb method : {
+				http::verb::get, http::verb::head, http::verb::post, http::verb::put,
+				http::verb::delete_, http::verb::patch, http::verb::options }) {
+				if ((methods & method_bit(method)) == 0) continue;
+				if (!allow.empty()) allow += ", ";
+				allow += std::string{ http::to_string(method) };
+			}
+			return allow;
+		}
+
+	}  // router_internal
 
 	class router {
 	private:
 		using path_holder_type = std::shared_ptr<router_internal::path_holder>;
 		std::vector<path_holder_type> paths_;
+		// compiled once, no pattern is parsed when a request comes
+		router_internal::route_tree tree_;
 		std::shared_ptr<server_resources> resources_;
 	public:
 		router(const std::initializer_list<path_holder_type>& paths)
-			: paths_{ paths } {}
+			: paths_{ paths } {
+			for (std::size_t i = 0; i < paths_.size(); ++i)
+				tree_.insert(paths_[i]->url(), i, paths_[i]->methods);
+		}
 		void set_resources(std::shared_ptr<server_resources> resources) {
 			resources_ = resources;
 		}
 		std::optional<boost::json::value> operator()(
 			asio::io_context& ioc, asio::yield_context& yield,
-			std::shared_ptr<websocket_session> ws_session,
-			const std::string& url, request_type& request, response_type& response) {
-			std::vector<std::string> url_params;
-			for (auto& ptr : paths_) {
-				if (ptr->match(url, url_params)) {
-					lgtrace << "router: received request: " << url;
-					request_resources resources{
-						*resources_,
-
-						ioc,
-						yield,
-						ws_session,
-						url_params,
-						request,
-						response,
-
-						nullptr,
-						nullptr,
-						nullptr,
-						nullptr
-					};
-					return ptr->invoke(resources);
-				}
+			std::shared_ptr<websocket_session> ws_session, request_arena& arena,
+			std::string_view url, request_type& request, response_type& response) {
+			url_captures url_params;
+			method_set methods = method_bit(request.method());
+			if (request.method() == http::verb::head)
+				methods |= method_bit(http::verb::get);
+			method_set allowed = 0;
+			std::size_t route = tree_.match(url, methods, url_params, allowed);
+			if (route == router_internal::route_tree::npos) {
+				if (allowed == 0) throw url_not_found_exception{};
+				if (request.method() != http::verb::options)
+					throw method_not_allowed_exception{ router_internal::allow_header(allowed) };
+				response.result(http::status::no_content);
+				response.set(http::field::allow, router_internal::allow_header(allowed));
+				return std::nullopt;
 			}
-			throw url_not_found_exception{};
+			lgtrace << "router: received request: " << url;
+			request_resources resources{
+				*resources_,
+
+				ioc,
+				yield,
+				ws_session,
+				url_params,
+				request,
+				response,
+				arena,
+
+				nullptr,
+				nullptr,
+				nullptr,
+				nullptr
+			};
+			return paths_[route]->invoke(resources);
+		}
+		// whether the websocket of `url` may negotiate permessage-deflate
+		bool compresses(const std::string& url) const {
+			url_captures url_params;
+			method_set allowed = 0;
+			std::size_t route = tree_.match(url, method_bit(http::verb::get), url_params, allowed);
+			return route != router_internal::route_tree::npos && paths_[route]->compress;
 		}
 	};
 
@@ -42,6 +42,7 @@ namespace bserv {
 		asio::io_context ioc_;
 		router routes_;
 		router ws_routes_;
+		const websocket_options ws_options_;
 		std::shared_ptr<session_manager_base> session_mgr_;
 		std::shared_ptr<db_connection_manager> db_conn_mgr_;
 	public:
@@ -10,6 +10,7 @@
 #include <set>
 #include <mutex>
 #include <memory>
+#include <functional>
 #include <chrono>
 #include <random>
 #include <limits>
@@ -73,6 +74,63 @@ namespace bserv {
 			std::shared_ptr<session_type>& session_ptr);
 	};
 
+	// the sessions are spread over shards by the hash of their id, and each
+	// shard has its own lock and an open-addressing hash table (linear
+	// probing) of records holding the session and its expiry, so that the
+	// requests of different sessions rarely wait on each other.
+	// an expired session is removed when it is looked up, and the others
+	// when their shard is swept, once a minute or when it is full.
+	class sharded_session_manager : public session_manager_base {
+	private:
+		using time_point = std::chrono::steady_clock::time_point;
+		// a slot is empty if its session is null
+		struct record {
+			std::string key;
+			std::size_t hash = 0;
+			std::shared_ptr<session_type> session;
+			time_point expiry;
+		};
+		// on its own cache line, the shards are locked by different threads
+		struct alignas(64) shard {
+			std::mutex lock;
+			std::vector<record> slots;
+			std::size_t size = 0;
+			time_point next_sweep;
+		};
+		static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+		std::chrono::steady_clock::duration expiry_;
+		std::size_t shard_count_;
+		// the low bits of the hash choose the shard, the others the slot
+		std::size_t shard_bits_;
+		std::unique_ptr<shard[]> shards_;
+		std::hash<std::string> hasher_;
+		shard& shard_of(std::size_t hash) {
+			return shards_[hash & (shard_count_ - 1)];
+		}
+		std::size_t slot_of(std::size_t hash, std::size_t capacity) const {
+			return (hash >> shard_bits_) & (capacity - 1);
+		}
+		std::size_t find(shard& s, const std::string& key, std::size_t hash) const;
+		void insert(shard& s, record&& r, time_point now);
+		void erase(shard& s, std::size_t index) const;
+		// rebuilds the table without the expired sessions,
+		// with at most half of the slots used
+		void resize(shard& s, time_point now) const;
+		void sweep(shard& s, time_point now) const;
+	public:
+		// `shards` is rounded up to a power of 2, a session expires
+		// if it is not visited for `expiry`
+		explicit sharded_session_manager(
+			std::size_t shards,
+			std::chrono::steady_clock::duration expiry = std::chrono::minutes{ 20 });
+		bool get_or_create(
+			std::string& key,
+			std::shared_ptr<session_type>& session_ptr);
+		bool try_get(
+			const std::string& key,
+			std::shared_ptr<session_type>& session_ptr);
+	};
+
 }  // bserv
 
 #endif  // _SESSION_HPP
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include <string>
 #include <cstddef>
 #include <cstdlib>
+#include <memory>
+#include <deque>
 
 namespace bserv {
 
@@ -35,16 +37,47 @@ namespace bserv {
 		const char* what() const noexcept { return msg_.c_str(); }
 	};
 
+	// what a session does with the messages it cannot send fast enough
+	struct websocket_options {
+		// the bytes queued for a session before it is a slow consumer
+		std::size_t high_water_mark;
+		// drops the oldest queued messages of a slow consumer, or closes it
+		bool drop_slow;
+		// offered to the routes that do not opt out (see `without_compression`)
+		websocket::permessage_deflate deflate;
+	};
+
+	struct websocket_message {
+		std::shared_ptr<const std::string> data;
+		bool binary;
+		// a queued message is replaced by a newer one with the same key
+		std::string key;
+	};
+
+	// the coroutines of a session (the handler and those it spawns)
+	// share its strand, so the state below needs no lock.
 	struct websocket_session {
 		const std::string address_;
 		asio::io_context& ioc_;
 		websocket::stream<beast::tcp_stream> ws_;
+		const websocket_options& options_;
+		// reused by all the reads
+		beast::flat_buffer read_buffer_;
+		bool got_binary_ = false;
+		// the messages waiting for the coroutine that is writing
+		std::deque<websocket_message> write_queue_;
+		std::size_t queued_bytes_ = 0;
+		bool writing_ = false;
+		beast::error_code write_error_;
+		std::size_t dropped_ = 0;
 		websocket_session(
 			const std::string& address,
 			asio::io_context& ioc,
-			tcp::socket&& socket)
+			tcp::socket&& socket,
+			const websocket_options& options)
 			: address_{ address },
-			ioc_{ ioc }, ws_{ std::move(socket) } {}
+			ioc_{ ioc }, ws_{ std::move(socket) },
+			options_{ options } {}
 	};
 
 	class websocket_server {
@@ -54,10 +87,34 @@ namespace bserv {
 	public:
 		websocket_server(websocket_session& session, asio::yield_context& yield)
 			: session_{ session }, yield_{ yield } {}
-		std::string read();
+		std::string read() { return read(yield_); }
+		// reads in another coroutine, which must have been spawned from the
+		// coroutine of the session (so that they share the strand),
+		// e.g. to wait for messages while the session writes
+		std::string read(asio::yield_context& yield);
 		boost::json::value read_json() { return boost::json::parse(read()); }
-		void write(const std::string& data);
+		// whether the last message read is a binary one
+		bool got_binary() const { return session_.got_binary_; }
+		void write(const std::string& data) { write(std::make_shared<const std::string>(data)); }
 		void write_json(const boost::json::value& val) { write(boost::json::serialize(val)); }
+		// queues the message, which may be shared with other sessions.
+		// if no coroutine of the session is writing, this one sends the queue
+		// before returning, otherwise it returns at once and the message is
+		// sent by the writer. a message with a non-empty `key` replaces the
+		// queued message with the same key, e.g. a newer state of something.
+		void write(
+			std::shared_ptr<const std::string> data,
+			bool binary = false, const std::string& key = "") {
+			write(std::move(data), yield_, binary, key);
+		}
+		void write(
+			std::shared_ptr<const std::string> data, asio::yield_context& yield,
+			bool binary = false, const std::string& key = "");
+		void write_binary(const std::string& data) {
+			write(std::make_shared<const std::string>(data), true);
+		}
+		// the messages dropped because the session was too slow
+		std::size_t dropped() const { return session_.dropped_; }
 	};
 
 }  // bserv
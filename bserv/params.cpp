@@ -0,0 +1,199 @@
+#include "pch.h"
+#include "bserv/params.hpp"
+
+#include <cstring>
+
+namespace bserv {
+
+	namespace {
+
+		// memchr is vectorized by the c library, so that the fields
+		// without escapes are found at memory speed
+		bool has_escapes(std::string_view s) {
+			return std::memchr(s.data(), '%', s.size()) != nullptr
+				|| std::memchr(s.data(), '+', s.size()) != nullptr;
+		}
+
+		std::string_view trim(std::string_view s) {
+			while (!s.empty() && s.front() == ' ') s.remove_prefix(1);
+			while (!s.empty() && s.back() == ' ') s.remove_suffix(1);
+			return s;
+		}
+
+		int hex_value(char c) {
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			return -1;
+		}
+
+		/*
+			for reference:
+			Content-Type: text/html; charset=UTF-8
+			Content-Type: multipart/form-data; boundary=something
+		*/
+		std::string_view media_type(const request_type& request) {
+			auto content_type = request[http::field::content_type];
+			std::string_view type{ content_type.data(), content_type.size() };
+			return trim(type.substr(0, type.find(';')));
+		}
+
+	}  // namespace
+
+	void request_params::index() {
+		if (indexed_) return;
+		indexed_ = true;
+		if (!request_.body().empty()) {
+			std::string_view type = media_type(request_);
+			if (type == "application/json") {
+				boost::system::error_code ec;
+				boost::json::value body = boost::json::parse(request_.body(), ec, arena_.storage());
+				if (ec || !body.is_object()) throw bad_request_exception{};
+				json_ = std::move(body.as_object());
+			}
+			else if (type == "application/x-www-form-urlencoded") {
+				index_fields(request_.body());
+			}
+		}
+		body_fields_ = fields_.size();
+		auto target = request_.target();
+		std::string_view url{ target.data(), target.size() };
+		std::size_t pos = url.find('?');
+		if (pos != std::string_view::npos) index_fields(url.substr(pos + 1));
+	}
+
+	void request_params::index_fields(std::string_view source) {
+		bool escaped = has_escapes(source);
+		while (!source.empty()) {
+			std::size_t end = source.find('&');
+			std::string_view pair = source.substr(0, end);
+			source = end == std::string_view::npos
+				? std::string_view{} : source.substr(end + 1);
+			std::size_t eq = pair.find('=');
+			std::string_view key = trim(pair.substr(0, eq));
+			std::string_view value = eq == std::string_view::npos
+				? std::string_view{} : trim(pair.substr(eq + 1));
+			if (key.empty() && value.empty()) continue;
+			// the keys are short and compared at each lookup
+			if (escaped) key = decode(key);
+			fields_.push_back({ key, value, !escaped });
+		}
+	}
+
+	std::string_view request_params::decode(std::string_view raw) {
+		if (!has_escapes(raw)) return raw;
+		// the decoded value is never longer
+		char* decoded = static_cast<char*>(arena_.memory()->allocate(raw.size(), 1));
+		std::size_t n = 0;
+		for (std::size_t i = 0; i < raw.size(); ++i) {
+			if (raw[i] == '+') decoded[n++] = ' ';
+			else if (raw[i] == '%' && i + 2 < raw.size()
+				&& hex_value(raw[i + 1]) >= 0 && hex_value(raw[i + 2]) >= 0) {
+				decoded[n++] = (char)(hex_value(raw[i + 1]) * 16 + hex_value(raw[i + 2]));
+				i += 2;
+			}
+			// a malformed escape is kept as it is
+			else decoded[n++] = raw[i];
+		}
+		return { decoded, n };
+	}
+
+	std::string_view request_params::value(field& f) {
+		if (!f.plain) {
+			f.value = decode(f.value);
+			f.plain = true;
+		}
+		return f.value;
+	}
+
+	std::optional<std::string_view> request_params::json_value(const boost::json::value& value) {
+		if (value.is_string()) {
+			const boost::json::string& s = value.as_string();
+			return std::string_view{ s.data(), s.size() };
+		}
+		if (value.is_array()) {
+			const boost::json::array& a = value.as_array();
+			if (a.empty()) return std::nullopt;
+			return json_value(a[0]);
+		}
+		if (value.is_number() || value.is_bool()) {
+			std::string text = boost::json::serialize(value);
+			char* copied = static_cast<char*>(arena_.memory()->allocate(text.size(), 1));
+			std::memcpy(copied, text.data(), text.size());
+			return std::string_view{ copied, text.size() };
+		}
+		return std::nullopt;
+	}
+
+	bool request_params::contains(std::string_view key) {
+		index();
+		if (json_.has_value() && json_->contains(key)) return true;
+		for (auto& f : fields_) {
+			if (f.key == key) return true;
+		}
+		return false;
+	}
+
+	std::optional<std::string_view> request_params::get(std::string_view key) {
+		index();
+		if (json_.has_value()) {
+			auto it = json_->find(key);
+			if (it != json_->end()) return json_value(it->value());
+		}
+		for (auto& f : fields_) {
+			if (f.key == key) return value(f);
+		}
+		return std::nullopt;
+	}
+
+	std::vector<std::string_view> request_params::get_all(std::string_view key) {
+		index();
+		std::vector<std::string_view> values;
+		if (json_.has_value()) {
+			auto it = json_->find(key);
+			if (it != json_->end()) {
+				if (it->value().is_array()) {
+					for (auto& v : it->value().as_array()) {
+						auto text = json_value(v);
+						if (text.has_value()) values.emplace_back(text.value());
+					}
+				}
+				else {
+					auto text = json_value(it->value());
+					if (text.has_value()) values.emplace_back(text.value());
+				}
+				return values;
+			}
+		}
+		for (auto& f : fields_) {
+			if (f.key == key) values.emplace_back(value(f));
+		}
+		return values;
+	}
+
+	boost::json::object request_params::to_object() {
+		index();
+		boost::json::object params{ arena_.storage() };
+		if (json_.has_value()) params = json_.value();
+		// the body goes before the query string, a key with
+		// several values in the same one is an array
+		auto add = [&](std::size_t begin, std::size_t end) {
+			boost::json::object part{ arena_.storage() };
+			for (std::size_t i = begin; i < end; ++i) {
+				field& f = fields_[i];
+				boost::json::string v{ value(f), arena_.storage() };
+				auto it = part.find(f.key);
+				if (it == part.end()) part.emplace(f.key, std::move(v));
+				else if (it->value().is_array()) it->value().as_array().emplace_back(std::move(v));
+				else it->value() = boost::json::array{ it->value(), std::move(v) };
+			}
+			for (auto& kv : part) {
+				if (!params.contains(kv.key())) params.emplace(kv.key(), std::move(kv.value()));
+			}
+		};
+		add(0, body_fields_);
+		add(body_fields_, fields_.size());
+		return params;
+	}
+
+}  // bserv
@@ -0,0 +1,134 @@
+#include "pch.h"
+#include "bserv/pubsub.hpp"
+
+#include <algorithm>
+
+namespace bserv {
+
+	void subscriber::wait(std::function<void()>&& waiter) {
+		{
+			std::lock_guard<std::mutex> lg{ lock_ };
+			if (queue_.empty() && !closed_) {
+				waiter_ = std::move(waiter);
+				return;
+			}
+		}
+		waiter();
+	}
+
+	std::vector<shared_message> subscriber::take() {
+		std::lock_guard<std::mutex> lg{ lock_ };
+		std::vector<shared_message> messages;
+		messages.reserve(queue_.size());
+		for (auto& queued : queue_) {
+			messages.emplace_back(std::move(queued.message));
+		}
+		queue_.clear();
+		return messages;
+	}
+
+	void subscriber::push(const shared_message& message, const std::string& key) {
+		std::function<void()> waiter;
+		{
+			std::lock_guard<std::mutex> lg{ lock_ };
+			if (closed_) return;
+			auto has_key = [&key](const entry& queued) { return queued.key == key; };
+			auto it = key == "" ? queue_.end()
+				: std::find_if(queue_.begin(), queue_.end(), has_key);
+			// the receiver is not waiting, as the queue is not empty
+			if (it != queue_.end()) {
+				it->message = message;
+				++dropped_;
+				return;
+			}
+			if (queue_.size() >= capacity_) {
+				it = std::find_if(queue_.begin(), queue_.end(),
+					[](const entry& queued) { return queued.key != ""; });
+				if (it != queue_.end()) {
+					queue_.erase(it);
+					++dropped_;
+				}
+				// it has fallen too far behind, as if it were `close`d
+				else {
+					dropped_ += queue_.size() + 1;
+					closed_ = true;
+					queue_.clear();
+				}
+			}
+			if (!closed_) queue_.push_back({ message, key });
+			waiter = std::move(waiter_);
+			waiter_ = nullptr;
+		}
+		if (waiter) waiter();
+	}
+
+	void subscriber::close() {
+		std::function<void()> waiter;
+		{
+			std::lock_guard<std::mutex> lg{ lock_ };
+			closed_ = true;
+			queue_.clear();
+			waiter = std::move(waiter_);
+			waiter_ = nullptr;
+		}
+		if (waiter) waiter();
+	}
+
+	std::size_t subscriber::dropped() {
+		std::lock_guard<std::mutex> lg{ lock_ };
+		return dropped_;
+	}
+
+	void pubsub_hub::subscribe(
+		const std::string& topic, const std::shared_ptr<subscriber>& sub) {
+		std::unique_lock<std::shared_mutex> lg{ lock_ };
+		auto& list = topics_[topic];
+		auto updated = list == nullptr
+			? std::make_shared<subscriber_list>()
+			: std::make_shared<subscriber_list>(*list);
+		if (std::find(updated->begin(), updated->end(), sub) != updated->end()) return;
+		updated->emplace_back(sub);
+		list = std::move(updated);
+	}
+
+	void pubsub_hub::unsubscribe(
+		const std::string& topic, const std::shared_ptr<subscriber>& sub) {
+		std::unique_lock<std::shared_mutex> lg{ lock_ };
+		auto it = topics_.find(topic);
+		if (it == topics_.end()) return;
+		auto updated = std::make_shared<subscriber_list>(*it->second);
+		updated->erase(std::remove(updated->begin(), updated->end(), sub), updated->end());
+		if (updated->empty()) topics_.erase(it);
+		else it->second = std::move(updated);
+	}
+
+	std::size_t pubsub_hub::publish(
+		const std::string& topic, const shared_message& message, bool latest_only) {
+		std::shared_ptr<const subscriber_list> list;
+		{
+			std::shared_lock<std::shared_mutex> lg{ lock_ };
+			auto it = topics_.find(topic);
+			if (it == topics_.end()) return 0;
+			list = it->second;
+		}
+		const std::string no_key;
+		for (const auto& sub : *list) {
+			sub->push(message, latest_only ? topic : no_key);
+		}
+		return list->size();
+	}
+
+	std::size_t pubsub_hub::publish(
+		const std::string& topic, const boost::json::value& message, bool latest_only) {
+		if (subscriber_count(topic) == 0) return 0;
+		return publish(topic, std::make_shared<const std::string>(
+			boost::json::serialize(message)), latest_only);
+	}
+
+	std::size_t pubsub_hub::subscriber_count(const std::string& topic) const {
+		std::shared_lock<std::shared_mutex> lg{ lock_ };
+		auto it = topics_.find(topic);
+		return it == topics_.end() ? 0 : it->second->size();
+	}
+
+}  // bserv
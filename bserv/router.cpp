@@ -0,0 +1,200 @@
+#include "pch.h"
+#include "bserv/router.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace bserv {
+
+	namespace router_internal {
+
+		namespace {
+
+			const std::vector<std::pair<std::string_view, url_piece::kind>> placeholder_kinds{
+				{"<int>", url_piece::kind::int_param},
+				{"<str>", url_piece::kind::str_param},
+				{"<path>", url_piece::kind::path_param}
+			};
+
+			void add_literal(url_pattern& pattern, std::string_view text) {
+				if (text.empty()) return;
+				if (!pattern.empty() && pattern.back().type == url_piece::kind::literal)
+					pattern.back().text += text;
+				else pattern.push_back({ url_piece::kind::literal, std::string{ text } });
+			}
+
+			// splits `pattern` into its segments, each being a list of pieces
+			std::vector<url_pattern> parse_pattern(std::string_view pattern) {
+				std::vector<url_pattern> segments(1);
+				std::size_t literal = 0;
+				std::size_t i = 0;
+				while (i < pattern.size()) {
+					if (pattern[i] == '/') {
+						add_literal(segments.back(), pattern.substr(literal, i - literal));
+						segments.emplace_back();
+						literal = ++i;
+						continue;
+					}
+					auto it = std::find_if(placeholder_kinds.begin(), placeholder_kinds.end(),
+						[&](const auto& p) { return pattern.substr(i, p.first.size()) == p.first; });
+					if (it == placeholder_kinds.end()) {
+						++i;
+						continue;
+					}
+					add_literal(segments.back(), pattern.substr(literal, i - literal));
+					segments.back().push_back({ it->second, "" });
+					i += it->first.size();
+					literal = i;
+				}
+				add_literal(segments.back(), pattern.substr(literal));
+				return segments;
+			}
+
+			bool in_class(url_piece::kind type, char c) {
+				if (c >= '0' && c <= '9') return true;
+				if (type == url_piece::kind::int_param) return false;
+				if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+					|| c == '_' || c == '.' || c == '-') return true;
+				return type == url_piece::kind::path_param && c == '/';
+			}
+
+			// the placeholders are greedy and give back characters
+			// when the rest does not match, as in a regex
+			bool match_pieces(
+				const url_pattern& pattern, std::size_t k, std::string_view text,
+				url_captures& captures) {
+				if (k == pattern.size()) return text.empty();
+				const url_piece& piece = pattern[k];
+				if (piece.type == url_piece::kind::literal) {
+					if (text.substr(0, piece.text.size()) != piece.text) return false;
+					return match_pieces(pattern, k + 1, text.substr(piece.text.size()), captures);
+				}
+				std::size_t n = 0;
+				while (n < text.size() && in_class(piece.type, text[n])) ++n;
+				for (; n > 0; --n) {
+					captures.push_back(text.substr(0, n));
+					if (match_pieces(pattern, k + 1, text.substr(n), captures)) return true;
+					captures.resize(captures.size() - 1);
+				}
+				return false;
+			}
+
+			bool is_literal(const url_pattern& segment) {
+				return segment.empty()
+					|| (segment.size() == 1 && segment[0].type == url_piece::kind::literal);
+			}
+
+			bool has_path(const url_pattern& segment) {
+				return std::any_of(segment.begin(), segment.end(),
+					[](const url_piece& p) { return p.type == url_piece::kind::path_param; });
+			}
+
+		}  // namespace
+
+		void route_tree::insert(
+			const std::string& pattern, std::size_t route, method_set methods) {
+			if (methods_.size() <= route) methods_.resize(route + 1);
+			methods_[route] = methods;
+			std::vector<url_pattern> segments = parse_pattern(pattern);
+			std::size_t placeholders = 0;
+			for (const auto& segment : segments)
+				placeholders += std::count_if(segment.begin(), segment.end(),
+					[](const url_piece& p) { return p.type != url_piece::kind::literal; });
+			// the url itself is the first one
+			if (placeholders + 1 > url_captures::capacity)
+				throw std::invalid_argument{ "too many placeholders in url: " + pattern };
+			node* n = &root_;
+			n->first = std::min(n->first, route);
+			for (std::size_t i = 0; i < segments.size(); ++i) {
+				url_pattern& segment = segments[i];
+				if (has_path(segment)) {
+					// the rest of the pattern is matched against the rest of the url
+					url_pattern tail;
+					for (std::size_t j = i; j < segments.size(); ++j) {
+						if (j != i) add_literal(tail, "/");
+						for (auto& piece : segments[j]) {
+							if (piece.type == url_piece::kind::literal) add_literal(tail, piece.text);
+							else tail.push_back(std::move(piece));
+						}
+					}
+					n->tails.emplace_back(std::move(tail), route);
+					return;
+				}
+				node* child = nullptr;
+				if (is_literal(segment)) {
+					auto& next = n->literals[segment.empty() ? "" : segment[0].text];
+					if (next == nullptr) next = std::make_unique<node>();
+					child = next.get();
+				}
+				else {
+					auto it = std::find_if(n->patterns.begin(), n->patterns.end(),
+						[&segment](const auto& p) { return p.first == segment; });
+					if (it == n->patterns.end()) {
+						n->patterns.emplace_back(std::move(segment), std::make_unique<node>());
+						it = std::prev(n->patterns.end());
+					}
+					child = it->second.get();
+				}
+				n = child;
+				n->first = std::min(n->first, route);
+			}
+			n->routes.insert(std::upper_bound(n->routes.begin(), n->routes.end(), route), route);
+		}
+
+		void route_tree::find(
+			const node& n, std::string_view url, std::size_t pos,
+			method_set methods, url_captures& captures,
+			std::size_t& best, url_captures& best_captures, method_set& allowed) const {
+			if (n.first >= best) return;
+			if (pos == std::string_view::npos) {
+				for (std::size_t route : n.routes) {
+					if (route >= best) break;
+					if (methods_[route] & methods) {
+						best = route;
+						best_captures = captures;
+						break;
+					}
+					allowed |= methods_[route];
+				}
+				return;
+			}
+			std::size_t slash = url.find('/', pos);
+			std::string_view segment = url.substr(pos, slash == std::string_view::npos ? slash : slash - pos);
+			std::size_t next = slash == std::string_view::npos ? slash : slash + 1;
+			auto it = n.literals.find(segment);
+			if (it != n.literals.end())
+				find(*it->second, url, next, methods, captures, best, best_captures, allowed);
+			std::size_t size = captures.size();
+			for (const auto& [pattern, child] : n.patterns) {
+				if (child->first >= best) continue;
+				if (match_pieces(pattern, 0, segment, captures))
+					find(*child, url, next, methods, captures, best, best_captures, allowed);
+				captures.resize(size);
+			}
+			for (const auto& [pattern, route] : n.tails) {
+				if (route >= best) continue;
+				if (match_pieces(pattern, 0, url.substr(pos), captures)) {
+					if (methods_[route] & methods) {
+						best = route;
+						best_captures = captures;
+					}
+					else allowed |= methods_[route];
+				}
+				captures.resize(size);
+			}
+		}
+
+		std::size_t route_tree::match(
+			std::string_view url, method_set methods,
+			url_captures& result, method_set& allowed) const {
+			url_captures captures;
+			captures.push_back(url);
+			std::size_t best = npos;
+			allowed = 0;
+			find(root_, url, 0, methods, captures, best, result, allowed);
+			return best;
+		}
+
+	}  // router_internal
+
+}  // bserv
@@ -81,4 +81,127 @@ namespace bserv {
         return true;
     }
 
+    namespace {
+
+        const std::chrono::minutes SWEEP_INTERVAL{ 1 };
+
+        const std::size_t INITIAL_SLOTS = 16;
+
+    }  // namespace
+
+    sharded_session_manager::sharded_session_manager(
+        std::size_t shards, std::chrono::steady_clock::duration expiry)
+        : expiry_{ expiry }, shard_count_{ 1 }, shard_bits_{ 0 } {
+        while (shard_count_ < shards) {
+            shard_count_ *= 2;
+            ++shard_bits_;
+        }
+        shards_.reset(new shard[shard_count_]);
+    }
+
+    std::size_t sharded_session_manager::find(
+        shard& s, const std::string& key, std::size_t hash) const {
+        std::size_t capacity = s.slots.size();
+        if (capacity == 0) return npos;
+        // there is always an empty slot to stop at
+        for (std::size_t i = slot_of(hash, capacity);; i = (i + 1) & (capacity - 1)) {
+            const record& r = s.slots[i];
+            if (r.session == nullptr) return npos;
+            if (r.hash == hash && r.key == key) return i;
+        }
+    }
+
+    void sharded_session_manager::insert(shard& s, record&& r, time_point now) {
+        if ((s.size + 1) * 2 > s.slots.size()) resize(s, now);
+        std::size_t capacity = s.slots.size();
+        std::size_t i = slot_of(r.hash, capacity);
+        while (s.slots[i].session != nullptr) i = (i + 1) & (capacity - 1);
+        s.slots[i] = std::move(r);
+        ++s.size;
+    }
+
+    void sharded_session_manager::erase(shard& s, std::size_t index) const {
+        std::size_t capacity = s.slots.size();
+        // shifts the records after the hole back, so that no record
+        // is separated from its home slot by an empty one
+        std::size_t hole = index;
+        for (std::size_t i = (hole + 1) & (capacity - 1);
+            s.slots[i].session != nullptr; i = (i + 1) & (capacity - 1)) {
+            std::size_t home = slot_of(s.slots[i].hash, capacity);
+            // whether the hole lies between the home and the record
+            if (((i - home) & (capacity - 1)) >= ((i - hole) & (capacity - 1))) {
+                s.slots[hole] = std::move(s.slots[i]);
+                hole = i;
+            }
+        }
+        s.slots[hole] = record{};
+        --s.size;
+    }
+
+    void sharded_session_manager::resize(shard& s, time_point now) const {
+        std::size_t live = 0;
+        for (const auto& r : s.slots) {
+            if (r.session != nullptr && r.expiry >= now) ++live;
+        }
+        std::size_t capacity = INITIAL_SLOTS;
+        while ((live + 1) * 2 > capacity) capacity *= 2;
+        std::vector<record> slots(capacity);
+        for (auto& r : s.slots) {
+            if (r.session == nullptr || r.expiry < now) continue;
+            std::size_t i = slot_of(r.hash, capacity);
+            while (slots[i].session != nullptr) i = (i + 1) & (capacity - 1);
+            slots[i] = std::move(r);
+        }
+        s.slots = std::move(slots);
+        s.size = live;
+    }
+
+    void sharded_session_manager::sweep(shard& s, time_point now) const {
+        if (now < s.next_sweep) return;
+        s.next_sweep = now + SWEEP_INTERVAL;
+        if (s.size != 0) resize(s, now);
+    }
+
+    bool sharded_session_manager::get_or_create(
+        std::string& key,
+        std::shared_ptr<session_type>& session_ptr) {
+        if (try_get(key, session_ptr)) return false;
+        // nothing is held while the key and the session are made
+        auto session = std::make_shared<session_type>();
+        while (true) {
+            std::string new_key = utils::generate_random_string(32);
+            std::size_t hash = hasher_(new_key);
+            shard& s = shard_of(hash);
+            std::lock_guard<std::mutex> lg{ s.lock };
+            if (find(s, new_key, hash) != npos) continue;
+            time_point now = std::chrono::steady_clock::now();
+            insert(s, record{ new_key, hash, session, now + expiry_ }, now);
+            key = std::move(new_key);
+            session_ptr = std::move(session);
+            return true;
+        }
+    }
+
+    bool sharded_session_manager::try_get(
+        const std::string& key,
+        std::shared_ptr<session_type>& session_ptr) {
+        if (key.empty()) return false;
+        std::size_t hash = hasher_(key);
+        shard& s = shard_of(hash);
+        std::lock_guard<std::mutex> lg{ s.lock };
+        time_point now = std::chrono::steady_clock::now();
+        sweep(s, now);
+        std::size_t index = find(s, key, hash);
+        if (index == npos) return false;
+        record& r = s.slots[index];
+        if (r.expiry < now) {
+            erase(s, index);
+            return false;
+        }
+        // the expiry is extended at each visit
+        r.expiry = now + expiry_;
+        session_ptr = r.session;
+        return true;
+    }
+
 }  // bserv
\ No newline at end of file
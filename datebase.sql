@@ -21,10 +21,27 @@ CREATE TABLE flightinfo (
     airline character varying(255) NOT NULL,
     price int NOT NULL,
     total_seat int,
-    available_seat int
+    available_seat int CHECK (available_seat >= 0)
 );
 
 CREATE TABLE orders (
     username character varying(255) NOT NULL,
-    flight_number character varying(255) NOT NULL
-);
\ No newline at end of file
+    flight_number character varying(255) NOT NULL,
+    seats int NOT NULL DEFAULT 1 CHECK (seats > 0),
+    UNIQUE (username, flight_number)
+);
+
+CREATE TABLE waitlist (
+    id serial PRIMARY KEY,
+    username character varying(255) NOT NULL,
+    flight_number character varying(255) NOT NULL,
+    UNIQUE (username, flight_number)
+);
+
+CREATE INDEX flightinfo_dept_time_id ON flightinfo (dept_time, id);
+
+CREATE INDEX flightinfo_route ON flightinfo (departure, destination, dept_time, id);
+
+CREATE INDEX auth_user_superuser_id ON auth_user ((NOT is_superuser), id);
+
+CREATE INDEX waitlist_flight_id ON waitlist (flight_number, id);
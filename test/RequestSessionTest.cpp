@@ -1,4 +1,6 @@
 ﻿#include <iostream>
+#include <thread>
+#include <vector>
 #include <bserv/common.hpp>
 #include <boost/json.hpp>
 boost::json::object hello() {
@@ -37,8 +39,111 @@ boost::json::object get(
 		{"val", 0}
 	};
 }
+// the routes are tried in the order they are given
+boost::json::object route_int(int id) {
+	return {
+		{"id", "route_int"},
+		{"val", id}
+	};
+}
+boost::json::object route_str(
+	const std::string& id) {
+	return {
+		{"id", "route_str"},
+		{"str", id}
+	};
+}
+// never reached, "/route/<str>" comes first
+boost::json::object route_literal() {
+	return {
+		{"id", "route_literal"}
+	};
+}
+boost::json::object file_json(
+	const std::string& path) {
+	return {
+		{"id", "file_json"},
+		{"path", path}
+	};
+}
+boost::json::object file(
+	const std::string& path) {
+	return {
+		{"id", "file"},
+		{"path", path}
+	};
+}
+boost::json::object post_only(
+	std::shared_ptr<bserv::session_type> session_ptr) {
+	bserv::session_type& session = *session_ptr;
+	return {
+		{"id", "post_only"},
+		{"val", session.count("count") ? session["count"].as_int64() : 0}
+	};
+}
+// the parameters as they are parsed, the body first
+boost::json::object params_echo(
+	bserv::request_params& params) {
+	return {
+		{"id", "params"},
+		{"obj", params.to_object()}
+	};
+}
+boost::json::object number(
+	bserv::request_params& params) {
+	return {
+		{"id", "number"},
+		{"val", params.required<int>("n")}
+	};
+}
+// the expiry of the sessions is too long to be waited for
+// through the server, so the table is checked on its own
+void session_test() {
+	const std::size_t count = 100;
+	bserv::sharded_session_manager manager{ 1, std::chrono::seconds{ 2 } };
+	auto create = [&](std::vector<std::string>& keys,
+		std::vector<std::shared_ptr<bserv::session_type>>& sessions) {
+		for (std::size_t i = 0; i < count; ++i) {
+			std::string key;
+			std::shared_ptr<bserv::session_type> session_ptr;
+			manager.get_or_create(key, session_ptr);
+			(*session_ptr)["i"] = i;
+			keys.push_back(key);
+			sessions.push_back(session_ptr);
+		}
+	};
+	auto found = [&](const std::vector<std::string>& keys,
+		const std::vector<std::shared_ptr<bserv::session_type>>& sessions) {
+		std::size_t n = 0;
+		for (std::size_t i = 0; i < keys.size(); ++i) {
+			std::shared_ptr<bserv::session_type> session_ptr;
+			if (manager.try_get(keys[i], session_ptr) && session_ptr == sessions[i]) ++n;
+		}
+		return n;
+	};
+	bool ok = true;
+	std::vector<std::string> old_keys, new_keys;
+	std::vector<std::shared_ptr<bserv::session_type>> old_sessions, new_sessions;
+	create(old_keys, old_sessions);
+	// a session is reused as long as it is visited
+	if (found(old_keys, old_sessions) != count) ok = false;
+	std::this_thread::sleep_for(std::chrono::seconds{ 1 });
+	create(new_keys, new_sessions);
+	std::this_thread::sleep_for(std::chrono::milliseconds{ 1500 });
+	// the old sessions have expired and are erased one by one,
+	// the new ones shifted back over them must still be found
+	if (found(old_keys, old_sessions) != 0) ok = false;
+	if (found(new_keys, new_sessions) != count) ok = false;
+	// an expired key is given a new session
+	std::string key = old_keys[0];
+	std::shared_ptr<bserv::session_type> session_ptr;
+	if (!manager.get_or_create(key, session_ptr)
+		|| key == old_keys[0] || session_ptr->count("i")) ok = false;
+	std::cout << (ok ? "session test: ok" : "session test: failed") << std::endl;
+}
 int main()
 {
+	session_test();
 	bserv::server{
 		bserv::server_config{},
 		{
@@ -49,7 +154,22 @@ int main()
 			bserv::make_path("/echo/<str>", &echo2,
 				bserv::placeholders::_1),
 			bserv::make_path("/get", &get,
-				bserv::placeholders::session)
+				bserv::placeholders::session),
+			bserv::make_path("/route/<int>", &route_int,
+				bserv::placeholders::_1),
+			bserv::make_path("/route/<str>", &route_str,
+				bserv::placeholders::_1),
+			bserv::make_path("/route/literal", &route_literal),
+			bserv::make_path("/files/<path>.json", &file_json,
+				bserv::placeholders::_1),
+			bserv::make_path("/files/<path>", &file,
+				bserv::placeholders::_1),
+			bserv::make_path(boost::beast::http::verb::post, "/post", &post_only,
+				bserv::placeholders::session),
+			bserv::make_path("/params", &params_echo,
+				bserv::placeholders::params),
+			bserv::make_path("/number", &number,
+				bserv::placeholders::params)
 		}
 	};
 }
\ No newline at end of file
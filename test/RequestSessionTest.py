@@ -1,6 +1,8 @@
 import uuid
 import requests
 import random
+import json
+import http.client
 from multiprocessing import Process
 from time import time
 from pprint import pprint
@@ -16,6 +18,119 @@ def size_test():
         print("size test: ok")
     print()
 
+def raw(method, target, body=None, headers={}):
+    # the target is sent as it is, `requests` would re-quote it
+    conn = http.client.HTTPConnection("localhost", 8080)
+    conn.request(method, target, body=body, headers=headers)
+    res = conn.getresponse()
+    data = res.read()
+    conn.close()
+    return res, data
+
+def route_test():
+    ok = True
+    expected = {
+        # the routes are tried in the order they are given
+        "/route/12": {"id": "route_int", "val": 12},
+        "/route/abc": {"id": "route_str", "str": "abc"},
+        "/route/literal": {"id": "route_str", "str": "literal"},
+        "/echo/abc": {"id": "echo2", "str": "abc"},
+        # a tail gives back what the rest of the pattern needs
+        "/files/a/b/c.txt": {"id": "file", "path": "a/b/c.txt"},
+        "/files/a/b.json": {"id": "file_json", "path": "a/b"},
+        "/files/b.json": {"id": "file_json", "path": "b"},
+    }
+    for target, obj in expected.items():
+        res = requests.get(f"http://localhost:8080{target}")
+        if res.status_code != 200 or res.json() != obj:
+            print(f"route test: {target} failed")
+            ok = False
+    # out of the range of the integer, a tail that is empty,
+    # a character out of the class of the placeholder
+    for target in ["/route/99999999999", "/files/", "/route/a%20b", "/nowhere"]:
+        if requests.get(f"http://localhost:8080{target}").status_code != 404:
+            print(f"route test: {target} failed")
+            ok = False
+    print("route test: ok" if ok else "route test: failed")
+
+def method_test():
+    ok = True
+    # rejected before the session is resolved
+    res, _ = raw("GET", "/post")
+    if res.status != 405 or res.getheader("Allow") != "POST, OPTIONS" \
+            or res.getheader("Set-Cookie") is not None:
+        ok = False
+    res, data = raw("OPTIONS", "/post")
+    if res.status != 204 or res.getheader("Allow") != "POST, OPTIONS" or data:
+        ok = False
+    res, _ = raw("POST", "/post")
+    if res.status != 200:
+        ok = False
+    res, data = raw("OPTIONS", "/hello")
+    if res.status != 204 or "GET, HEAD" not in res.getheader("Allow", ""):
+        ok = False
+    res, data = raw("OPTIONS", "/nowhere")
+    if res.status != 404:
+        ok = False
+    # the GET route, without the body
+    body = requests.get("http://localhost:8080/hello").content
+    res, data = raw("HEAD", "/hello")
+    if res.status != 200 or data \
+            or res.getheader("Content-Length") != str(len(body)):
+        ok = False
+    print("method test: ok" if ok else "method test: failed")
+
+def params_test():
+    ok = True
+    form = {"Content-Type": "application/x-www-form-urlencoded"}
+    cases = [
+        # `%xx` and `+`, a malformed escape is kept as it is
+        (("GET", "/params?a=x%20y+z&b=%zz&c=50%25&d=1%2&e=%&x%5B%5D=1"),
+         {"a": "x y z", "b": "%zz", "c": "50%", "d": "1%2", "e": "%", "x[]": "1"}),
+        (("GET", "/params?k=1&k=2"), {"k": ["1", "2"]}),
+        # the body goes before the query string
+        (("POST", "/params?a=query&q=1", "a=body&b=%41", form),
+         {"a": "body", "b": "A", "q": "1"}),
+        (("POST", "/params?a=query&q=1", '{"a": "json"}',
+          {"Content-Type": "application/json"}),
+         {"a": "json", "q": "1"}),
+    ]
+    for args, obj in cases:
+        res, data = raw(*args)
+        if res.status != 200 or json.loads(data) != {"id": "params", "obj": obj}:
+            print(f"params test: {args[1]} failed")
+            ok = False
+    res, data = raw("GET", "/number?n=%31%32")
+    if res.status != 200 or json.loads(data) != {"id": "number", "val": 12}:
+        ok = False
+    for target in ["/number?n=1x", "/number?n=", "/number"]:
+        res, _ = raw("GET", target)
+        if res.status != 400:
+            print(f"params test: {target} failed")
+            ok = False
+    res, _ = raw("POST", "/params", "{", {"Content-Type": "application/json"})
+    if res.status != 400:
+        ok = False
+    print("params test: ok" if ok else "params test: failed")
+
+def session_test():
+    ok = True
+    session = requests.session()
+    session.post("http://localhost:8080/echo", json={})
+    # the session is reused for its cookie
+    if {"id": "get", "val": 1} \
+            != session.get("http://localhost:8080/get").json():
+        ok = False
+    # an unknown session id is given a new session
+    res = requests.get("http://localhost:8080/get",
+                       cookies={"bsessionid": "x" * 32})
+    if {"id": "get", "val": 0} != res.json() \
+            or "bsessionid=" not in res.headers.get("Set-Cookie", "") \
+            or res.cookies.get("bsessionid") == "x" * 32:
+        ok = False
+    print("session test: ok" if ok else "session test: failed")
+    print()
+
 P = 200  # number of concurrent processes
 N = 20  # for each process, the number of posts
 
@@ -47,6 +162,10 @@ def test():
 
 if __name__ == '__main__':
     size_test()
+    route_test()
+    method_test()
+    params_test()
+    session_test()
 
     processes = [Process(target=test) for _ in range(P)]
 
@@ -1,5 +1,9 @@
 import uuid
 
+import json
+
+import http.client
+
 import requests
 
 from multiprocessing import Process
@@ -19,6 +23,62 @@ def size_test():
         print("size test: ok")
     print()
 
+def raw(method, target, body=None, headers={}):
+    # the target is sent as it is, `requests` would re-quote it
+    conn = http.client.HTTPConnection("localhost", 8080)
+    conn.request(method, target, body=body, headers=headers)
+    res = conn.getresponse()
+    data = res.read()
+    conn.close()
+    return res, data
+
+def method_test():
+    ok = True
+    for target in ["/register", "/login", "/update_user_info"]:
+        res, _ = raw("GET", target)
+        if res.status != 405 or res.getheader("Allow") != "POST, OPTIONS":
+            print(f"method test: GET {target} failed")
+            ok = False
+        res, data = raw("OPTIONS", target)
+        if res.status != 204 or res.getheader("Allow") != "POST, OPTIONS" or data:
+            print(f"method test: OPTIONS {target} failed")
+            ok = False
+    res, _ = raw("OPTIONS", "/nowhere")
+    if res.status != 404:
+        ok = False
+    body = requests.get("http://localhost:8080/hello").content
+    res, data = raw("HEAD", "/hello")
+    if res.status != 200 or data \
+            or res.getheader("Content-Length") != str(len(body)):
+        ok = False
+    print("method test: ok" if ok else "method test: failed")
+
+def params_test():
+    ok = True
+    form = {"Content-Type": "application/x-www-form-urlencoded"}
+    cases = [
+        # `%xx` and `+`, a malformed escape is kept as it is
+        (("GET", "/echo?a=x%20y+z&b=%zz&c=50%25&d=1%2&e=%"),
+         {"a": "x y z", "b": "%zz", "c": "50%", "d": "1%2", "e": "%"}),
+        (("POST", "/echo", "k=1&k=%32", form), {"k": ["1", "2"]}),
+        # the body goes before the query string
+        (("POST", "/echo?a=query&q=1", "a=body&b=%41", form),
+         {"a": "body", "b": "A", "q": "1"}),
+        (("POST", "/echo?a=query&q=1", '{"a": "json"}',
+          {"Content-Type": "application/json"}),
+         {"a": "json", "q": "1"}),
+    ]
+    for args, obj in cases:
+        res, data = raw(*args)
+        if res.status != 200 or json.loads(data) != {"echo": obj}:
+            print(f"params test: {args[0]} {args[1]} failed")
+            ok = False
+    res, _ = raw("POST", "/echo", "{", {"Content-Type": "application/json"})
+    if res.status != 400:
+        ok = False
+    print("params test: ok" if ok else "params test: failed")
+    print()
+
 P = 100  # number of concurrent processes
 N = 5  # for each process, the number of sessions
 R = 10  # for each session, the number of posts
@@ -38,6 +98,8 @@ def test(i):
 
 if __name__ == '__main__':
     size_test()
+    method_test()
+    params_test()
     # exit()
 
     processes = [Process(target=test, args=(i, )) for i in range(P)]